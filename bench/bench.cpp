@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <filesystem>
+
+#include "bench.h"
+#include "../src/desbitslice.h"
+#include "../src/keystore.h"
+
+namespace fs = std::filesystem;
+
+// Measurements stop after this long once the minimum iterations are done.
+#define BENCH_MIN_TIME 0.5
+#define BENCH_MIN_ITERATIONS 3
+#define BENCH_MAX_ITERATIONS 10000
+
+bool BenchSelected(const BenchOptions& options, const std::string& name)
+{
+	return options.Filter.empty() || name.find(options.Filter) != std::string::npos;
+}
+
+void BenchReport(const BenchResult& result)
+{
+	printf("{\"name\":\"%s\",\"layout\":\"%s\",\"keys\":%d,\"threads\":%u,\"bytes\":%zu,\"iterations\":%zu,"
+		"\"min_us\":%.1f,\"mean_us\":%.1f,\"mib_per_s\":%.1f,\"status\":\"%s\"}\n",
+		result.Name.c_str(), result.Layout.c_str(), result.Keys, result.Threads, result.Bytes, result.Iterations,
+		result.MinSeconds * 1e6, result.MeanSeconds * 1e6,
+		result.MinSeconds > 0 ? result.Bytes / 1048576.0 / result.MinSeconds : 0.0,
+		result.Status.c_str());
+	fflush(stdout);
+}
+
+BenchResult BenchMeasure(const std::string& name, size_t bytes, const std::function<int()>& fn)
+{
+	BenchResult result = { name, "", 0, 1, bytes, 0, 0, 0, "ok" };
+
+	double total = 0;
+	while (result.Iterations < BENCH_MAX_ITERATIONS &&
+		(result.Iterations < BENCH_MIN_ITERATIONS || total < BENCH_MIN_TIME))
+	{
+		auto start = std::chrono::steady_clock::now();
+		int ret = fn();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (ret != 0)
+		{
+			result.Status = "error " + std::to_string(ret);
+			break;
+		}
+
+		if (result.Iterations == 0 || elapsed < result.MinSeconds)
+			result.MinSeconds = elapsed;
+		total += elapsed;
+		result.Iterations++;
+	}
+
+	if (result.Iterations > 0)
+		result.MeanSeconds = total / result.Iterations;
+
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	options.Size = 16 << 20;
+	options.Tool = (fs::path(argv[0]).parent_path() / "kelftool.elf").string();
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp("--size", argv[i]) == 0 && i + 1 < argc)
+			options.Size = (size_t)atof(argv[++i]) * 1048576;
+		else if (strcmp("--tool", argv[i]) == 0 && i + 1 < argc)
+			options.Tool = argv[++i];
+		else if (strcmp("--filter", argv[i]) == 0 && i + 1 < argc)
+			options.Filter = argv[++i];
+		else
+		{
+			fprintf(stderr, "usage: %s [--size MiB] [--tool kelftool] [--filter name]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (options.Size < 0x10000)
+		options.Size = 0x10000;
+
+	char work[] = "/tmp/kelftool-bench-XXXXXX";
+	if (mkdtemp(work) == NULL)
+	{
+		fprintf(stderr, "Failed to create work directory\n");
+		return -1;
+	}
+	options.WorkDir = work;
+
+	// The engines are switched around for the comparisons, the rest of the
+	// benchmarks run on the default one.
+	std::string engine = DesBitslice::GetEngineName();
+	int failures = RunDesKats();
+	RunDesBench(options);
+	DesBitslice::SetEngine(engine.c_str());
+
+	std::string keys = options.WorkDir + "/PS2KEYS.dat";
+	KeyStore ks;
+	int ret = WriteTestKeyStore(keys);
+	if (ret == 0)
+		ret = ks.Load(keys);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to set up test keystore: %d\n", ret);
+		fs::remove_all(options.WorkDir);
+		return -1;
+	}
+
+	CryptoContext ctx(ks);
+	failures += RunKelfBench(options, ctx);
+
+	fs::remove_all(options.WorkDir);
+
+	if (failures)
+		fprintf(stderr, "%d check(s) failed\n", failures);
+	return failures ? 1 : 0;
+}
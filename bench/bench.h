@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../src/crypto.h"
+
+struct BenchOptions
+{
+	size_t Size;         // content bytes of the generated files
+	std::string Tool;    // kelftool binary for the CLI runs
+	std::string Filter;  // only run benchmarks whose name contains this
+	std::string WorkDir; // scratch directory holding keys and files
+};
+
+// One result, printed as a JSON object per line so runs can be diffed.
+struct BenchResult
+{
+	std::string Name;
+	std::string Layout;
+	int Keys;
+	unsigned Threads;
+	size_t Bytes;
+	size_t Iterations;
+	double MinSeconds;
+	double MeanSeconds;
+	std::string Status;
+};
+
+bool BenchSelected(const BenchOptions& options, const std::string& name);
+void BenchReport(const BenchResult& result);
+
+// Runs fn until at least a few iterations and a minimum time have passed.
+// fn returns 0 on success, the first failure ends the measurement.
+BenchResult BenchMeasure(const std::string& name, size_t bytes, const std::function<int()>& fn);
+
+// generator.cpp
+struct BlockSpec
+{
+	uint32_t Size;
+	uint32_t Flags;
+};
+
+int WriteTestKeyStore(const std::string& filename);
+int GenerateKelf(const CryptoContext& ctx, const std::vector<BlockSpec>& blocks, int keycount, const std::string& filename, std::string* plain);
+
+// des.cpp
+int RunDesKats();
+void RunDesBench(const BenchOptions& options);
+
+// kelf.cpp
+int RunKelfBench(const BenchOptions& options, const CryptoContext& ctx);
+
+#endif
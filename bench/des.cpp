@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "bench.h"
+#include "../src/desbitslice.h"
+
+static const char* ENGINES[] = { "avx512", "avx2", "scalar" };
+
+static std::mt19937_64 rng(0x4B454C46);
+
+static void Fill(uint8_t* data, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		data[i] = (uint8_t)rng();
+}
+
+static void Reference(uint8_t* result, const uint8_t* data, size_t length, const DesKey& key, const uint8_t* iv)
+{
+	DesBitslice::SetEngine("openssl");
+	TdesCbcCfb64Decrypt(result, data, length, key, iv);
+}
+
+// Known answer from FIPS 81 style single DES vector plus random comparisons
+// of every engine against OpenSSL.
+int RunDesKats()
+{
+	int failures = 0;
+
+	static const uint8_t katKey[8] = { 0x13, 0x34, 0x57, 0x79, 0x9B, 0xBC, 0xDF, 0xF1 };
+	static const uint8_t katPlain[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+	static const uint8_t katCipher[8] = { 0x85, 0xE8, 0x13, 0x54, 0x0F, 0x0A, 0xB4, 0x05 };
+
+	for (const char* name : ENGINES)
+	{
+		BenchResult result = { "des-kat", name, 0, 1, 0, 0, 0, 0, "ok" };
+		if (!DesBitslice::SetEngine(name))
+		{
+			result.Status = "unsupported";
+			BenchReport(result);
+			continue;
+		}
+
+		int engineFailures = 0;
+		size_t lanes = DesBitslice::GetLanes();
+
+		// The fixed vector repeated over a whole pass, ECB through a null IV
+		// and ciphertext chaining undone by hand.
+		{
+			DesKey key(katKey, 1);
+			std::vector<uint8_t> cipher(lanes * 8);
+			std::vector<uint8_t> plain(lanes * 8);
+			for (size_t i = 0; i < lanes; i++)
+				memcpy(&cipher[i * 8], katCipher, 8);
+			DesBitslice::CbcDecrypt(plain.data(), cipher.data(), cipher.size(), key, MG_IV_NULL);
+			for (size_t i = 0; i < lanes; i++)
+			{
+				uint8_t block[8];
+				memcpy(block, &plain[i * 8], 8);
+				if (i != 0)
+					for (int j = 0; j < 8; j++)
+						block[j] ^= katCipher[j];
+				if (memcmp(block, katPlain, 8) != 0)
+				{
+					engineFailures++;
+					break;
+				}
+			}
+		}
+
+		for (int keycount = 1; keycount <= 3; keycount++)
+		{
+			for (size_t passes = 1; passes <= 3; passes++)
+			{
+				uint8_t raw[24];
+				uint8_t iv[8];
+				Fill(raw, sizeof(raw));
+				Fill(iv, sizeof(iv));
+				DesKey key(raw, keycount);
+
+				size_t length = passes * lanes * 8;
+				std::vector<uint8_t> cipher(length);
+				std::vector<uint8_t> expected(length);
+				std::vector<uint8_t> actual(length);
+				Fill(cipher.data(), length);
+
+				Reference(expected.data(), cipher.data(), length, key, iv);
+				DesBitslice::SetEngine(name);
+
+				DesBitslice::CbcDecrypt(actual.data(), cipher.data(), length, key, iv);
+				if (actual != expected)
+					engineFailures++;
+
+				actual = cipher;
+				DesBitslice::CbcDecrypt(actual.data(), actual.data(), length, key, iv);
+				if (actual != expected)
+					engineFailures++;
+
+				// Mixed path through TdesCbcCfb64Decrypt with an OpenSSL head.
+				std::vector<uint8_t> longer(length + 8 * 5);
+				std::vector<uint8_t> longerExpected(longer.size());
+				Fill(longer.data(), longer.size());
+				Reference(longerExpected.data(), longer.data(), longer.size(), key, iv);
+				DesBitslice::SetEngine(name);
+				TdesCbcCfb64Decrypt(longer.data(), longer.data(), longer.size(), key, iv);
+				if (longer != longerExpected)
+					engineFailures++;
+			}
+
+			// CBC-MACs of messages with differing lengths, including a
+			// partial batch.
+			uint8_t raw[24];
+			Fill(raw, sizeof(raw));
+			DesKey key(raw, keycount);
+
+			size_t count = lanes + lanes / 2 + 3;
+			std::vector<std::vector<uint8_t>> messages(count);
+			std::vector<const uint8_t*> data(count);
+			std::vector<size_t> lengths(count);
+			for (size_t i = 0; i < count; i++)
+			{
+				messages[i].resize(8 * (1 + rng() % 40));
+				Fill(messages[i].data(), messages[i].size());
+				data[i] = messages[i].data();
+				lengths[i] = messages[i].size();
+			}
+
+			std::vector<uint8_t> macs(count * 8);
+			DesBitslice::CbcMac(count, data.data(), lengths.data(), key, (uint8_t (*)[8])macs.data());
+
+			for (size_t i = 0; i < count; i++)
+			{
+				std::vector<uint8_t> enc(lengths[i]);
+				TdesCbcCfb64Encrypt(enc.data(), data[i], lengths[i], key, MG_IV_NULL);
+				if (memcmp(&enc[lengths[i] - 8], &macs[i * 8], 8) != 0)
+				{
+					engineFailures++;
+					break;
+				}
+			}
+		}
+
+		if (engineFailures)
+			result.Status = "failed";
+		BenchReport(result);
+		failures += engineFailures;
+	}
+
+	return failures;
+}
+
+void RunDesBench(const BenchOptions& options)
+{
+	const size_t length = options.Size & ~(size_t)7;
+	std::vector<uint8_t> buffer(length);
+	Fill(buffer.data(), length);
+
+	uint8_t raw[24];
+	Fill(raw, sizeof(raw));
+
+	const char* names[] = { "openssl", "avx512", "avx2", "scalar" };
+	for (const char* name : names)
+	{
+		if (!DesBitslice::SetEngine(name))
+			continue;
+
+		for (int keycount = 1; keycount <= 3; keycount++)
+		{
+			DesKey key(raw, keycount);
+
+			if (BenchSelected(options, "des-cbc-decrypt"))
+			{
+				BenchResult result = BenchMeasure("des-cbc-decrypt", length, [&] {
+					return TdesCbcCfb64Decrypt(buffer.data(), buffer.data(), length, key, MG_IV_NULL);
+				});
+				result.Layout = name;
+				result.Keys = keycount;
+				BenchReport(result);
+			}
+
+			// 256 equally sized messages, like a bit table full of plain
+			// signed blocks.
+			if (BenchSelected(options, "des-cbc-mac"))
+			{
+				const size_t count = 256;
+				const size_t each = length / count & ~(size_t)7;
+				std::vector<const uint8_t*> data(count);
+				std::vector<size_t> lengths(count, each);
+				for (size_t i = 0; i < count; i++)
+					data[i] = buffer.data() + i * each;
+				std::vector<uint8_t> macs(count * 8);
+				std::vector<uint8_t> enc(each);
+
+				BenchResult result = BenchMeasure("des-cbc-mac", each * count, [&] {
+					if (strcmp(name, "openssl") == 0)
+					{
+						for (size_t i = 0; i < count; i++)
+							TdesCbcCfb64Encrypt(enc.data(), data[i], lengths[i], key, MG_IV_NULL);
+					}
+					else
+						DesBitslice::CbcMac(count, data.data(), lengths.data(), key, (uint8_t (*)[8])macs.data());
+					return 0;
+				});
+				result.Layout = name;
+				result.Keys = keycount;
+				BenchReport(result);
+			}
+		}
+	}
+}
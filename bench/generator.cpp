@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <random>
+
+#include "bench.h"
+#include "../src/kelf.h"
+#include "../src/signer.h"
+
+static std::mt19937_64 rng(0x42454E43);
+
+static void Fill(uint8_t* data, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		data[i] = (uint8_t)rng();
+}
+
+int WriteTestKeyStore(const std::string& filename)
+{
+	static const struct
+	{
+		const char* Name;
+		size_t Size;
+	} KEYS[] = {
+		{ "MG_SIG_MASTER_KEY", 8 },
+		{ "MG_SIG_HASH_KEY", 8 },
+		{ "MG_KBIT_MASTER_KEY", 16 },
+		{ "MG_KBIT_IV", 8 },
+		{ "MG_KC_MASTER_KEY", 16 },
+		{ "MG_KC_IV", 8 },
+		{ "MG_ROOTSIG_MASTER_KEY", 8 },
+		{ "MG_ROOTSIG_HASH_KEY", 16 },
+		{ "MG_CONTENT_TABLE_IV", 8 },
+		{ "MG_CONTENT_IV", 8 },
+	};
+
+	FILE* f = fopen(filename.c_str(), "w");
+	if (f == NULL)
+		return -1;
+
+	for (const auto& key : KEYS)
+	{
+		uint8_t value[16];
+		Fill(value, key.Size);
+
+		fprintf(f, "%s=", key.Name);
+		for (size_t i = 0; i < key.Size; i++)
+			fprintf(f, "%02X", value[i]);
+		fprintf(f, "\n");
+	}
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+// Builds a KELF with an arbitrary block layout from the primitives, the way
+// a signing tool would, independently of Kelf's own writer. Content keys
+// beyond the two Kc holds are flagged in the header only, such files are
+// expected to be rejected.
+int GenerateKelf(const CryptoContext& ctx, const std::vector<BlockSpec>& blocks, int keycount, const std::string& filename, std::string* plain)
+{
+	if (blocks.empty() || blocks.size() > 255)
+		return -1;
+
+	size_t ContentSize = 0;
+	for (const BlockSpec& block : blocks)
+		ContentSize += block.Size;
+
+	std::string content(ContentSize, '\0');
+	Fill((uint8_t*)content.data(), ContentSize);
+	if (plain)
+		*plain = content;
+
+	int BitTableSize = (int)(blocks.size() * 2 + 1) * 8;
+
+	KELFHeader header;
+	static const uint8_t USER[16] = { 0x01, 0x03, 0x00, 0x04, 0x00, 0x02, 0x00, 0x4A, 0x00, 0x07, 0x01, 0x00, 0x00, 0x00, 0x01, 0x78 };
+	memcpy(header.UserDefined, USER, 16);
+	header.ContentSize = (uint32_t)ContentSize;
+	header.HeaderSize = sizeof(KELFHeader) + 8 + 16 + 16 + BitTableSize + 8 + 8;
+	header.SystemType = SYSTEM_TYPE_PSX;
+	header.ApplicationType = 1;
+	header.Flags = 0x20C | (keycount & 3) << 4;
+	header.BitCount = 0;
+	header.MGZones = 1;
+
+	uint8_t Kbit[16];
+	uint8_t Kc[16];
+	Fill(Kbit, 16);
+	Fill(Kc, 16);
+	DesKey KcKey(Kc, keycount == 1 ? 1 : 2);
+
+	BitTable bitTable;
+	memset(&bitTable, 0, sizeof(bitTable));
+	bitTable.HeaderSize = header.HeaderSize;
+	bitTable.BlockCount = (uint8_t)blocks.size();
+
+	size_t offset = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		BitTable::BitBlock& block = bitTable.Blocks[i];
+		block.Size = blocks[i].Size;
+		block.Flags = blocks[i].Flags;
+
+		uint8_t* data = (uint8_t*)&content[offset];
+		if (block.Flags & BIT_BLOCK_SIGNED)
+		{
+			Signer signer(ctx, block.Flags & BIT_BLOCK_ENCRYPTED ? SIGNER_MODE_XOR : SIGNER_MODE_MAC);
+			signer.Update(data, block.Size);
+			signer.Final(block.Signature);
+		}
+		if (block.Flags & BIT_BLOCK_ENCRYPTED)
+			TdesCbcCfb64Encrypt(data, data, block.Size, KcKey, ctx.GetContentIV());
+
+		offset += block.Size;
+	}
+
+	uint8_t HeaderSignature[8];
+	Signer headerSigner(ctx, SIGNER_MODE_MAC);
+	headerSigner.Update(&header, sizeof(header));
+	headerSigner.Final(HeaderSignature);
+
+	uint8_t BitTableSignature[8];
+	Signer bitTableSigner(ctx, SIGNER_MODE_XOR);
+	bitTableSigner.Update(Kbit, 8);
+	if (memcmp(Kbit, Kbit + 8, 8) != 0)
+		bitTableSigner.Update(Kbit + 8, 8);
+	bitTableSigner.Update(Kc, 8);
+	if (memcmp(Kc, Kc + 8, 8) != 0)
+		bitTableSigner.Update(Kc + 8, 8);
+	bitTableSigner.Update(&bitTable, BitTableSize);
+	bitTableSigner.Final(BitTableSignature);
+
+	uint8_t RootSignature[8];
+	Signer rootSigner(ctx, SIGNER_MODE_ROOT);
+	rootSigner.Update(HeaderSignature, 8);
+	rootSigner.Update(BitTableSignature, 8);
+	for (size_t i = 0; i < blocks.size(); i++)
+		if (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED)
+			rootSigner.Update(bitTable.Blocks[i].Signature, 8);
+	rootSigner.Final(RootSignature);
+
+	TdesCbcCfb64Encrypt(&bitTable, &bitTable, BitTableSize, DesKey(Kbit, 2), ctx.GetContentTableIV());
+
+	Kelf kelf(ctx);
+	DesKey KEK = kelf.DeriveKeyEncryptionKey(header);
+	for (int i = 0; i < 2; i++)
+	{
+		TdesCbcCfb64Encrypt(Kbit + i * 8, Kbit + i * 8, 8, KEK, MG_IV_NULL);
+		TdesCbcCfb64Encrypt(Kc + i * 8, Kc + i * 8, 8, KEK, MG_IV_NULL);
+	}
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == NULL)
+		return -1;
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(HeaderSignature, 8, 1, f) == 1 &&
+		fwrite(Kbit, 16, 1, f) == 1 &&
+		fwrite(Kc, 16, 1, f) == 1 &&
+		fwrite(&bitTable, BitTableSize, 1, f) == 1 &&
+		fwrite(BitTableSignature, 8, 1, f) == 1 &&
+		fwrite(RootSignature, 8, 1, f) == 1 &&
+		fwrite(content.data(), 1, ContentSize, f) == ContentSize;
+
+	return fclose(f) == 0 && ok ? 0 : -1;
+}
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "bench.h"
+#include "../src/kelf.h"
+#include "../src/kelfview.h"
+#include "../src/signer.h"
+#include "../src/threadpool.h"
+
+struct Layout
+{
+	std::string Name;
+	std::vector<BlockSpec> Blocks;
+};
+
+static std::vector<Layout> GetLayouts(size_t size)
+{
+	size &= ~(size_t)7;
+
+	std::vector<Layout> layouts;
+	layouts.push_back({ "encrypted-signed", { { (uint32_t)size, BIT_BLOCK_ENCRYPTED | BIT_BLOCK_SIGNED } } });
+	layouts.push_back({ "encrypted", { { (uint32_t)size, BIT_BLOCK_ENCRYPTED } } });
+	layouts.push_back({ "plain-signed", { { (uint32_t)size, BIT_BLOCK_SIGNED } } });
+	layouts.push_back({ "plain", { { (uint32_t)size, 0 } } });
+
+	Layout mixed = { "mixed-8", {} };
+	static const uint32_t MIXED_FLAGS[4] = { BIT_BLOCK_ENCRYPTED | BIT_BLOCK_SIGNED, BIT_BLOCK_SIGNED, BIT_BLOCK_ENCRYPTED, 0 };
+	for (int i = 0; i < 8; i++)
+		mixed.Blocks.push_back({ (uint32_t)(size / 8 & ~(size_t)7), MIXED_FLAGS[i % 4] });
+	layouts.push_back(mixed);
+
+	// Many plain signed blocks, the case the batched CBC-MACs are for.
+	Layout many = { "plain-signed-255", {} };
+	for (int i = 0; i < 255; i++)
+		many.Blocks.push_back({ (uint32_t)(size / 255 & ~(size_t)7), BIT_BLOCK_SIGNED });
+	layouts.push_back(many);
+
+	// Largest possible header with next to no content, for per-file overhead.
+	Layout header = { "header-255", {} };
+	for (int i = 0; i < 255; i++)
+		header.Blocks.push_back({ 64, BIT_BLOCK_ENCRYPTED | BIT_BLOCK_SIGNED });
+	layouts.push_back(header);
+
+	return layouts;
+}
+
+static size_t GetSize(const std::vector<BlockSpec>& blocks)
+{
+	size_t size = 0;
+	for (const BlockSpec& block : blocks)
+		size += block.Size;
+	return size;
+}
+
+static bool ReadFile(const std::string& filename, std::string& data)
+{
+	std::ifstream f(filename, std::ios::binary);
+	if (!f)
+		return false;
+	std::stringstream ss;
+	ss << f.rdbuf();
+	data = ss.str();
+	return true;
+}
+
+static int RunTool(const BenchOptions& options, const std::string& args)
+{
+	std::string command = "HOME=" + options.WorkDir + " " + options.Tool + " " + args + " >/dev/null 2>&1";
+	return system(command.c_str()) == 0 ? 0 : -1;
+}
+
+static void Report(BenchResult result, const std::string& layout, int keys, unsigned threads)
+{
+	result.Layout = layout;
+	result.Keys = keys;
+	result.Threads = threads;
+	BenchReport(result);
+}
+
+static int RunLayout(const BenchOptions& options, const CryptoContext& ctx, const Layout& layout, int keycount)
+{
+	std::string input = options.WorkDir + "/" + layout.Name + ".kelf";
+	std::string output = options.WorkDir + "/" + layout.Name + ".out";
+	size_t size = GetSize(layout.Blocks);
+	unsigned cores = ThreadPool::GetDefaultThreadCount();
+
+	std::string plain;
+	if (GenerateKelf(ctx, layout.Blocks, keycount, input, &plain) != 0)
+	{
+		fprintf(stderr, "Failed to generate %s\n", input.c_str());
+		return 1;
+	}
+
+	bool encrypted = false;
+	for (const BlockSpec& block : layout.Blocks)
+		encrypted |= (block.Flags & BIT_BLOCK_ENCRYPTED) != 0;
+
+	// Three key content can't be decrypted since Kc only holds two keys,
+	// such files have to be rejected up front.
+	int expected = keycount == 3 && encrypted ? KELF_ERROR_INVALID_DES_KEY_COUNT : 0;
+
+	Kelf check(ctx);
+	int ret = check.DecryptKelfStream(input, output);
+	std::string decrypted;
+	if (ret != expected || (ret == 0 && (!ReadFile(output, decrypted) || decrypted != plain)))
+	{
+		fprintf(stderr, "%s with %d keys: decryption does not match (%d)\n", layout.Name.c_str(), keycount, ret);
+		remove(input.c_str());
+		remove(output.c_str());
+		return 1;
+	}
+
+	if (expected != 0)
+	{
+		if (BenchSelected(options, "reject"))
+		{
+			Report(BenchMeasure("reject", size, [&] {
+				Kelf kelf(ctx);
+				return kelf.LoadKelf(input) == expected ? 0 : -1;
+			}), layout.Name, keycount, 1);
+		}
+
+		remove(input.c_str());
+		return 0;
+	}
+
+	unsigned threadCounts[2] = { 1, cores };
+	for (int t = 0; t < (cores > 1 ? 2 : 1); t++)
+	{
+		unsigned threads = threadCounts[t];
+
+		if (BenchSelected(options, "load"))
+		{
+			Report(BenchMeasure("load", size, [&] {
+				Kelf kelf(ctx);
+				kelf.SetThreadCount(threads);
+				return kelf.LoadKelf(input);
+			}), layout.Name, keycount, threads);
+		}
+
+		if (BenchSelected(options, "verify"))
+		{
+			Report(BenchMeasure("verify", size, [&] {
+				Kelf kelf(ctx);
+				kelf.SetThreadCount(threads);
+				return kelf.VerifyKelf(input);
+			}), layout.Name, keycount, threads);
+		}
+	}
+
+	// One view shared by every core, each decrypting all of it at once.
+	if (BenchSelected(options, "view"))
+	{
+		std::shared_ptr<const KelfView> view;
+		std::vector<std::string> outputs(cores, std::string(size, '\0'));
+		int ret = KelfView::Load(ctx, input, view);
+		BenchResult result = BenchMeasure("view", size * cores, [&] {
+			if (ret != 0)
+				return ret;
+			std::atomic<int> failed(0);
+			ThreadPool::ParallelFor(cores, cores, [&](size_t i) {
+				int decrypted = view->Decrypt(&outputs[i][0], size, 1);
+				if (decrypted != 0)
+					failed = decrypted;
+			});
+			return failed.load();
+		});
+		for (const std::string& output : outputs)
+			if (result.Status == "ok" && output != plain)
+				result.Status = "mismatch";
+		Report(result, layout.Name, keycount, cores);
+	}
+
+	if (BenchSelected(options, "stream"))
+	{
+		Report(BenchMeasure("stream", size, [&] {
+			Kelf kelf(ctx);
+			return kelf.DecryptKelfStream(input, output);
+		}), layout.Name, keycount, 1);
+	}
+
+	if (BenchSelected(options, "cli-decrypt"))
+	{
+		Report(BenchMeasure("cli-decrypt", size, [&] {
+			return RunTool(options, "decrypt " + input + " " + output);
+		}), layout.Name, keycount, cores);
+	}
+
+	if (BenchSelected(options, "cli-verify"))
+	{
+		Report(BenchMeasure("cli-verify", size, [&] {
+			return RunTool(options, "verify " + input);
+		}), layout.Name, keycount, cores);
+	}
+
+	remove(input.c_str());
+	remove(output.c_str());
+	return 0;
+}
+
+static int RunSave(const BenchOptions& options, const CryptoContext& ctx)
+{
+	std::string input = options.WorkDir + "/content.elf";
+	std::string output = options.WorkDir + "/content.kelf";
+	std::string roundtrip = options.WorkDir + "/content.out";
+
+	std::string content(options.Size, '\0');
+	std::mt19937_64 rng(0x53415645);
+	for (char& c : content)
+		c = (char)rng();
+
+	std::ofstream(input, std::ios::binary).write(content.data(), content.size());
+
+	// build checks its own copies, the others leave output behind.
+	bool written = false;
+	if (BenchSelected(options, "save"))
+	{
+		written = true;
+		Report(BenchMeasure("save", content.size(), [&] {
+			Kelf kelf(ctx);
+			int ret = kelf.LoadContent(input);
+			if (ret == 0)
+				ret = kelf.SaveKelf(output);
+			return ret;
+		}), "psx-default", 2, 1);
+	}
+
+	// One builder shared by every core, each sealing its own copy.
+	unsigned cores = ThreadPool::GetDefaultThreadCount();
+	if (BenchSelected(options, "build"))
+	{
+		KelfBuilder builder(ctx);
+		std::vector<std::string> outputs(cores);
+		BenchResult result = BenchMeasure("build", content.size() * cores, [&] {
+			std::atomic<int> failed(0);
+			ThreadPool::ParallelFor(cores, cores, [&](size_t i) {
+				int built = builder.Build(content.data(), content.size(), outputs[i]);
+				if (built != 0)
+					failed = built;
+			});
+			return failed.load();
+		});
+
+		// Every copy has to come out the same and decrypt back to the input.
+		std::shared_ptr<const KelfView> view;
+		std::string decrypted(content.size(), '\0');
+		if (result.Status == "ok" && (KelfView::Load(ctx, outputs[0].data(), outputs[0].size(), view) != 0 ||
+			view->Decrypt(&decrypted[0], decrypted.size(), 1) != 0 || decrypted != content))
+			result.Status = "mismatch";
+		for (const std::string& output : outputs)
+			if (result.Status == "ok" && output != outputs[0])
+				result.Status = "mismatch";
+		Report(result, "psx-default", 2, cores);
+	}
+
+	if (BenchSelected(options, "cli-encrypt"))
+	{
+		written = true;
+		Report(BenchMeasure("cli-encrypt", content.size(), [&] {
+			return RunTool(options, "encrypt " + input + " " + output);
+		}), "psx-default", 2, 1);
+	}
+
+	// Whatever was written last has to decrypt back to the input.
+	Kelf kelf(ctx);
+	std::string decrypted;
+	int failures = 0;
+	if (written && (kelf.DecryptKelfStream(output, roundtrip) != 0 || !ReadFile(roundtrip, decrypted) || decrypted != content))
+	{
+		fprintf(stderr, "psx-default: encrypted file does not decrypt back to its input\n");
+		failures++;
+	}
+
+	remove(input.c_str());
+	remove(output.c_str());
+	remove(roundtrip.c_str());
+	return failures;
+}
+
+static int RunSignatures(const BenchOptions& options, const CryptoContext& ctx)
+{
+	if (BenchSelected(options, "sig-content"))
+	{
+		std::string data(options.Size & ~(size_t)7, '\0');
+		static const struct
+		{
+			const char* Name;
+			int Mode;
+		} MODES[] = { { "xor", SIGNER_MODE_XOR }, { "mac", SIGNER_MODE_MAC } };
+
+		for (const auto& mode : MODES)
+		{
+			Report(BenchMeasure("sig-content", data.size(), [&] {
+				uint8_t signature[8];
+				Signer signer(ctx, mode.Mode);
+				signer.Update(data.data(), data.size());
+				signer.Final(signature);
+				return 0;
+			}), mode.Name, 0, 1);
+		}
+	}
+
+	// The header signatures need a loaded file, the largest bit table makes
+	// for the worst case.
+	std::vector<BlockSpec> blocks(255, { 64, BIT_BLOCK_ENCRYPTED | BIT_BLOCK_SIGNED });
+	std::string input = options.WorkDir + "/signatures.kelf";
+	Kelf kelf(ctx);
+	if (GenerateKelf(ctx, blocks, 2, input, NULL) != 0 || kelf.LoadKelf(input) != 0)
+	{
+		fprintf(stderr, "Failed to set up signature benchmarks\n");
+		remove(input.c_str());
+		return 1;
+	}
+	remove(input.c_str());
+
+	KELFHeader header;
+	memset(&header, 0, sizeof(header));
+	uint8_t HeaderSignature[8];
+	uint8_t BitTableSignature[8];
+	uint8_t RootSignature[8];
+
+	if (BenchSelected(options, "sig-header"))
+	{
+		Report(BenchMeasure("sig-header", sizeof(header), [&] {
+			kelf.GetHeaderSignature(header, HeaderSignature);
+			return 0;
+		}), "header-255", 2, 1);
+	}
+
+	if (BenchSelected(options, "sig-bit-table"))
+	{
+		Report(BenchMeasure("sig-bit-table", (255 * 2 + 1) * 8, [&] {
+			kelf.GetBitTableSignature(BitTableSignature);
+			return 0;
+		}), "header-255", 2, 1);
+	}
+
+	if (BenchSelected(options, "sig-root"))
+	{
+		Report(BenchMeasure("sig-root", (255 + 2) * 8, [&] {
+			kelf.GetRootSignature(HeaderSignature, BitTableSignature, RootSignature);
+			return 0;
+		}), "header-255", 2, 1);
+	}
+
+	return 0;
+}
+
+int RunKelfBench(const BenchOptions& options, const CryptoContext& ctx)
+{
+	int failures = 0;
+
+	for (const Layout& layout : GetLayouts(options.Size))
+	{
+		bool encrypted = false;
+		for (const BlockSpec& block : layout.Blocks)
+			encrypted |= (block.Flags & BIT_BLOCK_ENCRYPTED) != 0;
+
+		// The key mode only matters for encrypted content.
+		for (int keycount = 1; keycount <= 3; keycount++)
+			if (encrypted || keycount == 2)
+				failures += RunLayout(options, ctx, layout, keycount);
+	}
+
+	failures += RunSave(options, ctx);
+	failures += RunSignatures(options, ctx);
+
+	return failures;
+}
@@ -0,0 +1,894 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <numeric>
+
+#include "batch.h"
+#include "cache.h"
+#include "fileio.h"
+#include "iso9660.h"
+#include "journal.h"
+#include "kelf.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "uring.h"
+
+namespace fs = std::filesystem;
+
+// Signature of files that never got as far as a KELF.
+static const uint8_t noSignature[8] = { 0 };
+
+int Batch::AddInput(std::string input, std::string outputDir)
+{
+	std::error_code ec;
+	if (fs::is_directory(input, ec))
+		return AddDirectory(input, outputDir);
+
+	IsoImage iso;
+	if (iso.Open(input) == 0)
+		return AddImage(input, outputDir);
+
+	return AddFileList(input, outputDir);
+}
+
+int Batch::AddDirectory(std::string input, std::string outputDir)
+{
+	std::error_code ec;
+	fs::recursive_directory_iterator it(input, ec);
+	if (ec)
+		return BATCH_ERROR_OPEN_FAILED;
+
+	size_t count = jobs.size();
+	for (; it != fs::recursive_directory_iterator(); it.increment(ec))
+	{
+		if (ec)
+			return BATCH_ERROR_OPEN_FAILED;
+		if (!it->is_regular_file(ec))
+			continue;
+
+		Job job;
+		job.Input = it->path().string();
+		job.Output = (fs::path(outputDir) / it->path().lexically_relative(input)).string();
+		std::error_code sizeError;
+		job.Size = it->file_size(sizeError);
+		if (sizeError)
+			job.Size = 0;
+		job.Probe = false;
+		job.Source = job.Input;
+		job.Offset = 0;
+		jobs.push_back(job);
+	}
+
+	if (jobs.size() == count)
+		return BATCH_ERROR_NO_INPUT;
+
+	return 0;
+}
+
+int Batch::AddFileList(std::string list, std::string outputDir)
+{
+	std::ifstream infile(list);
+	if (infile.fail())
+		return BATCH_ERROR_OPEN_FAILED;
+
+	size_t count = jobs.size();
+	std::unique_ptr<IsoImage> iso;
+	std::string isoPath;
+	std::string line;
+	while (std::getline(infile, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+
+		// Listed paths are mirrored under the output directory, absolute ones
+		// without their root, unless the line names the output.
+		Job job;
+		size_t tab = line.find('\t');
+		job.Input = line.substr(0, tab);
+		fs::path output = tab != std::string::npos ? fs::path(line.substr(tab + 1)) : fs::path(job.Input).relative_path();
+		job.Output = (fs::path(outputDir) / output).string();
+		std::error_code ec;
+		job.Size = fs::file_size(job.Input, ec);
+		if (ec)
+			job.Size = 0;
+		job.Probe = false;
+		job.Source = job.Input;
+		job.Offset = 0;
+
+		// Files of the same image usually follow each other, so the image
+		// stays open between them.
+		std::string image, path;
+		IsoEntry entry;
+		if (IsoImage::SplitPath(job.Input, image, path))
+		{
+			if (image != isoPath)
+			{
+				iso.reset(new IsoImage());
+				isoPath = image;
+				if (iso->Open(image) != 0)
+					iso.reset();
+			}
+			if (iso && iso->Find(path, entry) == 0)
+			{
+				job.Size = entry.Size;
+				job.Probe = true;
+				job.Source = image;
+				job.Offset = entry.Offset;
+			}
+		}
+
+		jobs.push_back(job);
+	}
+
+	if (jobs.size() == count)
+		return BATCH_ERROR_NO_INPUT;
+
+	return 0;
+}
+
+int Batch::AddImage(std::string image, std::string outputDir)
+{
+	IsoImage iso;
+	std::vector<IsoEntry> entries;
+	if (iso.Open(image) != 0 || iso.List(entries) != 0)
+		return BATCH_ERROR_OPEN_FAILED;
+	if (entries.empty())
+		return BATCH_ERROR_NO_INPUT;
+
+	// Paths inside the image are mirrored under the output directory.
+	for (const IsoEntry& entry : entries)
+	{
+		Job job;
+		job.Input = image + ISO_PATH_SEPARATOR + entry.Path;
+		job.Output = (fs::path(outputDir) / fs::path(entry.Path).relative_path()).string();
+		job.Size = entry.Size;
+		job.Probe = true;
+		job.Source = image;
+		job.Offset = entry.Offset;
+		jobs.push_back(job);
+	}
+
+	return 0;
+}
+
+int Batch::ProcessJob(const Job& job, uint8_t* signature)
+{
+	Kelf kelf(*keyRing);
+	int ret;
+
+	// Only the header is read to tell whether it is a KELF at all, and for
+	// the journal, which would miss the signature of a cached result.
+	if ((job.Probe || journal != NULL) && mode == BATCH_MODE_DECRYPT)
+	{
+		ret = kelf.LoadKelfHeader(job.Input);
+		if (job.Probe && Kelf::IsNotKelf(ret))
+			return BATCH_JOB_SKIPPED;
+	}
+
+	std::error_code ec;
+	fs::path parent = fs::path(job.Output).parent_path();
+	if (!parent.empty())
+		fs::create_directories(parent, ec);
+
+	if (mode == BATCH_MODE_DECRYPT)
+	{
+		auto work = [&] {
+			int ret = kelf.LoadKelf(job.Input);
+			if (ret == 0)
+				ret = kelf.SaveContent(job.Output);
+			return ret;
+		};
+		ret = cache ? cache->Run(job.Input, &job.Output, work) : work();
+	}
+	else
+	{
+		ret = kelf.SetKeySet(keyRing->GetName(keySet));
+		if (ret == 0)
+			ret = kelf.EncryptKelfStream(job.Input, job.Output);
+	}
+
+	// The journal must never call a file done whose data a crash can
+	// still lose.
+	if (ret == 0 && journal != NULL && OutputFile::Sync(job.Output) != 0)
+		ret = KELF_ERROR_WRITE_FAILED;
+
+	memcpy(signature, kelf.GetSignature(), 8);
+	return ret;
+}
+
+// Decrypts or encrypts a file held in memory. output and outputSize come in
+// as the buffer to use and leave describing the result, which goes to heap
+// when it does not fit.
+int Batch::ProcessBuffer(const uint8_t* data, size_t size, std::vector<uint8_t>& heap, uint8_t*& output, size_t& outputSize, uint8_t* signature)
+{
+	Kelf kelf(*keyRing);
+	size_t needed;
+	int ret;
+
+	if (mode == BATCH_MODE_DECRYPT)
+	{
+		ret = kelf.LoadKelfHeader(data, size);
+		if (ret != 0)
+			return ret;
+		needed = kelf.GetContentSize();
+	}
+	else
+	{
+		ret = kelf.SetKeySet(keyRing->GetName(keySet));
+		if (ret == 0)
+			ret = kelf.LoadContent(data, size);
+		if (ret != 0)
+			return ret;
+		needed = kelf.GetKelfSize();
+	}
+
+	if (needed > outputSize)
+	{
+		heap.resize(needed);
+		output = heap.data();
+	}
+	outputSize = needed;
+
+	if (mode == BATCH_MODE_DECRYPT)
+		ret = kelf.DecryptKelf(data, size, output, outputSize);
+	else
+		ret = kelf.SaveKelf(output, outputSize);
+	memcpy(signature, kelf.GetSignature(), 8);
+	return ret;
+}
+
+void Batch::Finish(const Job& job, int ret, const uint8_t* signature)
+{
+	if (ret != BATCH_JOB_SKIPPED)
+		STATS_RESULT(ret);
+
+	// Only recorded once the output is complete, so a crash before this
+	// point just means doing the file again.
+	if (journal != NULL)
+	{
+		JournalRecord record;
+		record.Result = ret;
+		record.Size = job.Size;
+		record.OutputSize = 0;
+		if (ret == 0)
+		{
+			std::error_code ec;
+			record.OutputSize = fs::file_size(job.Output, ec);
+		}
+		memcpy(record.Signature, signature, 8);
+		record.Input = job.Input;
+		record.Output = job.Output;
+		int written = journal->Append(record);
+		if (written != 0)
+		{
+			std::lock_guard<std::mutex> guard(outputLock);
+			fprintf(stderr, "%s: %d - %s\n", job.Input.c_str(), written, Journal::getErrorString(written).c_str());
+		}
+	}
+
+	if (ret == BATCH_JOB_SKIPPED)
+	{
+		skipped++;
+		return;
+	}
+	if (ret != 0)
+	{
+		failed++;
+		std::lock_guard<std::mutex> guard(outputLock);
+		fprintf(stderr, "%s: %d - %s\n", job.Input.c_str(), ret, Kelf::getErrorString(ret).c_str());
+		return;
+	}
+
+	bytes += job.Size;
+}
+
+void Batch::RunPool(unsigned& threadCount)
+{
+	ThreadPool pool(threadCount);
+	for (const Job& job : jobs)
+		pool.Submit([&, job] {
+			uint8_t signature[8] = { 0 };
+			int ret = ProcessJob(job, signature);
+			Finish(job, ret, signature);
+		});
+	pool.Wait();
+	threadCount = pool.GetThreadCount();
+}
+
+#ifdef __linux__
+
+// io_uring user data of the eventfd read that wakes the loop when the pool
+// finished a file.
+#define BATCH_WAKEUP UINT64_MAX
+
+// Largest single read or write handed to the kernel.
+#define BATCH_MAX_TRANSFER (1u << 30)
+
+enum SlotStage
+{
+	SLOT_PROBE, // reading just enough to tell whether it is a KELF
+	SLOT_READ,
+	SLOT_PROCESS, // on the pool
+	SLOT_WRITE,
+	SLOT_SYNC, // with a journal, before the file is recorded as done
+};
+
+// One file in flight. The loop thread owns it except while the pool works
+// on it, which is the only time it is in SLOT_PROCESS.
+struct Slot
+{
+	size_t Job;
+	SlotStage Stage;
+	int In;
+	int Out;
+	int Result;
+	bool Direct; // too large for the buffers, done by ProcessJob on the pool
+	uint8_t Signature[8];
+	uint8_t* Buffers[2]; // registered input and output buffer
+	uint8_t* Input;
+	uint8_t* Output;
+	std::vector<uint8_t> OutputHeap;
+	size_t Size;
+	size_t OutputSize;
+	size_t Done; // bytes of the current stage transferred
+	std::chrono::steady_clock::time_point Started; // the current stage
+};
+
+// Reads and writes go through io_uring on this thread, decryption runs on a
+// pool, so while file N is decrypted the reads of the files after it and the
+// writes of the ones before are in flight. queueDepth bounds the files in
+// flight and with it the memory in use; every one gets a pair of registered
+// buffers. Opening files stays synchronous.
+bool Batch::RunPipelined(unsigned& threadCount)
+{
+	// The buffers outlive the ring, so nothing in flight can land in freed
+	// memory.
+	std::vector<uint8_t> arena;
+	Uring ring;
+	if (queueDepth == 0 || ring.Init(queueDepth + 1) != 0)
+		return false;
+
+	int wakeup = eventfd(0, EFD_CLOEXEC);
+	if (wakeup < 0)
+		return false;
+
+	arena.resize((size_t)queueDepth * 2 * BATCH_BUFFER_SIZE);
+	ring.RegisterBuffers(arena.data(), BATCH_BUFFER_SIZE, queueDepth * 2);
+
+	std::vector<Slot> slots(queueDepth);
+	std::vector<size_t> idle;
+	for (unsigned i = 0; i < queueDepth; i++)
+	{
+		slots[i].Buffers[0] = arena.data() + (size_t)i * 2 * BATCH_BUFFER_SIZE;
+		slots[i].Buffers[1] = slots[i].Buffers[0] + BATCH_BUFFER_SIZE;
+		idle.push_back(queueDepth - 1 - i);
+	}
+
+	std::mutex doneLock;
+	std::deque<size_t> done;
+	uint64_t counter;
+
+	// Reads and writes are timed from their first submission to their last
+	// completion, so overlapping ones add up to more than the wall time.
+	[[maybe_unused]] auto stageTime = [&](size_t slot) {
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - slots[slot].Started).count();
+	};
+
+	auto bufferIndex = [&](size_t slot, int which, const uint8_t* buffer) {
+		return buffer == slots[slot].Buffers[which] ? (int)(slot * 2 + which) : -1;
+	};
+	auto submitRead = [&](size_t slot, size_t target) {
+		Slot& s = slots[slot];
+		size_t length = std::min<size_t>(target - s.Done, BATCH_MAX_TRANSFER);
+		return ring.Read(s.In, s.Input + s.Done, (unsigned)length, jobs[s.Job].Offset + s.Done, bufferIndex(slot, 0, s.Input), slot);
+	};
+	auto submitWrite = [&](size_t slot) {
+		Slot& s = slots[slot];
+		size_t length = std::min<size_t>(s.OutputSize - s.Done, BATCH_MAX_TRANSFER);
+		return ring.Write(s.Out, s.Output + s.Done, (unsigned)length, s.Done, bufferIndex(slot, 1, s.Output), slot);
+	};
+
+	size_t active = 0;
+	auto finish = [&](size_t slot, int ret) {
+		Slot& s = slots[slot];
+		if (s.In >= 0)
+			close(s.In);
+		if (s.Out >= 0)
+		{
+			close(s.Out);
+			if (ret != 0)
+				unlink(jobs[s.Job].Output.c_str());
+		}
+		std::vector<uint8_t>().swap(s.OutputHeap);
+		Finish(jobs[s.Job], ret, s.Signature);
+		idle.push_back(slot);
+		active--;
+	};
+
+	// The journal must never call a file done whose data a crash can
+	// still lose.
+	auto syncOutput = [&](size_t slot) {
+		if (journal == NULL)
+			return finish(slot, 0);
+		slots[slot].Stage = SLOT_SYNC;
+		if (ring.Sync(slots[slot].Out, slot) != 0)
+			finish(slot, KELF_ERROR_WRITE_FAILED);
+	};
+
+	ThreadPool pool(threadCount);
+	threadCount = pool.GetThreadCount();
+
+	// Called on the pool, hands the slot back to the loop.
+	auto processedOnPool = [&](size_t slot) {
+		{
+			std::lock_guard<std::mutex> guard(doneLock);
+			done.push_back(slot);
+		}
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) != sizeof(one))
+			abort();
+	};
+
+	auto process = [&](size_t slot) {
+		Slot& s = slots[slot];
+		s.Stage = SLOT_PROCESS;
+		pool.Submit([&, slot] {
+			Slot& s = slots[slot];
+			s.Output = s.Buffers[1];
+			s.OutputSize = BATCH_BUFFER_SIZE;
+			s.Result = ProcessBuffer(s.Input, s.Size, s.OutputHeap, s.Output, s.OutputSize, s.Signature);
+			processedOnPool(slot);
+		});
+	};
+
+	// Files larger than the buffers are left to ProcessJob, which maps and
+	// streams them, so memory in flight stays bounded by the buffers and
+	// large files keep the zero-copy paths.
+	auto processDirect = [&](size_t slot) {
+		Slot& s = slots[slot];
+		s.Stage = SLOT_PROCESS;
+		s.Direct = true;
+		pool.Submit([&, slot] {
+			Slot& s = slots[slot];
+			s.Result = ProcessJob(jobs[s.Job], s.Signature);
+			processedOnPool(slot);
+		});
+	};
+
+	// The input is fully read, the header so far for probed files.
+	auto readDone = [&](size_t slot) {
+		Slot& s = slots[slot];
+		if (s.Stage == SLOT_PROBE)
+		{
+			Kelf kelf(*keyRing);
+			if (Kelf::IsNotKelf(kelf.LoadKelfHeader(s.Input, s.Done)))
+				return finish(slot, BATCH_JOB_SKIPPED);
+			s.Stage = SLOT_READ;
+			if (s.Done < s.Size)
+			{
+				if (submitRead(slot, s.Size) != 0)
+					finish(slot, KELF_ERROR_READ_FAILED);
+				return;
+			}
+		}
+		STATS_ADD(STAT_READ, stageTime(slot), s.Size);
+		process(slot);
+	};
+
+	auto start = [&](size_t job) {
+		size_t slot = idle.back();
+		idle.pop_back();
+		active++;
+
+		Slot& s = slots[slot];
+		s.Job = job;
+		s.In = -1;
+		s.Out = -1;
+		s.Done = 0;
+		s.Direct = false;
+		memset(s.Signature, 0, sizeof(s.Signature));
+
+		const Job& j = jobs[job];
+		s.In = open(j.Source.c_str(), O_RDONLY | O_CLOEXEC);
+		if (s.In < 0)
+			return finish(slot, KELF_ERROR_OPEN_FAILED);
+
+		// The listed size may be stale, files of images are what the image
+		// says.
+		s.Size = j.Size;
+		if (j.Source == j.Input)
+		{
+			struct stat st;
+			if (fstat(s.In, &st) != 0)
+				return finish(slot, KELF_ERROR_READ_FAILED);
+			s.Size = st.st_size;
+		}
+
+		if (s.Size > BATCH_BUFFER_SIZE)
+		{
+			close(s.In);
+			s.In = -1;
+			return processDirect(slot);
+		}
+
+		s.Input = s.Buffers[0];
+		if (s.Size == 0)
+			return process(slot);
+
+		s.Stage = SLOT_READ;
+		s.Started = std::chrono::steady_clock::now();
+		size_t target = s.Size;
+		if (j.Probe && mode == BATCH_MODE_DECRYPT)
+		{
+			s.Stage = SLOT_PROBE;
+			target = std::min<size_t>(s.Size, KELF_MAX_HEADER_SIZE);
+		}
+		if (submitRead(slot, target) != 0)
+			finish(slot, KELF_ERROR_READ_FAILED);
+	};
+
+	auto processed = [&](size_t slot) {
+		Slot& s = slots[slot];
+		if (s.Direct || s.Result != 0)
+			return finish(slot, s.Result);
+
+		const Job& j = jobs[s.Job];
+		std::error_code ec;
+		fs::path parent = fs::path(j.Output).parent_path();
+		if (!parent.empty())
+			fs::create_directories(parent, ec);
+		s.Out = open(j.Output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (s.Out < 0)
+			return finish(slot, KELF_ERROR_OPEN_FAILED);
+
+		s.Stage = SLOT_WRITE;
+		s.Done = 0;
+		s.Started = std::chrono::steady_clock::now();
+		if (s.OutputSize == 0)
+			return syncOutput(slot);
+		if (submitWrite(slot) != 0)
+			finish(slot, KELF_ERROR_WRITE_FAILED);
+	};
+
+	bool broken = ring.Read(wakeup, &counter, sizeof(counter), 0, -1, BATCH_WAKEUP) != 0;
+	size_t next = 0;
+	while (!broken && (next < jobs.size() || active > 0))
+	{
+		while (!idle.empty() && next < jobs.size())
+			start(next++);
+		if (active == 0)
+			continue;
+
+		uint64_t userData;
+		int result;
+		if (ring.Wait(userData, result) != 0)
+		{
+			broken = true;
+			break;
+		}
+
+		if (userData == BATCH_WAKEUP)
+		{
+			std::deque<size_t> finished;
+			{
+				std::lock_guard<std::mutex> guard(doneLock);
+				finished.swap(done);
+			}
+			for (size_t slot : finished)
+				processed(slot);
+			broken = ring.Read(wakeup, &counter, sizeof(counter), 0, -1, BATCH_WAKEUP) != 0;
+			continue;
+		}
+
+		size_t slot = (size_t)userData;
+		Slot& s = slots[slot];
+		if (s.Stage == SLOT_SYNC)
+		{
+			finish(slot, result == 0 ? 0 : KELF_ERROR_WRITE_FAILED);
+			continue;
+		}
+		if (s.Stage == SLOT_WRITE)
+		{
+			if (result <= 0)
+			{
+				finish(slot, KELF_ERROR_WRITE_FAILED);
+				continue;
+			}
+			s.Done += result;
+			if (s.Done == s.OutputSize)
+			{
+				STATS_ADD(STAT_WRITE, stageTime(slot), s.OutputSize);
+				syncOutput(slot);
+			}
+			else if (submitWrite(slot) != 0)
+				finish(slot, KELF_ERROR_WRITE_FAILED);
+			continue;
+		}
+
+		// Short reads are resumed, end of file before the size is an error.
+		if (result <= 0)
+		{
+			finish(slot, KELF_ERROR_READ_FAILED);
+			continue;
+		}
+		s.Done += result;
+		size_t target = s.Stage == SLOT_PROBE ? std::min<size_t>(s.Size, KELF_MAX_HEADER_SIZE) : s.Size;
+		if (s.Done < target)
+		{
+			if (submitRead(slot, target) != 0)
+				finish(slot, KELF_ERROR_READ_FAILED);
+			continue;
+		}
+		readDone(slot);
+	}
+
+	// Only a failing ring gets here early; the pool still has to drain
+	// before the slots go away.
+	pool.Wait();
+	for (size_t slot = 0; slot < slots.size(); slot++)
+	{
+		if (std::find(idle.begin(), idle.end(), slot) == idle.end())
+			finish(slot, KELF_ERROR_READ_FAILED);
+	}
+	while (next < jobs.size())
+		Finish(jobs[next++], KELF_ERROR_READ_FAILED, noSignature);
+
+	close(wakeup);
+
+	printf("I/O: io_uring, queue depth %u, %s buffers\n", queueDepth, ring.HasRegisteredBuffers() ? "registered" : "unregistered");
+	return true;
+}
+
+#else
+
+bool Batch::RunPipelined(unsigned& threadCount)
+{
+	return false;
+}
+
+#endif
+
+int Batch::Run(unsigned threadCount)
+{
+	failed = 0;
+	skipped = 0;
+	bytes = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	size_t resumed = 0;
+	if (journal != NULL)
+	{
+		std::vector<Job> pending;
+		for (const Job& job : jobs)
+			if (!journal->IsDone(job.Input, job.Size))
+				pending.push_back(job);
+		resumed = jobs.size() - pending.size();
+		jobs.swap(pending);
+	}
+
+	// The cache works on files, so with one in use everything stays on the
+	// pool.
+	bool pipelined = false;
+	if (io != BATCH_IO_SYNC && !(cache && cache->IsOpen()))
+		pipelined = RunPipelined(threadCount);
+	if (!pipelined)
+	{
+		if (io == BATCH_IO_URING)
+			fprintf(stderr, "io_uring is not available, falling back to the thread pool\n");
+		RunPool(threadCount);
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	size_t processed = jobs.size() - skipped;
+	printf("Processed %zu files (%d failed) on %u threads in %.3f s\n", processed, failed.load(), threadCount, seconds);
+	if (skipped > 0)
+		printf("Skipped %d files that are no KELF\n", skipped.load());
+	if (resumed > 0)
+		printf("Skipped %zu files done in an earlier run\n", resumed);
+	printf("Throughput: %.2f MiB/s, %.1f files/s\n", bytes / seconds / (1024 * 1024), (processed - failed) / seconds);
+
+	return failed;
+}
+
+// Writes text to filename through a temporary file, so readers on other
+// machines never see half of it.
+static bool writeAtomically(const fs::path& filename, const std::string& text)
+{
+	std::string temporary = filename.string() + ".tmp";
+	FILE* f = fopen(temporary.c_str(), "wb");
+	if (f == NULL)
+		return false;
+	bool written = fwrite(text.data(), 1, text.size(), f) == text.size();
+	written = fclose(f) == 0 && written;
+
+	std::error_code ec;
+	if (written)
+		fs::rename(temporary, filename, ec);
+	if (!written || ec)
+	{
+		fs::remove(temporary, ec);
+		return false;
+	}
+	return true;
+}
+
+static bool isShardList(const fs::path& path)
+{
+	std::string name = path.filename().string();
+	return name.compare(0, strlen(BATCH_SHARD_PREFIX), BATCH_SHARD_PREFIX) == 0 && path.extension() == BATCH_SHARD_LIST;
+}
+
+int Batch::WriteShards(std::string directory, unsigned count)
+{
+	if (jobs.empty())
+		return BATCH_ERROR_NO_INPUT;
+	if (count == 0)
+		count = 1;
+
+	std::error_code ec;
+	fs::create_directories(directory, ec);
+
+	// Largest files first, each onto the shard with the fewest bytes so far
+	// and the lowest number among those. Ties in size go by path, so the
+	// order of enumeration does not matter.
+	std::vector<size_t> order(jobs.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		if (jobs[a].Size != jobs[b].Size)
+			return jobs[a].Size > jobs[b].Size;
+		return jobs[a].Input < jobs[b].Input;
+	});
+
+	std::vector<uint64_t> load(count, 0);
+	std::vector<std::vector<size_t>> shards(count);
+	for (size_t job : order)
+	{
+		size_t shard = std::min_element(load.begin(), load.end()) - load.begin();
+		shards[shard].push_back(job);
+		load[shard] += std::max<uint64_t>(jobs[job].Size, 1);
+	}
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		std::sort(shards[i].begin(), shards[i].end(), [&](size_t a, size_t b) { return jobs[a].Input < jobs[b].Input; });
+		std::string text;
+		for (size_t job : shards[i])
+			text += jobs[job].Input + "\t" + jobs[job].Output + "\n";
+
+		char name[32];
+		snprintf(name, sizeof(name), BATCH_SHARD_PREFIX "%04u" BATCH_SHARD_LIST, i);
+		if (!writeAtomically(fs::path(directory) / name, text))
+			return BATCH_ERROR_WRITE_FAILED;
+	}
+
+	// Lists of an earlier split into more shards would be merged too.
+	for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+	{
+		unsigned index;
+		std::string name = it->path().filename().string();
+		if (isShardList(it->path()) && sscanf(name.c_str(), BATCH_SHARD_PREFIX "%u", &index) == 1 && index >= count)
+			fs::remove(it->path(), ec);
+	}
+
+	return 0;
+}
+
+int Batch::MergeShards(std::string directory, std::string report)
+{
+	std::error_code ec;
+	std::vector<fs::path> lists;
+	for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+		if (isShardList(it->path()))
+			lists.push_back(it->path());
+	if (ec)
+		return BATCH_ERROR_OPEN_FAILED;
+	if (lists.empty())
+		return BATCH_ERROR_NO_INPUT;
+	std::sort(lists.begin(), lists.end());
+
+	size_t files = 0, done = 0, failures = 0, notKelf = 0, missing = 0;
+	std::string text;
+	for (const fs::path& list : lists)
+	{
+		std::ifstream infile(list);
+		if (infile.fail())
+			return BATCH_ERROR_OPEN_FAILED;
+
+		// A shard without a journal has not started yet.
+		std::string shard = list.stem().string();
+		fs::path journalPath = list;
+		journalPath.replace_extension(BATCH_SHARD_JOURNAL);
+		std::map<std::string, JournalRecord> records;
+		Journal::Read(journalPath.string(), records);
+
+		std::string line;
+		while (std::getline(infile, line))
+		{
+			if (line.empty())
+				continue;
+			files++;
+			std::string input = line.substr(0, line.find('\t'));
+
+			std::map<std::string, JournalRecord>::const_iterator it = records.find(input);
+			if (it == records.end())
+			{
+				missing++;
+				text += shard + "\tmissing\t-\t-\t" + input + "\t-\n";
+				continue;
+			}
+
+			const JournalRecord& record = it->second;
+			const char* status = "ok";
+			if (record.Result == BATCH_JOB_SKIPPED)
+				status = "skipped", notKelf++;
+			else if (record.Result != 0)
+				status = "failed", failures++;
+			else
+				done++;
+
+			char signature[17];
+			for (int i = 0; i < 8; i++)
+				snprintf(signature + i * 2, 3, "%02x", record.Signature[i]);
+			text += shard + "\t" + status + "\t" + std::to_string(record.Result) + "\t" + signature + "\t" + input + "\t" + record.Output + "\n";
+		}
+	}
+
+	if (report == "-")
+	{
+		fputs(text.c_str(), stdout);
+		return (int)(failures + missing);
+	}
+	if (!writeAtomically(report, text))
+		return BATCH_ERROR_WRITE_FAILED;
+
+	printf("Merged %zu shards: %zu files, %zu done, %zu failed, %zu no KELF, %zu missing\n", lists.size(), files, done, failures, notKelf, missing);
+	return (int)(failures + missing);
+}
+
+std::string Batch::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case BATCH_ERROR_OPEN_FAILED: return "Failed to open batch input!";
+	case BATCH_ERROR_NO_INPUT: return "No input files found!";
+	case BATCH_ERROR_WRITE_FAILED: return "Failed to write shard files!";
+	default: return "Unknown error";
+	}
+}
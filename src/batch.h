@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+
+class Cache;
+class Journal;
+
+#define BATCH_ERROR_OPEN_FAILED -1
+#define BATCH_ERROR_NO_INPUT -2
+#define BATCH_ERROR_WRITE_FAILED -3
+
+// ProcessJob result for files of an image that are no KELF
+#define BATCH_JOB_SKIPPED 1
+
+#define BATCH_MODE_DECRYPT 0
+#define BATCH_MODE_ENCRYPT 1
+
+#define BATCH_IO_AUTO 0
+#define BATCH_IO_URING 1
+#define BATCH_IO_SYNC 2
+
+#define BATCH_DEFAULT_QUEUE_DEPTH 16
+
+// Files up to this size are read into and written from registered buffers
+// by io_uring, larger ones are processed like with synchronous I/O.
+#define BATCH_BUFFER_SIZE (1024 * 1024)
+
+// Work split over several machines sharing a file system: WriteShards puts
+// shard-NNNN.list files into a manifest directory. Each is a file list with
+// a tab and the output path relative to the output directory on every
+// line, which a worker runs as a batch, with --journal shard-NNNN.journal
+// next to it to be able to resume. MergeShards puts the journals together.
+#define BATCH_SHARD_PREFIX "shard-"
+#define BATCH_SHARD_LIST ".list"
+#define BATCH_SHARD_JOURNAL ".journal"
+#define BATCH_SHARD_REPORT "report.tsv"
+
+class Batch
+{
+	struct Job
+	{
+		std::string Input;
+		std::string Output;
+		uint64_t Size;
+		bool Probe; // skip the file if it is no KELF
+		std::string Source; // file the data is read from, the image for image files
+		uint64_t Offset; // of the data within Source
+	};
+
+	const KeyRing* keyRing;
+	Cache* cache;
+	Journal* journal;
+	int mode;
+	int io;
+	unsigned queueDepth;
+	size_t keySet;
+	std::vector<Job> jobs;
+
+	std::mutex outputLock;
+	std::atomic<int> failed;
+	std::atomic<int> skipped;
+	std::atomic<uint64_t> bytes;
+
+	int ProcessJob(const Job& job, uint8_t* signature);
+	int ProcessBuffer(const uint8_t* data, size_t size, std::vector<uint8_t>& heap, uint8_t*& output, size_t& outputSize, uint8_t* signature);
+	void Finish(const Job& job, int ret, const uint8_t* signature);
+
+	void RunPool(unsigned& threadCount);
+	bool RunPipelined(unsigned& threadCount);
+
+public:
+	Batch(const KeyRing& _keyRing, int _mode)
+		: keyRing(&_keyRing), cache(NULL), journal(NULL), mode(_mode), io(BATCH_IO_AUTO), queueDepth(BATCH_DEFAULT_QUEUE_DEPTH), keySet(0) { }
+	// Without keys a batch can only collect its input for WriteShards.
+	Batch()
+		: keyRing(NULL), cache(NULL), journal(NULL), mode(BATCH_MODE_DECRYPT), io(BATCH_IO_AUTO), queueDepth(BATCH_DEFAULT_QUEUE_DEPTH), keySet(0) { }
+
+	// Decryption goes through cache when it is set.
+	void SetCache(Cache* _cache) { cache = _cache; }
+
+	// Every finished file is recorded in journal, and Run leaves out the
+	// ones it says are done.
+	void SetJournal(Journal* _journal) { journal = _journal; }
+
+	// BATCH_IO_AUTO reads and writes through io_uring where the kernel has it
+	// and no cache is in use, BATCH_IO_SYNC always on the thread pool.
+	void SetIo(int _io) { io = _io; }
+	// Files in flight at once with io_uring.
+	void SetQueueDepth(unsigned depth) { queueDepth = depth; }
+	// Index into the ring of the keyset to encrypt with.
+	void SetKeySet(size_t index) { keySet = index; }
+
+	int AddInput(std::string input, std::string outputDir);
+	int AddDirectory(std::string input, std::string outputDir);
+	// One path per line, optionally followed by a tab and the output path
+	// relative to outputDir. <image>::<path> names a file of an image.
+	int AddFileList(std::string list, std::string outputDir);
+
+	// Every file of an ISO9660 image, read in place.
+	int AddImage(std::string image, std::string outputDir);
+
+	// Returns the number of files that failed.
+	int Run(unsigned threadCount);
+
+	// Splits the collected files, added with an empty output directory, into
+	// count shards of about the same number of bytes in directory. The same
+	// input always gives the same shards.
+	int WriteShards(std::string directory, unsigned count);
+
+	// Writes one tab separated line per file of the shards in directory:
+	//   <shard> <ok|failed|skipped|missing> <result> <signature> <input> <output>
+	// to report, "-" for stdout. Returns the number of files that failed or
+	// are missing, or an error.
+	static int MergeShards(std::string directory, std::string report);
+
+	static std::string getErrorString(int err);
+};
+
+#endif
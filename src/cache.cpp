@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "cache.h"
+#include "fileio.h"
+#include "kelf.h"
+
+namespace fs = std::filesystem;
+
+static std::string toHex(const uint8_t* data, size_t length)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (size_t i = 0; i < length; i++)
+	{
+		hex += digits[data[i] >> 4];
+		hex += digits[data[i] & 15];
+	}
+	return hex;
+}
+
+// Shares the blocks of from with to where the file system can, copies them
+// otherwise.
+static bool cloneFile(const std::string& from, const std::string& to)
+{
+#ifdef __linux__
+	int src = open(from.c_str(), O_RDONLY);
+	if (src < 0)
+		return false;
+	int dst = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (dst < 0)
+	{
+		close(src);
+		return false;
+	}
+	int ret = ioctl(dst, FICLONE, src);
+	close(dst);
+	close(src);
+	if (ret == 0)
+		return true;
+#endif
+
+	std::error_code ec;
+	return fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec) && !ec;
+}
+
+// Unique within the directory across threads and processes sharing it.
+static std::string temporaryName(const std::string& dir)
+{
+	static std::atomic<unsigned> counter(0);
+	return dir + "/tmp-" + std::to_string(getpid()) + "-" +
+		std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "-" +
+		std::to_string(counter++);
+}
+
+Cache::Cache(const KeyRing& _ring) : ring(_ring), limit(CACHE_DEFAULT_SIZE)
+{
+	// Results depend on the keys, so they are part of every entry's key.
+	memcpy(keyDigest, ring.GetDigest(), sizeof(keyDigest));
+}
+
+int Cache::Open(std::string directory, uint64_t sizeLimit)
+{
+	std::error_code ec;
+	fs::create_directories(directory, ec);
+	if (!fs::is_directory(directory, ec))
+		return CACHE_ERROR_OPEN_FAILED;
+
+	dir = directory;
+	limit = sizeLimit;
+	return 0;
+}
+
+int Cache::GetKey(std::string input, std::string& key)
+{
+	InputFile in;
+	if (in.Open(input) != 0 || in.Load() != 0)
+		return CACHE_ERROR_OPEN_FAILED;
+
+	const uint8_t* data = in.Data();
+	size_t size = in.Size();
+	if (size < sizeof(KELFHeader) + 8)
+		return CACHE_ERROR_NOT_KELF;
+	size_t HeaderSize = ((const KELFHeader*)data)->HeaderSize;
+	if (HeaderSize < sizeof(KELFHeader) + 16 || HeaderSize > size)
+		return CACHE_ERROR_NOT_KELF;
+
+	uint8_t digest[32];
+	EVP_MD_CTX* md = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	EVP_DigestUpdate(md, keyDigest, sizeof(keyDigest));
+	EVP_DigestUpdate(md, data, size);
+	EVP_DigestFinal_ex(md, digest, NULL);
+	EVP_MD_CTX_free(md);
+
+	// header signature, root signature, digest
+	key = toHex(data + sizeof(KELFHeader), 8) + toHex(data + HeaderSize - 8, 8) + "-" + toHex(digest, sizeof(digest));
+	return 0;
+}
+
+int Cache::Lookup(const std::string& key, const std::string* output, int& result)
+{
+	std::string base = dir + "/" + key;
+
+	FILE* f = fopen((base + ".result").c_str(), "r");
+	if (f == NULL)
+		return CACHE_ERROR_MISS;
+	int found = fscanf(f, "%d", &result);
+	fclose(f);
+	if (found != 1)
+		return CACHE_ERROR_MISS;
+
+	// An entry left by verify has no content to hand out.
+	if (output && result == 0 && !cloneFile(base + ".content", *output))
+		return CACHE_ERROR_MISS;
+
+	std::error_code ec;
+	fs::last_write_time(base + ".result", fs::file_time_type::clock::now(), ec);
+	return 0;
+}
+
+int Cache::Store(const std::string& key, const std::string* output, int result)
+{
+	std::string base = dir + "/" + key;
+	std::error_code ec;
+
+	// The content goes in first, so whoever sees the result finds it. Content
+	// that alone exceeds the limit would only flush everything else.
+	if (output && result == 0 && fs::file_size(*output, ec) <= limit && !ec)
+	{
+		std::string temporary = temporaryName(dir);
+		if (!cloneFile(*output, temporary))
+		{
+			fs::remove(temporary, ec);
+			return CACHE_ERROR_WRITE_FAILED;
+		}
+		fs::rename(temporary, base + ".content", ec);
+		if (ec)
+		{
+			fs::remove(temporary, ec);
+			return CACHE_ERROR_WRITE_FAILED;
+		}
+	}
+
+	std::string temporary = temporaryName(dir);
+	FILE* f = fopen(temporary.c_str(), "w");
+	if (f == NULL)
+		return CACHE_ERROR_WRITE_FAILED;
+	bool written = fprintf(f, "%d\n", result) > 0;
+	written = fclose(f) == 0 && written;
+	if (written)
+		fs::rename(temporary, base + ".result", ec);
+	if (!written || ec)
+	{
+		fs::remove(temporary, ec);
+		return CACHE_ERROR_WRITE_FAILED;
+	}
+
+	Evict();
+	return 0;
+}
+
+void Cache::Evict()
+{
+	struct Entry
+	{
+		uint64_t Size = 0;
+		fs::file_time_type Used = fs::file_time_type::min();
+	};
+
+	std::error_code ec;
+	std::map<std::string, Entry> entries;
+	uint64_t total = 0;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+	{
+		std::string name = it->path().filename().string();
+		size_t dot = name.rfind('.');
+		if (dot == std::string::npos || name.compare(0, 4, "tmp-") == 0)
+			continue;
+
+		std::error_code entryError;
+		uint64_t size = it->file_size(entryError);
+		if (entryError)
+			continue;
+
+		Entry& entry = entries[name.substr(0, dot)];
+		entry.Size += size;
+		total += size;
+		if (name.compare(dot, std::string::npos, ".result") == 0)
+			entry.Used = it->last_write_time(entryError);
+	}
+
+	if (total <= limit)
+		return;
+
+	std::vector<std::pair<fs::file_time_type, std::string>> order;
+	for (const auto& entry : entries)
+		order.push_back({ entry.second.Used, entry.first });
+	std::sort(order.begin(), order.end());
+
+	for (const auto& victim : order)
+	{
+		if (total <= limit)
+			break;
+
+		// The result goes first, so readers never find it without content.
+		std::string base = dir + "/" + victim.second;
+		fs::remove(base + ".result", ec);
+		fs::remove(base + ".content", ec);
+		total -= entries[victim.second].Size;
+	}
+}
+
+// Results that only depend on the bytes of the input and the keys. Failing
+// to open, read or write a file, or finding it shorter than it claims
+// while reading, may turn out differently next time.
+static bool isContentResult(int result)
+{
+	switch (result)
+	{
+	case 0:
+	case KELF_ERROR_INVALID_DES_KEY_COUNT:
+	case KELF_ERROR_INVALID_HEADER_SIGNATURE:
+	case KELF_ERROR_INVALID_BIT_TABLE_SIZE:
+	case KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE:
+	case KELF_ERROR_INVALID_ROOT_SIGNATURE:
+	case KELF_ERROR_INVALID_CONTENT_SIGNATURE:
+	case KELF_ERROR_UNSUPPORTED_FILE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int Cache::Run(std::string input, const std::string* output, std::function<int()> work)
+{
+	// Hashing stdin would use it up before work reads it, and stdout can't
+	// be served from the cache.
+	bool standard = input == FILEIO_STANDARD_STREAM || (output != NULL && *output == FILEIO_STANDARD_STREAM);
+	std::string key;
+	if (!IsOpen() || standard || GetKey(input, key) != 0)
+		return work();
+
+	int result;
+	if (Lookup(key, output, result) == 0)
+		return result;
+
+	result = work();
+	if (isContentResult(result))
+		Store(key, output, result);
+
+	return result;
+}
+
+std::string Cache::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case CACHE_ERROR_OPEN_FAILED: return "Failed to open cache or input!";
+	case CACHE_ERROR_NOT_KELF: return "Input is not a KELF file!";
+	case CACHE_ERROR_MISS: return "Not in cache!";
+	case CACHE_ERROR_WRITE_FAILED: return "Failed to write cache entry!";
+	default:
+		return "Unknown error!";
+	}
+}
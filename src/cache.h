@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include "crypto.h"
+
+#define CACHE_ERROR_OPEN_FAILED -1
+#define CACHE_ERROR_NOT_KELF -2
+#define CACHE_ERROR_MISS -3
+#define CACHE_ERROR_WRITE_FAILED -4
+
+// Cache directory and its size limit in MiB, read by the command line tool
+#define CACHE_DIR_ENV "KELFTOOL_CACHE"
+#define CACHE_SIZE_ENV "KELFTOOL_CACHE_SIZE"
+#define CACHE_DEFAULT_SIZE (1024ull * 1024 * 1024)
+
+// On-disk cache of decrypt and verify results. An entry is keyed by the
+// header and root signatures of the input together with a SHA-256 over the
+// whole input and the loaded keys, and holds the result code and, for a
+// successful decrypt, the decrypted content. Hits are served by a reflink
+// where the file system supports it and a copy otherwise. The least
+// recently used entries are evicted once the directory grows past its
+// limit. Several processes may share one directory.
+class Cache
+{
+	const KeyRing& ring;
+	std::string dir;
+	uint64_t limit;
+	uint8_t keyDigest[32];
+
+	int GetKey(std::string input, std::string& key);
+	int Lookup(const std::string& key, const std::string* output, int& result);
+	int Store(const std::string& key, const std::string* output, int result);
+	void Evict();
+
+public:
+	Cache(const KeyRing& _ring);
+
+	// Without a successful Open the cache is disabled and Run just does the
+	// work.
+	int Open(std::string directory, uint64_t sizeLimit);
+	bool IsOpen() const { return !dir.empty(); }
+
+	// Runs work, which decrypts input to output or only verifies it when
+	// output is NULL, unless the cache already knows its result. Results
+	// that depend on more than the input, like failing to open, read or
+	// write a file, are not kept. stdin and stdout bypass the cache.
+	int Run(std::string input, const std::string* output, std::function<int()> work);
+
+	static std::string getErrorString(int err);
+};
+
+#endif
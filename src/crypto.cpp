@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include "crypto.h"
+#include "desbitslice.h"
+
+const uint8_t MG_IV_NULL[8] = { 0 };
+
+void DesKey::Set(const void* key, int keycount)
+{
+	KeyCount = keycount;
+	for (int i = 0; i < keycount && i < 3; i++)
+	{
+		memcpy(Raw + i * 8, (const uint8_t*)key + i * 8, 8);
+		DES_set_key_unchecked((const_DES_cblock*)((const uint8_t*)key + i * 8), &Schedules[i]);
+		DesBitslice::ExpandKey((const uint8_t*)key + i * 8, Subkeys[i]);
+	}
+}
+
+int TdesCbcCfb64Encrypt(void* Result, const void* Data, size_t Length, const DesKey& Key, const void* IV)
+{
+	DES_key_schedule* sc = (DES_key_schedule*)Key.Schedules;
+
+	DES_cblock iv;
+	memcpy(&iv, IV, 8);
+
+	if (Key.KeyCount == 1)
+		DES_ncbc_encrypt((const uint8_t*)Data, (uint8_t*)Result, Length, &sc[0], &iv, DES_ENCRYPT);
+	else if (Key.KeyCount == 2)
+		DES_ede3_cbc_encrypt((const uint8_t*)Data, (uint8_t*)Result, Length, &sc[0], &sc[1], &sc[0], &iv, DES_ENCRYPT);
+	else if (Key.KeyCount == 3)
+		DES_ede3_cbc_encrypt((const uint8_t*)Data, (uint8_t*)Result, Length, &sc[0], &sc[1], &sc[2], &iv, DES_ENCRYPT);
+	else
+		return CRYPTO_ERROR_INVALID_DES_KEY_COUNT;
+
+	return 0;
+}
+
+int TdesCbcCfb64Decrypt(void* Result, const void* Data, size_t Length, const DesKey& Key, const void* IV)
+{
+	DES_key_schedule* sc = (DES_key_schedule*)Key.Schedules;
+
+	if (Key.KeyCount < 1 || Key.KeyCount > 3)
+		return CRYPTO_ERROR_INVALID_DES_KEY_COUNT;
+
+	// Blocks decrypt independently, so the bitsliced engine takes the tail and
+	// OpenSSL whatever is left in front of it. The tail goes first as it
+	// chains off the last ciphertext block of the head, which an in place
+	// decryption of the head would overwrite.
+	size_t bulk = DesBitslice::GetBulkLength(Length);
+	if (bulk != 0)
+	{
+		size_t head = Length - bulk;
+		const uint8_t* chain = head ? (const uint8_t*)Data + head - 8 : (const uint8_t*)IV;
+		DesBitslice::CbcDecrypt((uint8_t*)Result + head, (const uint8_t*)Data + head, bulk, Key, chain);
+		if (head == 0)
+			return 0;
+		Length = head;
+	}
+
+	DES_cblock iv;
+	memcpy(&iv, IV, 8);
+
+	if (Key.KeyCount == 1)
+		DES_ncbc_encrypt((const uint8_t*)Data, (uint8_t*)Result, Length, &sc[0], &iv, DES_DECRYPT);
+	else if (Key.KeyCount == 2)
+		DES_ede3_cbc_encrypt((const uint8_t*)Data, (uint8_t*)Result, Length, &sc[0], &sc[1], &sc[0], &iv, DES_DECRYPT);
+	else if (Key.KeyCount == 3)
+		DES_ede3_cbc_encrypt((const uint8_t*)Data, (uint8_t*)Result, Length, &sc[0], &sc[1], &sc[2], &iv, DES_DECRYPT);
+	else
+		return CRYPTO_ERROR_INVALID_DES_KEY_COUNT;
+
+	return 0;
+}
+
+CryptoContext::CryptoContext(const KeyStore& ks)
+{
+	SignatureMasterKey.Set(ks.GetSignatureMasterKey().data(), 1);
+	SignatureHashKey.Set(ks.GetSignatureHashKey().data(), 1);
+
+	uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
+	memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
+	memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
+	SignatureMasterAndHashKey.Set(MG_SIG_MASTER_AND_HASH_KEY, 2);
+
+	KbitMasterKey.Set(ks.GetKbitMasterKey().data(), 2);
+	KcMasterKey.Set(ks.GetKcMasterKey().data(), 2);
+	RootSignatureMasterKey.Set(ks.GetRootSignatureMasterKey().data(), 1);
+	RootSignatureHashKey.Set(ks.GetRootSignatureHashKey().data(), 2);
+
+	memcpy(KbitIV, ks.GetKbitIV().data(), 8);
+	memcpy(KcIV, ks.GetKcIV().data(), 8);
+	memcpy(ContentTableIV, ks.GetContentTableIV().data(), 8);
+	memcpy(ContentIV, ks.GetContentIV().data(), 8);
+}
+
+KeyRing::KeyRing(const std::vector<KeyStore>& keysets)
+{
+	for (const KeyStore& ks : keysets)
+	{
+		contexts.emplace_back(ks);
+		names.push_back(ks.GetName());
+	}
+
+	EVP_MD_CTX* md = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	for (const CryptoContext& ctx : contexts)
+	{
+		const DesKey* keys[] = {
+			&ctx.GetSignatureMasterKey(), &ctx.GetSignatureHashKey(),
+			&ctx.GetKbitMasterKey(), &ctx.GetKcMasterKey(),
+			&ctx.GetRootSignatureMasterKey(), &ctx.GetRootSignatureHashKey(),
+		};
+		const uint8_t* ivs[] = { ctx.GetKbitIV(), ctx.GetKcIV(), ctx.GetContentTableIV(), ctx.GetContentIV() };
+
+		for (const DesKey* key : keys)
+			EVP_DigestUpdate(md, key->Raw, key->KeyCount * 8);
+		for (const uint8_t* iv : ivs)
+			EVP_DigestUpdate(md, iv, 8);
+	}
+	EVP_DigestFinal_ex(md, digest, NULL);
+	EVP_MD_CTX_free(md);
+}
+
+int KeyRing::Find(const std::string& name) const
+{
+	for (size_t i = 0; i < names.size(); i++)
+		if (names[i] == name)
+			return (int)i;
+	return -1;
+}
+
+size_t KeyRing::GetLastMatch(uint8_t systemType, uint8_t applicationType) const
+{
+	std::shared_lock<std::shared_mutex> guard(lock);
+	std::map<uint16_t, size_t>::const_iterator it = lastMatch.find(systemType << 8 | applicationType);
+	return it != lastMatch.end() ? it->second : 0;
+}
+
+void KeyRing::SetLastMatch(uint8_t systemType, uint8_t applicationType, size_t index) const
+{
+	std::unique_lock<std::shared_mutex> guard(lock);
+	lastMatch[systemType << 8 | applicationType] = index;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CRYPTO_H__
+#define __CRYPTO_H__
+
+#include <openssl/des.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "keystore.h"
+
+#define CRYPTO_ERROR_INVALID_DES_KEY_COUNT -1
+
+extern const uint8_t MG_IV_NULL[8];
+
+// DES key schedules prepared once and reused for every call.
+struct DesKey
+{
+	DES_key_schedule Schedules[3];
+	uint64_t Subkeys[3][16]; // for DesBitslice
+	uint8_t Raw[24];
+	int KeyCount;
+
+	DesKey() : KeyCount(0) { }
+	DesKey(const void* key, int keycount) { Set(key, keycount); }
+
+	void Set(const void* key, int keycount);
+};
+
+int TdesCbcCfb64Encrypt(void* Result, const void* Data, size_t Length, const DesKey& Key, const void* IV);
+int TdesCbcCfb64Decrypt(void* Result, const void* Data, size_t Length, const DesKey& Key, const void* IV);
+
+// Everything derived from a loaded KeyStore that is needed to process files.
+// It is immutable after construction and can be shared between threads.
+class CryptoContext
+{
+	DesKey SignatureMasterKey;
+	DesKey SignatureHashKey;
+	DesKey SignatureMasterAndHashKey;
+	DesKey KbitMasterKey;
+	DesKey KcMasterKey;
+	DesKey RootSignatureMasterKey;
+	DesKey RootSignatureHashKey;
+	uint8_t KbitIV[8];
+	uint8_t KcIV[8];
+	uint8_t ContentTableIV[8];
+	uint8_t ContentIV[8];
+
+public:
+	CryptoContext(const KeyStore& ks);
+
+	const DesKey& GetSignatureMasterKey() const { return SignatureMasterKey; }
+	const DesKey& GetSignatureHashKey() const { return SignatureHashKey; }
+	const DesKey& GetSignatureMasterAndHashKey() const { return SignatureMasterAndHashKey; }
+	const DesKey& GetKbitMasterKey() const { return KbitMasterKey; }
+	const DesKey& GetKcMasterKey() const { return KcMasterKey; }
+	const DesKey& GetRootSignatureMasterKey() const { return RootSignatureMasterKey; }
+	const DesKey& GetRootSignatureHashKey() const { return RootSignatureHashKey; }
+	const uint8_t* GetKbitIV() const { return KbitIV; }
+	const uint8_t* GetKcIV() const { return KcIV; }
+	const uint8_t* GetContentTableIV() const { return ContentTableIV; }
+	const uint8_t* GetContentIV() const { return ContentIV; }
+};
+
+// CryptoContexts of every keyset of a keystore. Kelf tries them against the
+// header signature of the files it loads, starting with the keyset that
+// matched the last file of the same SystemType and ApplicationType, which
+// the ring remembers. Can be shared between threads.
+class KeyRing
+{
+	std::vector<CryptoContext> contexts;
+	std::vector<std::string> names;
+	uint8_t digest[32];
+
+	mutable std::shared_mutex lock;
+	mutable std::map<uint16_t, size_t> lastMatch;
+
+public:
+	KeyRing(const std::vector<KeyStore>& keysets);
+
+	size_t GetCount() const { return contexts.size(); }
+	const CryptoContext& Get(size_t index) const { return contexts[index]; }
+	const std::string& GetName(size_t index) const { return names[index]; }
+
+	// SHA-256 over every key and IV of every keyset, for keeping results
+	// that depend on the keys apart.
+	const uint8_t* GetDigest() const { return digest; }
+
+	// Index of the keyset called name, -1 if there is none.
+	int Find(const std::string& name) const;
+
+	// Keyset to try first for a header, 0 until one of its kind matched.
+	size_t GetLastMatch(uint8_t systemType, uint8_t applicationType) const;
+	void SetLastMatch(uint8_t systemType, uint8_t applicationType, size_t index) const;
+};
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "desbitslice.h"
+#include "crypto.h"
+
+// Standard DES tables, bit numbers are 1 based from the most significant
+// bit like in FIPS 46-3.
+static const uint8_t IP_TABLE[64] = {
+	58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+	62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+	57, 49, 41, 33, 25, 17, 9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+	61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7,
+};
+
+static const uint8_t E_TABLE[48] = {
+	32, 1, 2, 3, 4, 5, 4, 5, 6, 7, 8, 9,
+	8, 9, 10, 11, 12, 13, 12, 13, 14, 15, 16, 17,
+	16, 17, 18, 19, 20, 21, 20, 21, 22, 23, 24, 25,
+	24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32, 1,
+};
+
+static const uint8_t P_TABLE[32] = {
+	16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+	2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25,
+};
+
+static const uint8_t PC1_TABLE[56] = {
+	57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+	10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+	63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+	14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4,
+};
+
+static const uint8_t PC2_TABLE[48] = {
+	14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+	23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+	41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+	44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32,
+};
+
+static const uint8_t SHIFTS[16] = { 1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1 };
+
+static const uint8_t SBOX_TABLE[8][64] = {
+	{
+		14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7,
+		0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8,
+		4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0,
+		15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13,
+	},
+	{
+		15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10,
+		3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5,
+		0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15,
+		13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9,
+	},
+	{
+		10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8,
+		13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1,
+		13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7,
+		1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12,
+	},
+	{
+		7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15,
+		13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9,
+		10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4,
+		3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14,
+	},
+	{
+		2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9,
+		14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6,
+		4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14,
+		11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3,
+	},
+	{
+		12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11,
+		10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8,
+		9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6,
+		4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13,
+	},
+	{
+		4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1,
+		13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6,
+		1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2,
+		6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12,
+	},
+	{
+		13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7,
+		1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2,
+		7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8,
+		2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11,
+	},
+};
+
+// Zero based tables used by the kernels, derived from the ones above.
+static uint8_t DES_IP[64];
+static uint8_t DES_FP[64];
+static uint8_t DES_E[48];
+static uint8_t DES_P_INVERSE[32];
+
+// For S-box s, output bit o and the 16 values of the four high inputs, the
+// truth table of the output over the two low inputs (b5, b6).
+static uint8_t SboxGroups[8][4][16];
+
+static void InitTables()
+{
+	for (int i = 0; i < 64; i++)
+	{
+		DES_IP[i] = IP_TABLE[i] - 1;
+		DES_FP[IP_TABLE[i] - 1] = i;
+	}
+	for (int i = 0; i < 48; i++)
+		DES_E[i] = E_TABLE[i] - 1;
+	for (int i = 0; i < 32; i++)
+		DES_P_INVERSE[P_TABLE[i] - 1] = i;
+
+	for (int s = 0; s < 8; s++)
+	{
+		for (int o = 0; o < 4; o++)
+		{
+			for (int g = 0; g < 16; g++)
+			{
+				uint8_t table = 0;
+				for (int low = 0; low < 4; low++)
+				{
+					// Input b1..b6: b1 and b6 pick the row, b2..b5 the column.
+					int v = g << 2 | low;
+					int row = (v >> 4 & 2) | (v & 1);
+					int column = v >> 1 & 15;
+					if (SBOX_TABLE[s][row * 16 + column] >> (3 - o) & 1)
+						table |= 1 << low;
+				}
+				SboxGroups[s][o][g] = table;
+			}
+		}
+	}
+}
+
+static inline uint64_t LoadBlock(const uint8_t* data)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++)
+		value = value << 8 | data[i];
+	return value;
+}
+
+static inline void StoreBlock(uint8_t* data, uint64_t value)
+{
+	for (int i = 7; i >= 0; i--)
+	{
+		data[i] = (uint8_t)value;
+		value >>= 8;
+	}
+}
+
+// 64x64 bit matrix transpose, with bits numbered from the most significant
+// one: bit c of row r ends up as bit r of row c.
+static void Transpose64(uint64_t* a)
+{
+	uint64_t m = 0x00000000FFFFFFFFull;
+	for (int j = 32; j != 0; j >>= 1, m ^= m << j)
+	{
+		for (int k = 0; k < 64; k = ((k | j) + 1) & ~j)
+		{
+			uint64_t t = (a[k] ^ (a[k | j] >> j)) & m;
+			a[k] ^= t;
+			a[k | j] ^= t << j;
+		}
+	}
+}
+
+void DesBitslice::ExpandKey(const void* key, uint64_t* subkeys)
+{
+	uint64_t k = LoadBlock((const uint8_t*)key);
+
+	uint32_t C = 0;
+	uint32_t D = 0;
+	for (int i = 0; i < 28; i++)
+	{
+		C = C << 1 | (k >> (64 - PC1_TABLE[i]) & 1);
+		D = D << 1 | (k >> (64 - PC1_TABLE[28 + i]) & 1);
+	}
+
+	for (int r = 0; r < 16; r++)
+	{
+		C = ((C << SHIFTS[r]) | (C >> (28 - SHIFTS[r]))) & 0x0FFFFFFF;
+		D = ((D << SHIFTS[r]) | (D >> (28 - SHIFTS[r]))) & 0x0FFFFFFF;
+
+		uint64_t CD = (uint64_t)C << 28 | D;
+		uint64_t subkey = 0;
+		for (int b = 0; b < 48; b++)
+			subkey |= (CD >> (56 - PC2_TABLE[b]) & 1) << b;
+		subkeys[r] = subkey;
+	}
+}
+
+namespace scalar
+{
+	typedef uint64_t Vec;
+	static const size_t WORDS = 1;
+	static inline Vec Broadcast(uint64_t v) { return v; }
+
+#include "desbitslice_kernel.h"
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DESBITSLICE_X86
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2
+{
+	typedef uint64_t Vec __attribute__((vector_size(32)));
+	static const size_t WORDS = 4;
+	static inline Vec Broadcast(uint64_t v) { Vec r = { v, v, v, v }; return r; }
+
+#include "desbitslice_kernel.h"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace avx512
+{
+	typedef uint64_t Vec __attribute__((vector_size(64)));
+	static const size_t WORDS = 8;
+	static inline Vec Broadcast(uint64_t v) { Vec r = { v, v, v, v, v, v, v, v }; return r; }
+
+#include "desbitslice_kernel.h"
+}
+#pragma GCC pop_options
+#endif
+
+struct Engine
+{
+	const char* Name;
+	size_t Lanes;
+	// Smallest CBC decryption, in passes, and smallest message count worth
+	// handing to the engine.
+	size_t MinPasses;
+	size_t MinMacs;
+	void (*CbcDecrypt)(uint8_t*, const uint8_t*, size_t, const uint64_t (*)[16], int, const uint8_t*);
+	void (*CbcMac)(size_t, const uint8_t* const*, const size_t*, const uint64_t (*)[16], int, uint8_t (*)[8]);
+};
+
+// A pass costs the same however many lanes are filled, so the CBC-MAC
+// batch only wins past a fraction of the lanes. The scalar engine is slower
+// than OpenSSL either way and is there for comparisons only.
+static const Engine ENGINES[] = {
+#ifdef DESBITSLICE_X86
+	{ "avx512", avx512::LANES, 1, 160, avx512::CbcDecrypt, avx512::CbcMac },
+	{ "avx2", avx2::LANES, 1, 168, avx2::CbcDecrypt, avx2::CbcMac },
+#endif
+	{ "scalar", scalar::LANES, 0, (size_t)-1, scalar::CbcDecrypt, scalar::CbcMac },
+};
+
+static std::atomic<const Engine*> engine(NULL);
+static std::once_flag engineOnce;
+
+static bool IsSupported(const Engine& e)
+{
+#ifdef DESBITSLICE_X86
+	if (strcmp(e.Name, "avx512") == 0)
+		return __builtin_cpu_supports("avx512f");
+	if (strcmp(e.Name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return true;
+}
+
+static const Engine* Find(const char* name)
+{
+	for (const Engine& e : ENGINES)
+		if (strcmp(e.Name, name) == 0)
+			return IsSupported(e) ? &e : NULL;
+	return NULL;
+}
+
+static void Init()
+{
+	InitTables();
+
+	const char* forced = getenv("KELFTOOL_DES_ENGINE");
+	if (forced)
+	{
+		engine = Find(forced);
+		return;
+	}
+
+	for (const Engine& e : ENGINES)
+	{
+		if (e.MinPasses != 0 && IsSupported(e))
+		{
+			engine = &e;
+			return;
+		}
+	}
+}
+
+static const Engine* GetEngine()
+{
+	std::call_once(engineOnce, Init);
+	return engine;
+}
+
+const char* DesBitslice::GetEngineName()
+{
+	const Engine* e = GetEngine();
+	return e ? e->Name : "openssl";
+}
+
+size_t DesBitslice::GetLanes()
+{
+	const Engine* e = GetEngine();
+	return e ? e->Lanes : 0;
+}
+
+bool DesBitslice::SetEngine(const char* name)
+{
+	GetEngine();
+
+	if (strcmp(name, "openssl") == 0)
+	{
+		engine = NULL;
+		return true;
+	}
+
+	const Engine* e = Find(name);
+	if (e == NULL)
+		return false;
+
+	engine = e;
+	return true;
+}
+
+size_t DesBitslice::GetBulkLength(size_t Length)
+{
+	const Engine* e = GetEngine();
+	if (e == NULL || Length % 8 != 0)
+		return 0;
+
+	size_t passes = Length / 8 / e->Lanes;
+	if (passes == 0 || passes < e->MinPasses)
+		return 0;
+
+	return passes * e->Lanes * 8;
+}
+
+void DesBitslice::CbcDecrypt(void* Result, const void* Data, size_t Length, const DesKey& Key, const void* IV)
+{
+	GetEngine()->CbcDecrypt((uint8_t*)Result, (const uint8_t*)Data, Length / 8, Key.Subkeys, Key.KeyCount, (const uint8_t*)IV);
+}
+
+size_t DesBitslice::GetMacBatchMinimum()
+{
+	const Engine* e = GetEngine();
+	return e ? e->MinMacs : (size_t)-1;
+}
+
+void DesBitslice::CbcMac(size_t count, const uint8_t* const* data, const size_t* lengths, const DesKey& Key, uint8_t (*macs)[8])
+{
+	const Engine* e = GetEngine();
+	for (size_t i = 0; i < count; i += e->Lanes)
+	{
+		size_t batch = count - i < e->Lanes ? count - i : e->Lanes;
+		e->CbcMac(batch, data + i, lengths + i, Key.Subkeys, Key.KeyCount, macs + i);
+	}
+}
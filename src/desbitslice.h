@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DESBITSLICE_H__
+#define __DESBITSLICE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct DesKey;
+
+// Bitsliced DES for the data-parallel bulk operations: CBC decryption,
+// where every block can be decrypted independently, and many independent
+// CBC-MACs at once. The widest engine the CPU supports is picked at runtime
+// (AVX-512, AVX2); without one everything stays on OpenSSL.
+class DesBitslice
+{
+public:
+	// "avx512", "avx2", "scalar" or "openssl" when no engine is in use.
+	static const char* GetEngineName();
+
+	// Blocks processed per pass, 0 when no engine is in use.
+	static size_t GetLanes();
+
+	// Forces an engine by name, for benchmarks and comparisons. Fails if the
+	// CPU lacks support for it. Only to be called while no DES work is
+	// running, work in flight may have sized itself for the old engine.
+	static bool SetEngine(const char* name);
+
+	// The 16 round subkeys of one 8 byte DES key in the form the engines
+	// take. DesKey keeps them next to its OpenSSL schedules.
+	static void ExpandKey(const void* key, uint64_t* subkeys);
+
+	// How many bytes at the end of a Length byte CBC decryption the engine
+	// takes: whole passes only, 0 when it is not worth it.
+	static size_t GetBulkLength(size_t Length);
+
+	// CBC decryption of exactly GetBulkLength() bytes, may be in place.
+	static void CbcDecrypt(void* Result, const void* Data, size_t Length, const DesKey& Key, const void* IV);
+
+	// Least number of messages for which CbcMac beats one OpenSSL CBC pass
+	// per message.
+	static size_t GetMacBatchMinimum();
+
+	// count independent CBC-MACs with a null IV, the last ciphertext block
+	// of each message ends up in macs.
+	static void CbcMac(size_t count, const uint8_t* const* data, const size_t* lengths, const DesKey& Key, uint8_t (*macs)[8]);
+};
+
+#endif
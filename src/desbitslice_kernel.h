@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Bitsliced DES kernel. Included by desbitslice.cpp once per vector width,
+// inside a namespace that defines Vec (a 64 bit word or a GCC vector of
+// them), WORDS (64 bit words per Vec) and Broadcast(). Every Vec holds one
+// bit position of LANES = 64 * WORDS independent blocks.
+
+static const size_t LANES = 64 * WORDS;
+
+static inline Vec Mux(Vec a, Vec b, Vec select)
+{
+	return a ^ ((a ^ b) & select);
+}
+
+// Loads LANES big-endian blocks so that x[i] holds DES bit i + 1 of all of
+// them. Blocks past count are zero.
+static void Load(Vec* x, const uint8_t* const* blocks, size_t count)
+{
+	uint64_t words[64 * WORDS];
+	for (size_t w = 0; w < WORDS; w++)
+	{
+		uint64_t rows[64];
+		for (size_t r = 0; r < 64; r++)
+		{
+			size_t lane = w * 64 + r;
+			rows[r] = lane < count ? LoadBlock(blocks[lane]) : 0;
+		}
+		Transpose64(rows);
+		for (size_t i = 0; i < 64; i++)
+			words[i * WORDS + w] = rows[i];
+	}
+	memcpy(x, words, sizeof(words));
+}
+
+static void Store(const Vec* x, uint8_t* const* blocks, size_t count)
+{
+	uint64_t words[64 * WORDS];
+	memcpy(words, x, sizeof(words));
+	for (size_t w = 0; w < WORDS; w++)
+	{
+		uint64_t rows[64];
+		for (size_t i = 0; i < 64; i++)
+			rows[i] = words[i * WORDS + w];
+		Transpose64(rows);
+		for (size_t r = 0; r < 64; r++)
+		{
+			size_t lane = w * 64 + r;
+			if (lane < count)
+				StoreBlock(blocks[lane], rows[r]);
+		}
+	}
+}
+
+// All 16 boolean functions of the two lowest S-box inputs, indexed by their
+// truth table.
+static inline void Functions2(Vec b5, Vec b6, Vec* f)
+{
+	f[0] = b5 ^ b5;
+	f[1] = ~b5 & ~b6;
+	f[2] = ~b5 & b6;
+	f[4] = b5 & ~b6;
+	f[8] = b5 & b6;
+	f[3] = ~b5;
+	f[12] = b5;
+	f[5] = ~b6;
+	f[10] = b6;
+	f[6] = b5 ^ b6;
+	f[9] = ~f[6];
+	f[7] = ~f[8];
+	f[11] = ~f[4];
+	f[13] = ~f[2];
+	f[14] = ~f[1];
+	f[15] = ~f[0];
+}
+
+// Evaluates S-box s as a multiplexer tree over its truth table: the two low
+// inputs pick one of the precomputed functions, the other four select
+// between them.
+static inline void Sbox(int s, const Vec* in, Vec* out)
+{
+	Vec f[16];
+	Functions2(in[4], in[5], f);
+
+	for (int o = 0; o < 4; o++)
+	{
+		const uint8_t* groups = SboxGroups[s][o];
+
+		Vec l[16];
+		for (int g = 0; g < 16; g++)
+			l[g] = f[groups[g]];
+		for (int g = 0; g < 8; g++)
+			l[g] = Mux(l[2 * g], l[2 * g + 1], in[3]);
+		for (int g = 0; g < 4; g++)
+			l[g] = Mux(l[2 * g], l[2 * g + 1], in[2]);
+		for (int g = 0; g < 2; g++)
+			l[g] = Mux(l[2 * g], l[2 * g + 1], in[1]);
+		out[o] = Mux(l[0], l[1], in[0]);
+	}
+}
+
+// L ^= f(R, K)
+static inline void Round(Vec* L, const Vec* R, uint64_t subkey)
+{
+	for (int s = 0; s < 8; s++)
+	{
+		Vec in[6];
+		for (int t = 0; t < 6; t++)
+		{
+			int bit = s * 6 + t;
+			in[t] = R[DES_E[bit]] ^ Broadcast(0 - ((subkey >> bit) & 1));
+		}
+
+		Vec out[4];
+		Sbox(s, in, out);
+
+		for (int o = 0; o < 4; o++)
+			L[DES_P_INVERSE[s * 4 + o]] ^= out[o];
+	}
+}
+
+// Runs the 16 rounds of one DES stage on the (L, R) halves and leaves the
+// swapped preoutput (R16, L16) in (L, R) for the next stage.
+static inline void Stage(Vec* L, Vec* R, const uint64_t* subkeys, bool decrypt)
+{
+	for (int r = 0; r < 16; r += 2)
+	{
+		Round(L, R, subkeys[decrypt ? 15 - r : r]);
+		Round(R, L, subkeys[decrypt ? 14 - r : r + 1]);
+	}
+
+	for (int i = 0; i < 32; i++)
+	{
+		Vec t = L[i];
+		L[i] = R[i];
+		R[i] = t;
+	}
+}
+
+// Encrypts or decrypts the bitsliced blocks in x in place with one, two or
+// three key EDE.
+static void Crypt(Vec* x, const uint64_t (*subkeys)[16], int keycount, bool decrypt)
+{
+	Vec L[32];
+	Vec R[32];
+	for (int i = 0; i < 32; i++)
+	{
+		L[i] = x[DES_IP[i]];
+		R[i] = x[DES_IP[32 + i]];
+	}
+
+	if (keycount == 1)
+		Stage(L, R, subkeys[0], decrypt);
+	else
+	{
+		// EDE: E3(D2(E1(x))), D1(E2(D3(x))) to decrypt.
+		const uint64_t* last = subkeys[keycount == 3 ? 2 : 0];
+		Stage(L, R, decrypt ? last : subkeys[0], decrypt);
+		Stage(L, R, subkeys[1], !decrypt);
+		Stage(L, R, decrypt ? subkeys[0] : last, decrypt);
+	}
+
+	// The preoutput is (R16, L16), which Stage already put in (L, R).
+	Vec y[64];
+	for (int i = 0; i < 32; i++)
+	{
+		y[i] = L[i];
+		y[32 + i] = R[i];
+	}
+	for (int i = 0; i < 64; i++)
+		x[i] = y[DES_FP[i]];
+}
+
+static void CbcDecrypt(uint8_t* result, const uint8_t* data, size_t blocks, const uint64_t (*subkeys)[16], int keycount, const uint8_t* iv)
+{
+	// Batches are processed back to front and every batch writes its blocks
+	// back to front, so in place decryption still finds the preceding
+	// ciphertext block intact when it is needed for chaining.
+	size_t batches = blocks / LANES;
+	for (size_t b = batches; b-- > 0;)
+	{
+		size_t first = (blocks - (batches - b) * LANES);
+
+		const uint8_t* in[LANES];
+		for (size_t i = 0; i < LANES; i++)
+			in[i] = data + (first + i) * 8;
+
+		Vec x[64];
+		Load(x, in, LANES);
+		Crypt(x, subkeys, keycount, true);
+
+		uint8_t plain[LANES * 8];
+		uint8_t* out[LANES];
+		for (size_t i = 0; i < LANES; i++)
+			out[i] = plain + i * 8;
+		Store(x, out, LANES);
+
+		for (size_t i = LANES; i-- > 0;)
+		{
+			size_t block = first + i;
+			const uint8_t* chain = block == 0 ? iv : data + (block - 1) * 8;
+			for (int j = 0; j < 8; j++)
+				result[block * 8 + j] = plain[i * 8 + j] ^ chain[j];
+		}
+	}
+}
+
+static void CbcMac(size_t count, const uint8_t* const* data, const size_t* lengths, const uint64_t (*subkeys)[16], int keycount, uint8_t (*macs)[8])
+{
+	size_t longest = 0;
+	for (size_t i = 0; i < count; i++)
+		if (lengths[i] > longest)
+			longest = lengths[i];
+
+	// The chaining state stays bitsliced for the whole message, only the
+	// message blocks are transposed in.
+	Vec state[64];
+	for (int i = 0; i < 64; i++)
+		state[i] = Broadcast(0);
+
+	uint8_t zero[8] = { 0 };
+	uint8_t tail[LANES][8];
+	for (size_t offset = 0; offset < longest; offset += 8)
+	{
+		const uint8_t* in[LANES];
+		uint64_t active[WORDS] = { 0 };
+		for (size_t i = 0; i < count; i++)
+		{
+			if (offset >= lengths[i])
+			{
+				in[i] = zero;
+				continue;
+			}
+
+			if (lengths[i] - offset < 8)
+			{
+				// A trailing partial block is zero padded like OpenSSL does.
+				memset(tail[i], 0, 8);
+				memcpy(tail[i], data[i] + offset, lengths[i] - offset);
+				in[i] = tail[i];
+			}
+			else
+				in[i] = data[i] + offset;
+			active[i / 64] |= 1ull << (63 - i % 64);
+		}
+
+		Vec x[64];
+		Load(x, in, count);
+		for (int i = 0; i < 64; i++)
+			x[i] ^= state[i];
+		Crypt(x, subkeys, keycount, false);
+
+		// Lanes whose message already ended keep their state.
+		Vec mask;
+		memcpy(&mask, active, sizeof(mask));
+		for (int i = 0; i < 64; i++)
+			state[i] = Mux(state[i], x[i], mask);
+	}
+
+	uint8_t* out[LANES];
+	for (size_t i = 0; i < count; i++)
+		out[i] = macs[i];
+	Store(state, out, count);
+}
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <filesystem>
+
+#include "fileio.h"
+#include "iso9660.h"
+#include "stats.h"
+
+InputFile::~InputFile()
+{
+#ifndef _WIN32
+	if (mapBase)
+		munmap(mapBase, mapLength);
+	if (fd >= 0)
+		close(fd);
+#endif
+	if (stream && stream != stdin)
+		fclose(stream);
+}
+
+int InputFile::Open(std::string filename, bool mapping)
+{
+	// Unbuffered, so whatever is read through the descriptor by Transfer
+	// lines up with the stream.
+	if (filename == FILEIO_STANDARD_STREAM)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		stream = stdin;
+		setvbuf(stream, NULL, _IONBF, 0);
+		return 0;
+	}
+
+	std::string image, path;
+	if (!IsoImage::SplitPath(filename, image, path))
+		return OpenRange(filename, 0, UINT64_MAX, mapping);
+
+	IsoImage iso;
+	IsoEntry entry;
+	if (iso.Open(image) != 0 || iso.Find(path, entry) != 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+
+	return OpenRange(image, entry.Offset, entry.Size, mapping);
+}
+
+// length bytes from offset, or all of the file with UINT64_MAX.
+int InputFile::OpenRange(std::string filename, uint64_t offset, uint64_t length, bool mapping)
+{
+#ifndef _WIN32
+	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+
+	struct stat st;
+	bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (regular)
+	{
+		if (offset > (uint64_t)st.st_size)
+			return FILEIO_ERROR_OPEN_FAILED;
+		if (length > st.st_size - offset)
+			length = st.st_size - offset;
+	}
+
+	if (mapping && regular && length > 0)
+	{
+		// Mappings start on a page, extents in an image only on a sector.
+		uint64_t skip = offset % sysconf(_SC_PAGESIZE);
+		void* data = mmap(NULL, length + skip, PROT_READ, MAP_PRIVATE, fd, offset - skip);
+		if (data != MAP_FAILED)
+		{
+			madvise(data, length + skip, MADV_SEQUENTIAL);
+			mapBase = data;
+			mapLength = length + skip;
+			map = (const uint8_t*)data + skip;
+			size = length;
+			base = offset;
+			return 0;
+		}
+	}
+
+	stream = fdopen(fd, "rb");
+	if (stream == NULL)
+		return FILEIO_ERROR_OPEN_FAILED;
+	fd = -1;
+	setvbuf(stream, NULL, _IONBF, 0);
+	if (offset != 0 && fseeko(stream, offset, SEEK_SET) != 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+#else
+	stream = fopen(filename.c_str(), "rb");
+	if (stream == NULL)
+		return FILEIO_ERROR_OPEN_FAILED;
+	if (offset != 0 && _fseeki64(stream, offset, SEEK_SET) != 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+#endif
+
+	if (length < SIZE_MAX)
+		limit = length;
+	return 0;
+}
+
+int InputFile::Load()
+{
+	if (map || loaded)
+		return 0;
+
+	STATS_TIMER(STAT_READ, limit < SIZE_MAX ? limit : 0);
+	char chunk[0x10000];
+	size_t read;
+	while (buffer.size() < limit && (read = fread(chunk, 1, limit - buffer.size() < sizeof(chunk) ? limit - buffer.size() : sizeof(chunk), stream)) > 0)
+		buffer.append(chunk, read);
+
+	if (ferror(stream))
+		return FILEIO_ERROR_READ_FAILED;
+
+	loaded = true;
+	return 0;
+}
+
+int InputFile::Read(size_t length, const uint8_t** data, uint8_t* scratch)
+{
+	if (map)
+	{
+		if (length > size - position)
+			return FILEIO_ERROR_READ_FAILED;
+
+		*data = map + position;
+		position += length;
+		return 0;
+	}
+
+	if (loaded)
+	{
+		if (length > buffer.size() - position)
+			return FILEIO_ERROR_READ_FAILED;
+
+		*data = (const uint8_t*)buffer.data() + position;
+		position += length;
+		return 0;
+	}
+
+	STATS_TIMER(STAT_READ, length);
+	if (length > limit - position || fread(scratch, 1, length, stream) != length)
+		return FILEIO_ERROR_READ_FAILED;
+
+	*data = scratch;
+	position += length;
+	return 0;
+}
+
+#ifdef __linux__
+// One step of moving data between two descriptors in the kernel. method
+// starts at 0 and keeps the first of copy_file_range, splice (one end a
+// pipe) and sendfile that works for the pair. Returns the bytes moved, 0 at
+// the end of the input, or -1 when none of them can do it.
+static ssize_t moveData(int in, loff_t* inOffset, int out, loff_t* outOffset, size_t length, int& method)
+{
+	for (; method < 3; method++)
+	{
+		ssize_t moved;
+		do
+		{
+			if (method == 0)
+				moved = copy_file_range(in, inOffset, out, outOffset, length, 0);
+			else if (method == 1)
+				moved = splice(in, inOffset, out, outOffset, length, SPLICE_F_MOVE);
+			else if (outOffset == NULL)
+				moved = sendfile(out, in, (off_t*)inOffset, length);
+			else
+				moved = -1;
+		} while (moved < 0 && errno == EINTR);
+
+		if (moved >= 0)
+			return moved;
+	}
+	return -1;
+}
+#endif
+
+int InputFile::Transfer(OutputFile& out, size_t length)
+{
+	STATS_TIMER(STAT_WRITE, length);
+
+	size_t available = map ? size - position : loaded ? buffer.size() - position : limit - position;
+	if (length > available)
+		return FILEIO_ERROR_READ_FAILED;
+	if (out.map && length > out.size - out.position)
+		return FILEIO_ERROR_WRITE_FAILED;
+
+#ifdef __linux__
+	// Descriptors without an offset move along with what is transferred,
+	// the streams on them are unbuffered or flushed first.
+	if (!loaded && (out.stream == NULL || fflush(out.stream) == 0))
+	{
+		int from = map ? fd : fileno(stream);
+		int to = out.map ? out.fd : fileno(out.stream);
+		loff_t inOffset = base + position;
+		loff_t outOffset = out.position;
+		int method = 0;
+		while (length > 0)
+		{
+			ssize_t moved = moveData(from, map ? &inOffset : NULL, to, out.map ? &outOffset : NULL, length, method);
+			if (moved <= 0)
+				break;
+			position += moved;
+			out.position += moved;
+			length -= moved;
+		}
+	}
+#endif
+
+	// Whatever the kernel could not move is copied.
+	uint8_t chunk[0x10000];
+	while (length > 0)
+	{
+		size_t part = length < sizeof(chunk) ? length : sizeof(chunk);
+		const uint8_t* data;
+		if (Read(part, &data, chunk) != 0)
+			return FILEIO_ERROR_READ_FAILED;
+		if (out.Write(data, part) != 0)
+			return FILEIO_ERROR_WRITE_FAILED;
+		length -= part;
+	}
+
+	return 0;
+}
+
+OutputFile::~OutputFile()
+{
+	Close();
+}
+
+bool InputFile::IsSameFile(const std::string& input, const std::string& output)
+{
+	if (input == FILEIO_STANDARD_STREAM || output == FILEIO_STANDARD_STREAM)
+		return false;
+
+	std::error_code ec;
+	return std::filesystem::equivalent(input, output, ec) && !ec;
+}
+
+int OutputFile::Create(std::string _filename, size_t _size)
+{
+	// stdout is never removed by Discard().
+	if (_filename == FILEIO_STANDARD_STREAM)
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		fflush(stdout);
+		stream = stdout;
+		return 0;
+	}
+
+	filename = _filename;
+
+#ifndef _WIN32
+	fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+
+	// Writing through a mapping can't report a full disk, a store into a
+	// page without backing raises SIGBUS. So the blocks are allocated up
+	// front, and where that fails, or there is no posix_fallocate, the
+	// output goes through the stream instead.
+#ifdef __linux__
+	struct stat st;
+	if (_size > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	{
+		if (posix_fallocate(fd, 0, _size) == 0)
+		{
+			void* data = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				map = (uint8_t*)data;
+				size = _size;
+				return 0;
+			}
+		}
+
+		// Whatever was allocated would be left as zeros behind the data.
+		if (ftruncate(fd, 0) != 0)
+		{
+			close(fd);
+			fd = -1;
+			return FILEIO_ERROR_OPEN_FAILED;
+		}
+	}
+#endif
+
+	stream = fdopen(fd, "wb");
+	if (stream == NULL)
+		return FILEIO_ERROR_OPEN_FAILED;
+	fd = -1;
+#else
+	stream = fopen(filename.c_str(), "wb");
+	if (stream == NULL)
+		return FILEIO_ERROR_OPEN_FAILED;
+#endif
+
+	return 0;
+}
+
+uint8_t* OutputFile::Reserve(size_t length)
+{
+	if (map)
+		return length <= size - position ? map + position : NULL;
+
+	if (scratch.size() < length)
+		scratch.resize(length);
+	return scratch.data();
+}
+
+int OutputFile::Commit(size_t length)
+{
+	STATS_TIMER(STAT_WRITE, length);
+	if (map)
+	{
+		position += length;
+		return 0;
+	}
+
+	if (fwrite(scratch.data(), 1, length, stream) != length)
+		return FILEIO_ERROR_WRITE_FAILED;
+
+	position += length;
+	return 0;
+}
+
+int OutputFile::Write(const void* data, size_t length)
+{
+	STATS_TIMER(STAT_WRITE, length);
+	if (map)
+	{
+		if (length > size - position)
+			return FILEIO_ERROR_WRITE_FAILED;
+
+		memcpy(map + position, data, length);
+		position += length;
+		return 0;
+	}
+
+	if (fwrite(data, 1, length, stream) != length)
+		return FILEIO_ERROR_WRITE_FAILED;
+
+	position += length;
+	return 0;
+}
+
+int OutputFile::Close()
+{
+	STATS_TIMER(STAT_WRITE, 0);
+	int ret = 0;
+
+#ifndef _WIN32
+	if (map)
+	{
+		munmap(map, size);
+		map = NULL;
+
+		// Never leave preallocated space behind that was not written.
+		if (position != size && ftruncate(fd, position) != 0)
+			ret = FILEIO_ERROR_WRITE_FAILED;
+	}
+	if (fd >= 0)
+	{
+		if (close(fd) != 0)
+			ret = FILEIO_ERROR_WRITE_FAILED;
+		fd = -1;
+	}
+#endif
+	if (stream)
+	{
+		if ((stream == stdout ? fflush(stream) : fclose(stream)) != 0)
+			ret = FILEIO_ERROR_WRITE_FAILED;
+		stream = NULL;
+	}
+
+	return ret;
+}
+
+void OutputFile::Discard()
+{
+	Close();
+	if (!filename.empty())
+		remove(filename.c_str());
+}
+
+int OutputFile::Sync(const std::string& filename)
+{
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+	int ret = fdatasync(fd) == 0 ? 0 : FILEIO_ERROR_WRITE_FAILED;
+	if (close(fd) != 0)
+		ret = FILEIO_ERROR_WRITE_FAILED;
+#else
+	int fd = _open(filename.c_str(), _O_RDWR | _O_BINARY);
+	if (fd < 0)
+		return FILEIO_ERROR_OPEN_FAILED;
+	int ret = _commit(fd) == 0 ? 0 : FILEIO_ERROR_WRITE_FAILED;
+	if (_close(fd) != 0)
+		ret = FILEIO_ERROR_WRITE_FAILED;
+#endif
+	return ret;
+}
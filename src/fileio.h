@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#define FILEIO_ERROR_OPEN_FAILED -1
+#define FILEIO_ERROR_READ_FAILED -2
+#define FILEIO_ERROR_WRITE_FAILED -3
+
+// Names both classes take for stdin and stdout.
+#define FILEIO_STANDARD_STREAM "-"
+
+class OutputFile;
+
+// Regular files are memory mapped and read in place. Pipes and other
+// non-regular files fall back to unbuffered reads. A file inside an ISO9660
+// image, named "<image>::<path>", is read straight out of its extent in the
+// image the same way.
+class InputFile
+{
+	int fd;
+	FILE* stream;
+	const uint8_t* map;
+	size_t size;
+	size_t position;
+	size_t limit;
+	std::string buffer;
+	bool loaded;
+	void* mapBase;
+	size_t mapLength;
+	uint64_t base; // file offset of the data
+
+	int OpenRange(std::string filename, uint64_t offset, uint64_t length, bool mapping);
+
+public:
+	InputFile() : fd(-1), stream(NULL), map(NULL), size(0), position(0), limit(SIZE_MAX), loaded(false), mapBase(NULL), mapLength(0), base(0) { }
+	~InputFile();
+
+	// Regular files are mapped unless mapping is false, which is cheaper when
+	// only a small part at the start is going to be read.
+	int Open(std::string filename, bool mapping = true);
+
+	// Makes the whole input available through Data(); a no-op when mapped.
+	int Load();
+
+	// Sequential read of exactly length bytes. Mapped input returns a pointer
+	// into the mapping, everything else is copied into scratch.
+	int Read(size_t length, const uint8_t** data, uint8_t* scratch);
+
+	// Moves length bytes from the current position to the current position
+	// of out. Between files and pipes this stays in the kernel
+	// (copy_file_range, splice or sendfile) where the system allows it, and
+	// falls back to copying through user space otherwise.
+	int Transfer(OutputFile& out, size_t length);
+
+	bool IsMapped() const { return map != NULL; }
+	const uint8_t* Data() const { return map ? map : (const uint8_t*)buffer.data(); }
+	size_t Size() const { return map ? size : buffer.size(); }
+
+	// Whether both name the same existing file, which creating the output
+	// would truncate while the input is still being read.
+	static bool IsSameFile(const std::string& input, const std::string& output);
+};
+
+// Regular files are preallocated to their final size and written through a
+// shared mapping; anything else, stdout included, goes through buffered
+// writes.
+class OutputFile
+{
+	int fd;
+	FILE* stream;
+	uint8_t* map;
+	size_t size;
+	size_t position;
+	std::vector<uint8_t> scratch;
+	std::string filename;
+
+	friend class InputFile;
+
+public:
+	OutputFile() : fd(-1), stream(NULL), map(NULL), size(0), position(0) { }
+	~OutputFile();
+
+	int Create(std::string filename, size_t size);
+
+	// Returns length bytes of writable space at the current position. The
+	// data becomes part of the file once committed.
+	uint8_t* Reserve(size_t length);
+	int Commit(size_t length);
+
+	int Write(const void* data, size_t length);
+	int Close();
+
+	// Closes and deletes a partially written output.
+	void Discard();
+
+	// Flushes a closed file's data to disk, for callers that record it as
+	// finished somewhere that outlives a crash.
+	static int Sync(const std::string& filename);
+
+	bool IsMapped() const { return map != NULL; }
+};
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <filesystem>
+
+#include "index.h"
+#include "fileio.h"
+#include "threadpool.h"
+
+namespace fs = std::filesystem;
+
+#pragma pack(push, 1)
+struct IndexFileHeader
+{
+	char Magic[4];
+	uint32_t Version;
+	uint32_t Count;
+	uint8_t KeyDigest[32];
+};
+
+struct IndexRecord
+{
+	uint64_t Size;
+	int64_t MTime;
+	int32_t Result;
+	KELFHeader Header;
+	uint8_t HeaderSignature[8];
+	uint8_t RootSignature[8];
+	uint8_t Digest[32];
+};
+#pragma pack(pop)
+
+bool IndexFilter::Matches(const IndexEntry& entry) const
+{
+	if (Fields & INDEX_FILTER_SYSTEM_TYPE && entry.Header.SystemType != SystemType)
+		return false;
+	if (Fields & INDEX_FILTER_APPLICATION_TYPE && entry.Header.ApplicationType != ApplicationType)
+		return false;
+	if (Fields & INDEX_FILTER_MG_ZONES && (entry.Header.MGZones & MGZones) == 0)
+		return false;
+	return true;
+}
+
+static void putString(std::string& out, const std::string& text)
+{
+	uint16_t length = (uint16_t)text.size();
+	out.append((const char*)&length, sizeof(length));
+	out.append(text, 0, length);
+}
+
+// Takes size bytes at position, false if the data ends before.
+static bool take(const std::string& data, size_t& position, void* out, size_t size)
+{
+	if (data.size() - position < size)
+		return false;
+	memcpy(out, data.data() + position, size);
+	position += size;
+	return true;
+}
+
+static bool takeString(const std::string& data, size_t& position, std::string& text)
+{
+	uint16_t length;
+	if (!take(data, position, &length, sizeof(length)) || data.size() - position < length)
+		return false;
+	text.assign(data, position, length);
+	position += length;
+	return true;
+}
+
+int Index::Load(std::string filename)
+{
+	entries.clear();
+	memset(keyDigest, 0, sizeof(keyDigest));
+
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return errno == ENOENT ? 0 : INDEX_ERROR_OPEN_FAILED;
+
+	std::string data;
+	char chunk[0x10000];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		data.append(chunk, read);
+	bool failed = ferror(f);
+	fclose(f);
+	if (failed)
+		return INDEX_ERROR_READ_FAILED;
+
+	size_t position = 0;
+	IndexFileHeader header;
+	if (!take(data, position, &header, sizeof(header)) || memcmp(header.Magic, INDEX_MAGIC, sizeof(header.Magic)) != 0)
+		return INDEX_ERROR_CORRUPT;
+	if (header.Version != INDEX_VERSION)
+		return INDEX_ERROR_VERSION;
+	memcpy(keyDigest, header.KeyDigest, sizeof(keyDigest));
+
+	// Every entry takes at least its fixed part, which bounds a bad count.
+	if (header.Count > data.size() / sizeof(IndexRecord))
+		return INDEX_ERROR_CORRUPT;
+	entries.resize(header.Count);
+	for (IndexEntry& entry : entries)
+	{
+		IndexRecord record;
+		uint8_t BlockCount;
+		if (!take(data, position, &record, sizeof(record)) ||
+			!takeString(data, position, entry.Path) ||
+			!takeString(data, position, entry.KeySet) ||
+			!take(data, position, &BlockCount, sizeof(BlockCount)))
+		{
+			entries.clear();
+			return INDEX_ERROR_CORRUPT;
+		}
+
+		entry.Size = record.Size;
+		entry.MTime = record.MTime;
+		entry.Result = record.Result;
+		entry.Header = record.Header;
+		memcpy(entry.HeaderSignature, record.HeaderSignature, sizeof(entry.HeaderSignature));
+		memcpy(entry.RootSignature, record.RootSignature, sizeof(entry.RootSignature));
+		memcpy(entry.Digest, record.Digest, sizeof(entry.Digest));
+
+		entry.Blocks.resize(BlockCount);
+		for (KelfLayoutEntry& block : entry.Blocks)
+		{
+			if (!take(data, position, &block, sizeof(block)))
+			{
+				entries.clear();
+				return INDEX_ERROR_CORRUPT;
+			}
+		}
+	}
+
+	return position == data.size() ? 0 : INDEX_ERROR_CORRUPT;
+}
+
+int Index::Save(std::string filename)
+{
+	std::string data;
+	IndexFileHeader header;
+	memcpy(header.Magic, INDEX_MAGIC, sizeof(header.Magic));
+	header.Version = INDEX_VERSION;
+	header.Count = (uint32_t)entries.size();
+	memcpy(header.KeyDigest, keyDigest, sizeof(keyDigest));
+	data.append((const char*)&header, sizeof(header));
+
+	for (const IndexEntry& entry : entries)
+	{
+		IndexRecord record;
+		record.Size = entry.Size;
+		record.MTime = entry.MTime;
+		record.Result = entry.Result;
+		record.Header = entry.Header;
+		memcpy(record.HeaderSignature, entry.HeaderSignature, sizeof(record.HeaderSignature));
+		memcpy(record.RootSignature, entry.RootSignature, sizeof(record.RootSignature));
+		memcpy(record.Digest, entry.Digest, sizeof(record.Digest));
+		data.append((const char*)&record, sizeof(record));
+
+		putString(data, entry.Path);
+		putString(data, entry.KeySet);
+		uint8_t BlockCount = (uint8_t)entry.Blocks.size();
+		data.append((const char*)&BlockCount, sizeof(BlockCount));
+		data.append((const char*)entry.Blocks.data(), BlockCount * sizeof(KelfLayoutEntry));
+	}
+
+	std::string temporary = filename + ".tmp";
+	FILE* f = fopen(temporary.c_str(), "wb");
+	if (f == NULL)
+		return INDEX_ERROR_WRITE_FAILED;
+	bool written = fwrite(data.data(), 1, data.size(), f) == data.size();
+	written = fclose(f) == 0 && written;
+
+	std::error_code ec;
+	if (written)
+		fs::rename(temporary, filename, ec);
+	if (!written || ec)
+	{
+		fs::remove(temporary, ec);
+		return INDEX_ERROR_WRITE_FAILED;
+	}
+	return 0;
+}
+
+// Checks the header of the file and hashes its content, size and mtime
+// are already set.
+void Index::ProcessFile(const KeyRing& ring, IndexEntry& entry)
+{
+	entry.Header = KELFHeader();
+	entry.Blocks.clear();
+	entry.KeySet.clear();
+	memset(entry.HeaderSignature, 0, sizeof(entry.HeaderSignature));
+	memset(entry.RootSignature, 0, sizeof(entry.RootSignature));
+	memset(entry.Digest, 0, sizeof(entry.Digest));
+
+	InputFile in;
+	if (in.Open(entry.Path) != 0)
+	{
+		entry.Result = KELF_ERROR_OPEN_FAILED;
+		return;
+	}
+	if (in.Load() != 0)
+	{
+		entry.Result = KELF_ERROR_READ_FAILED;
+		return;
+	}
+
+	Kelf kelf(ring);
+	entry.Result = kelf.LoadKelfHeader(in.Data(), in.Size());
+	if (entry.Result != 0)
+		return;
+
+	const KELFHeader& header = kelf.GetHeader();
+	size_t ContentSize = kelf.GetContentSize();
+	if (in.Size() - header.HeaderSize < ContentSize)
+	{
+		entry.Result = KELF_ERROR_TRUNCATED;
+		return;
+	}
+
+	entry.Header = header;
+	const BitTable& bitTable = kelf.GetBitTable();
+	for (int i = 0; i < bitTable.BlockCount; i++)
+		entry.Blocks.push_back({ bitTable.Blocks[i].Size, bitTable.Blocks[i].Flags });
+	memcpy(entry.HeaderSignature, in.Data() + sizeof(KELFHeader), sizeof(entry.HeaderSignature));
+	memcpy(entry.RootSignature, kelf.GetSignature(), sizeof(entry.RootSignature));
+	entry.KeySet = kelf.GetKeySetName();
+
+	EVP_MD_CTX* md = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	EVP_DigestUpdate(md, in.Data() + header.HeaderSize, ContentSize);
+	EVP_DigestFinal_ex(md, entry.Digest, NULL);
+	EVP_MD_CTX_free(md);
+}
+
+int Index::Update(const KeyRing& ring, std::string directory, unsigned threads, size_t& added, size_t& changed, size_t& removed)
+{
+	added = changed = removed = 0;
+
+	// Results depend on the keys, other keys mean starting over.
+	bool sameKeys = memcmp(keyDigest, ring.GetDigest(), sizeof(keyDigest)) == 0;
+	memcpy(keyDigest, ring.GetDigest(), sizeof(keyDigest));
+
+	std::map<std::string, IndexEntry*> known;
+	for (IndexEntry& entry : entries)
+		known[entry.Path] = &entry;
+
+	std::vector<IndexEntry> current;
+	std::vector<size_t> pending;
+	std::error_code ec;
+	fs::recursive_directory_iterator it(directory, ec);
+	if (ec)
+		return INDEX_ERROR_OPEN_FAILED;
+	for (; it != fs::recursive_directory_iterator(); it.increment(ec))
+	{
+		if (ec)
+			return INDEX_ERROR_OPEN_FAILED;
+		if (!it->is_regular_file(ec))
+			continue;
+
+		IndexEntry entry;
+		entry.Path = it->path().string();
+		if (entry.Path.size() > UINT16_MAX)
+			continue;
+		std::error_code statError;
+		entry.Size = it->file_size(statError);
+		entry.MTime = it->last_write_time(statError).time_since_epoch().count();
+		if (statError)
+			continue;
+
+		std::map<std::string, IndexEntry*>::iterator old = known.find(entry.Path);
+		if (old != known.end() && sameKeys && old->second->Size == entry.Size && old->second->MTime == entry.MTime)
+		{
+			current.push_back(std::move(*old->second));
+			continue;
+		}
+
+		if (old != known.end())
+			changed++;
+		else
+			added++;
+		entry.Result = 0;
+		pending.push_back(current.size());
+		current.push_back(std::move(entry));
+	}
+	removed = entries.size() + added - current.size();
+
+	ThreadPool::ParallelFor(pending.size(), threads ? threads : ThreadPool::GetDefaultThreadCount(), [&](size_t i) {
+		ProcessFile(ring, current[pending[i]]);
+	});
+
+	std::sort(current.begin(), current.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.Path < b.Path; });
+	entries.swap(current);
+	return 0;
+}
+
+std::vector<const IndexEntry*> Index::Query(const IndexFilter& filter) const
+{
+	std::vector<const IndexEntry*> found;
+	for (const IndexEntry& entry : entries)
+		if (entry.Result == 0 && filter.Matches(entry))
+			found.push_back(&entry);
+	return found;
+}
+
+std::vector<std::vector<const IndexEntry*>> Index::FindDuplicates(const IndexFilter& filter) const
+{
+	std::map<std::string, std::vector<const IndexEntry*>> byDigest;
+	for (const IndexEntry* entry : Query(filter))
+		byDigest[std::string((const char*)entry->Digest, sizeof(entry->Digest))].push_back(entry);
+
+	std::vector<std::vector<const IndexEntry*>> groups;
+	for (std::map<std::string, std::vector<const IndexEntry*>>::value_type& group : byDigest)
+		if (group.second.size() > 1)
+			groups.push_back(group.second);
+	return groups;
+}
+
+std::string Index::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case INDEX_ERROR_OPEN_FAILED: return "Failed to open index or directory!";
+	case INDEX_ERROR_READ_FAILED: return "Failed to read index!";
+	case INDEX_ERROR_WRITE_FAILED: return "Failed to write index!";
+	case INDEX_ERROR_CORRUPT: return "Index is corrupt!";
+	case INDEX_ERROR_VERSION: return "Index was written by another version!";
+	default:
+		return "Unknown error!";
+	}
+}
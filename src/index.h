@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+#include "kelf.h"
+
+#define INDEX_ERROR_OPEN_FAILED -1
+#define INDEX_ERROR_READ_FAILED -2
+#define INDEX_ERROR_WRITE_FAILED -3
+#define INDEX_ERROR_CORRUPT -4
+#define INDEX_ERROR_VERSION -5
+
+#define INDEX_MAGIC "KIDX"
+#define INDEX_VERSION 1
+
+// Query filters, any combination. MGZones matches entries that share a
+// region bit with the given mask.
+#define INDEX_FILTER_SYSTEM_TYPE 1
+#define INDEX_FILTER_APPLICATION_TYPE 2
+#define INDEX_FILTER_MG_ZONES 4
+
+struct IndexEntry
+{
+	std::string Path;
+	uint64_t Size;
+	int64_t MTime; // file clock ticks
+	int Result; // of checking the header, entries that are no KELF are kept so they are not parsed again
+	KELFHeader Header;
+	std::vector<KelfLayoutEntry> Blocks; // decrypted bit table layout
+	uint8_t HeaderSignature[8];
+	uint8_t RootSignature[8];
+	uint8_t Digest[32]; // SHA-256 of the content as stored, encrypted
+	std::string KeySet;
+};
+
+struct IndexFilter
+{
+	unsigned Fields;
+	uint8_t SystemType;
+	uint8_t ApplicationType;
+	uint32_t MGZones;
+
+	IndexFilter() : Fields(0), SystemType(0), ApplicationType(0), MGZones(0) { }
+
+	bool Matches(const IndexEntry& entry) const;
+};
+
+// Catalog of the KELFs under a directory, kept in one binary file:
+//   "KIDX", version and entry count (u32 each), SHA-256 of the keys
+//   per entry: size, mtime, result, KELFHeader, header and root signature,
+//   digest, path, keyset and block count followed by the blocks' size and
+//   flags, the strings as u16 length and bytes
+// Update walks the directory again and only reads files whose size or
+// mtime changed, or every file if the keys changed, on a thread pool. Only
+// the header is checked, the content is hashed but neither decrypted nor
+// verified. Save replaces the file atomically, so readers never see half
+// of it.
+class Index
+{
+	std::vector<IndexEntry> entries;
+	uint8_t keyDigest[32];
+
+	static void ProcessFile(const KeyRing& ring, IndexEntry& entry);
+
+public:
+	Index() : keyDigest() { }
+
+	// A missing file is an empty index.
+	int Load(std::string filename);
+	int Save(std::string filename);
+
+	// Brings the index in line with the files under directory, entries of
+	// files that are gone are dropped. Counts what was done.
+	int Update(const KeyRing& ring, std::string directory, unsigned threads, size_t& added, size_t& changed, size_t& removed);
+
+	// KELFs that pass filter, in path order.
+	std::vector<const IndexEntry*> Query(const IndexFilter& filter) const;
+	// Groups of KELFs with the same content digest, each in path order.
+	std::vector<std::vector<const IndexEntry*>> FindDuplicates(const IndexFilter& filter) const;
+
+	size_t GetCount() const { return entries.size(); }
+
+	static std::string getErrorString(int err);
+};
+
+#endif
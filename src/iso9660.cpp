@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#ifdef _WIN32
+#define strcasecmp _stricmp
+#else
+#include <strings.h>
+#endif
+
+#include "iso9660.h"
+
+// Directories nested deeper than this are not followed.
+#define ISO_MAX_DEPTH 32
+
+// Offsets into a directory record
+#define RECORD_LENGTH 0
+#define RECORD_EXTENT 2
+#define RECORD_SIZE 10
+#define RECORD_FLAGS 25
+#define RECORD_NAME_LENGTH 32
+#define RECORD_NAME 33
+
+#define RECORD_FLAG_DIRECTORY 2
+
+static uint32_t le32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int seek(FILE* f, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+// "NAME.EXT;1" becomes "NAME.EXT", a name without extension loses its dot.
+static std::string recordName(const uint8_t* record)
+{
+	std::string name((const char*)record + RECORD_NAME, record[RECORD_NAME_LENGTH]);
+	size_t version = name.find(';');
+	if (version != std::string::npos)
+		name.erase(version);
+	if (!name.empty() && name.back() == '.')
+		name.pop_back();
+	return name;
+}
+
+IsoImage::~IsoImage()
+{
+	if (f)
+		fclose(f);
+}
+
+int IsoImage::Open(std::string filename)
+{
+	f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+		return ISO_ERROR_OPEN_FAILED;
+
+	// Volume descriptors start at sector 16, the primary one is type 1.
+	uint8_t descriptor[ISO_SECTOR_SIZE];
+	for (uint32_t sector = 16; ; sector++)
+	{
+		if (seek(f, (uint64_t)sector * ISO_SECTOR_SIZE) != 0 || fread(descriptor, 1, sizeof(descriptor), f) != sizeof(descriptor))
+			return ISO_ERROR_NOT_ISO;
+		if (memcmp(descriptor + 1, "CD001", 5) != 0 || descriptor[0] == 255)
+			return ISO_ERROR_NOT_ISO;
+		if (descriptor[0] == 1)
+			break;
+	}
+
+	const uint8_t* root = descriptor + 156;
+	rootExtent = le32(root + RECORD_EXTENT);
+	rootSize = le32(root + RECORD_SIZE);
+	return 0;
+}
+
+int IsoImage::ReadDirectory(uint32_t extent, uint32_t size, std::vector<uint8_t>& data)
+{
+	data.resize(size);
+	if (seek(f, (uint64_t)extent * ISO_SECTOR_SIZE) != 0 || fread(data.data(), 1, size, f) != size)
+		return ISO_ERROR_READ_FAILED;
+	return 0;
+}
+
+// Calls fn for every record of a directory but . and ..
+template <typename F>
+static void forEachRecord(const std::vector<uint8_t>& data, F fn)
+{
+	size_t offset = 0;
+	while (offset < data.size())
+	{
+		const uint8_t* record = &data[offset];
+		uint8_t length = record[RECORD_LENGTH];
+
+		// Records never cross a sector, the rest of one is zero padding.
+		if (length == 0)
+		{
+			offset = (offset / ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE;
+			continue;
+		}
+		if (length < RECORD_NAME + 1 || offset + length > data.size() || RECORD_NAME + record[RECORD_NAME_LENGTH] > length)
+			break;
+		offset += length;
+
+		if (record[RECORD_NAME_LENGTH] == 1 && record[RECORD_NAME] <= 1)
+			continue;
+		if (!fn(record))
+			break;
+	}
+}
+
+// Every directory is listed once, however many records point at it, so
+// crafted images that link directories back into the tree stay linear.
+int IsoImage::Walk(uint32_t extent, uint32_t size, const std::string& path, int depth, std::set<uint32_t>& visited, std::vector<IsoEntry>& entries)
+{
+	if (depth > ISO_MAX_DEPTH || !visited.insert(extent).second)
+		return 0;
+
+	std::vector<uint8_t> data;
+	int ret = ReadDirectory(extent, size, data);
+	if (ret != 0)
+		return ret;
+
+	forEachRecord(data, [&](const uint8_t* record) {
+		std::string name = path + "/" + recordName(record);
+		if (record[RECORD_FLAGS] & RECORD_FLAG_DIRECTORY)
+			ret = Walk(le32(record + RECORD_EXTENT), le32(record + RECORD_SIZE), name, depth + 1, visited, entries);
+		else
+			entries.push_back({ name, (uint64_t)le32(record + RECORD_EXTENT) * ISO_SECTOR_SIZE, le32(record + RECORD_SIZE) });
+		return ret == 0;
+	});
+
+	return ret;
+}
+
+int IsoImage::List(std::vector<IsoEntry>& entries)
+{
+	std::set<uint32_t> visited;
+	return Walk(rootExtent, rootSize, "", 0, visited, entries);
+}
+
+int IsoImage::Find(std::string path, IsoEntry& entry)
+{
+	uint32_t extent = rootExtent;
+	uint32_t size = rootSize;
+	std::string found;
+
+	size_t start = 0;
+	while (start < path.size())
+	{
+		size_t end = path.find('/', start);
+		if (end == std::string::npos)
+			end = path.size();
+		std::string component = path.substr(start, end - start);
+		start = end + 1;
+		if (component.empty())
+			continue;
+
+		std::vector<uint8_t> data;
+		int ret = ReadDirectory(extent, size, data);
+		if (ret != 0)
+			return ret;
+
+		bool match = false;
+		bool directory = false;
+		forEachRecord(data, [&](const uint8_t* record) {
+			if (strcasecmp(recordName(record).c_str(), component.c_str()) != 0)
+				return true;
+			match = true;
+			directory = record[RECORD_FLAGS] & RECORD_FLAG_DIRECTORY;
+			extent = le32(record + RECORD_EXTENT);
+			size = le32(record + RECORD_SIZE);
+			found += "/" + recordName(record);
+			return false;
+		});
+
+		// Only the last component may be a file.
+		if (!match || (!directory && start < path.size()))
+			return ISO_ERROR_NOT_FOUND;
+		if (start >= path.size())
+		{
+			if (directory)
+				return ISO_ERROR_NOT_FOUND;
+			entry = { found, (uint64_t)extent * ISO_SECTOR_SIZE, size };
+			return 0;
+		}
+	}
+
+	return ISO_ERROR_NOT_FOUND;
+}
+
+bool IsoImage::SplitPath(const std::string& filename, std::string& image, std::string& path)
+{
+	size_t separator = filename.find(ISO_PATH_SEPARATOR);
+	if (separator == std::string::npos)
+		return false;
+
+	image = filename.substr(0, separator);
+	path = filename.substr(separator + strlen(ISO_PATH_SEPARATOR));
+	return true;
+}
+
+std::string IsoImage::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case ISO_ERROR_OPEN_FAILED: return "Failed to open image!";
+	case ISO_ERROR_READ_FAILED: return "Failed to read image!";
+	case ISO_ERROR_NOT_ISO: return "Not an ISO9660 image!";
+	case ISO_ERROR_NOT_FOUND: return "File not found in image!";
+	default:
+		return "Unknown error!";
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ISO9660_H__
+#define __ISO9660_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#define ISO_ERROR_OPEN_FAILED -1
+#define ISO_ERROR_READ_FAILED -2
+#define ISO_ERROR_NOT_ISO -3
+#define ISO_ERROR_NOT_FOUND -4
+
+#define ISO_SECTOR_SIZE 2048
+
+// Files inside an image are addressed as <image>::<path>, e.g.
+// "disc.iso::/SYSTEM/OSDSYS.KELF".
+#define ISO_PATH_SEPARATOR "::"
+
+struct IsoEntry
+{
+	std::string Path; // absolute, without the ;1 version suffix
+	uint64_t Offset; // in bytes from the start of the image
+	uint64_t Size;
+};
+
+// Reads the directory tree of the primary volume of an ISO9660 image. File
+// data is never touched, only the extents are located so the files can be
+// read straight out of the image.
+class IsoImage
+{
+	FILE* f;
+	uint32_t rootExtent;
+	uint32_t rootSize;
+
+	int ReadDirectory(uint32_t extent, uint32_t size, std::vector<uint8_t>& data);
+	int Walk(uint32_t extent, uint32_t size, const std::string& path, int depth, std::set<uint32_t>& visited, std::vector<IsoEntry>& entries);
+
+public:
+	IsoImage() : f(NULL), rootExtent(0), rootSize(0) { }
+	~IsoImage();
+
+	int Open(std::string filename);
+
+	// Every file of the image, depth first.
+	int List(std::vector<IsoEntry>& entries);
+
+	// Looks a single path up, case insensitive, reading only the directories
+	// along it.
+	int Find(std::string path, IsoEntry& entry);
+
+	// Splits "<image>::<path>" into its parts.
+	static bool SplitPath(const std::string& filename, std::string& image, std::string& path);
+
+	static std::string getErrorString(int err);
+};
+
+#endif
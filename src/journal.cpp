@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "journal.h"
+
+namespace fs = std::filesystem;
+
+// FNV-1a, enough to tell a torn line from a whole one.
+static uint32_t checksum(const std::string& text)
+{
+	uint32_t hash = 2166136261u;
+	for (unsigned char c : text)
+		hash = (hash ^ c) * 16777619u;
+	return hash;
+}
+
+static std::vector<std::string> splitFields(const std::string& line)
+{
+	std::vector<std::string> fields;
+	size_t start = 0;
+	for (;;)
+	{
+		size_t end = line.find('\t', start);
+		fields.push_back(line.substr(start, end == std::string::npos ? std::string::npos : end - start));
+		if (end == std::string::npos)
+			return fields;
+		start = end + 1;
+	}
+}
+
+static bool parseRecord(const std::string& line, JournalRecord& record)
+{
+	size_t last = line.rfind('\t');
+	if (last == std::string::npos)
+		return false;
+	char expected[16];
+	snprintf(expected, sizeof(expected), "%08x", checksum(line.substr(0, last)));
+	if (line.compare(last + 1, std::string::npos, expected) != 0)
+		return false;
+
+	std::vector<std::string> fields = splitFields(line.substr(0, last));
+	if (fields.size() != 6 || fields[3].size() != 16)
+		return false;
+
+	record.Result = atoi(fields[0].c_str());
+	record.Size = strtoull(fields[1].c_str(), NULL, 10);
+	record.OutputSize = strtoull(fields[2].c_str(), NULL, 10);
+	for (int i = 0; i < 8; i++)
+		record.Signature[i] = (uint8_t)strtoul(fields[3].substr(i * 2, 2).c_str(), NULL, 16);
+	record.Input = fields[4];
+	record.Output = fields[5];
+	return true;
+}
+
+// Reads the whole records of filename, length is where the last of them
+// ends.
+static int readRecords(const std::string& filename, std::map<std::string, JournalRecord>& records, uint64_t& length)
+{
+	records.clear();
+	length = 0;
+
+	std::ifstream infile(filename, std::ios::binary);
+	if (infile.fail())
+		return JOURNAL_ERROR_OPEN_FAILED;
+
+	std::string line;
+	uint64_t position = 0;
+	while (std::getline(infile, line))
+	{
+		// A last line without its newline never made it out whole.
+		if (infile.eof())
+			break;
+		position += line.size() + 1;
+
+		JournalRecord record;
+		if (!parseRecord(line, record))
+			continue;
+		records[record.Input] = record;
+		length = position;
+	}
+
+	return 0;
+}
+
+int Journal::Read(std::string filename, std::map<std::string, JournalRecord>& records)
+{
+	uint64_t length;
+	return readRecords(filename, records, length);
+}
+
+int Journal::Open(std::string filename)
+{
+	Close();
+
+	std::error_code ec;
+	if (fs::exists(filename, ec))
+	{
+		uint64_t length;
+		if (readRecords(filename, records, length) != 0)
+			return JOURNAL_ERROR_OPEN_FAILED;
+
+		// What follows the last whole record would otherwise run into the
+		// first new one.
+		if (fs::file_size(filename, ec) != length)
+			fs::resize_file(filename, length, ec);
+		if (ec)
+			return JOURNAL_ERROR_OPEN_FAILED;
+	}
+
+	f = fopen(filename.c_str(), "ab");
+	if (f == NULL)
+		return JOURNAL_ERROR_OPEN_FAILED;
+	setvbuf(f, NULL, _IOFBF, JOURNAL_BUFFER_SIZE);
+
+	synced = std::chrono::steady_clock::now();
+	return 0;
+}
+
+void Journal::Sync()
+{
+#ifdef _WIN32
+	_commit(_fileno(f));
+#else
+	fdatasync(fileno(f));
+#endif
+	synced = std::chrono::steady_clock::now();
+}
+
+int Journal::Close()
+{
+	if (f == NULL)
+		return 0;
+
+	int ret = fflush(f) == 0 ? 0 : JOURNAL_ERROR_WRITE_FAILED;
+	Sync();
+	if (fclose(f) != 0)
+		ret = JOURNAL_ERROR_WRITE_FAILED;
+	f = NULL;
+	return ret;
+}
+
+bool Journal::IsDone(const std::string& input, uint64_t size)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::map<std::string, JournalRecord>::const_iterator it = records.find(input);
+	if (it == records.end() || it->second.Result < 0 || it->second.Size != size)
+		return false;
+	if (it->second.Result != 0)
+		return true;
+
+	std::error_code ec;
+	uint64_t outputSize = fs::file_size(it->second.Output, ec);
+	return !ec && outputSize == it->second.OutputSize;
+}
+
+int Journal::Append(const JournalRecord& record)
+{
+	char signature[17];
+	for (int i = 0; i < 8; i++)
+		snprintf(signature + i * 2, 3, "%02x", record.Signature[i]);
+
+	std::string line = std::to_string(record.Result) + "\t" + std::to_string(record.Size) + "\t" +
+		std::to_string(record.OutputSize) + "\t" + signature + "\t" + record.Input + "\t" + record.Output;
+	char sum[16];
+	snprintf(sum, sizeof(sum), "\t%08x\n", checksum(line));
+	line += sum;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (f == NULL)
+		return JOURNAL_ERROR_WRITE_FAILED;
+
+	if (fwrite(line.data(), 1, line.size(), f) != line.size() || fflush(f) != 0)
+		return JOURNAL_ERROR_WRITE_FAILED;
+	if (std::chrono::steady_clock::now() - synced >= JOURNAL_SYNC_INTERVAL)
+		Sync();
+
+	records[record.Input] = record;
+	return 0;
+}
+
+std::string Journal::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case JOURNAL_ERROR_OPEN_FAILED: return "Failed to open journal!";
+	case JOURNAL_ERROR_WRITE_FAILED: return "Failed to write journal!";
+	default:
+		return "Unknown error!";
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+#define JOURNAL_ERROR_OPEN_FAILED -1
+#define JOURNAL_ERROR_WRITE_FAILED -2
+
+// Records are synced to disk at most once per interval, by the next Append
+// after it passed, and when the journal closes. Until then a crash of the
+// machine may lose them, a crash of the process does not.
+#define JOURNAL_SYNC_INTERVAL std::chrono::seconds(1)
+
+// Holds any line whole, so each goes out in one write.
+#define JOURNAL_BUFFER_SIZE 0x10000
+
+struct JournalRecord
+{
+	int Result;
+	uint64_t Size; // of the input
+	uint64_t OutputSize;
+	uint8_t Signature[8]; // root signature of the KELF read or written, zero if there was none
+	std::string Input;
+	std::string Output;
+};
+
+// Append-only log of finished files, one tab separated line each:
+//   <result> <size> <output size> <signature> <input> <output> <checksum>
+// A line goes out in a single write at the end of the file, so a crash
+// leaves at most a torn last line, which its checksum rejects and Open cuts
+// off. Losing the records since the last sync only means doing those files
+// again. Later lines for the same input replace earlier ones.
+class Journal
+{
+	FILE* f;
+	std::mutex lock;
+	std::map<std::string, JournalRecord> records;
+	std::chrono::steady_clock::time_point synced;
+
+	void Sync();
+
+public:
+	Journal() : f(NULL) { }
+	~Journal() { Close(); }
+
+	// Reads what an earlier run left in filename and opens it for appending.
+	int Open(std::string filename);
+	int Close();
+
+	// Whether input was done in an earlier run: it succeeded or was no KELF,
+	// still has the size it had then, and its output still has the size it
+	// was written with.
+	bool IsDone(const std::string& input, uint64_t size);
+
+	// Can be called from several threads.
+	int Append(const JournalRecord& record);
+
+	static int Read(std::string filename, std::map<std::string, JournalRecord>& records);
+
+	static std::string getErrorString(int err);
+};
+
+#endif
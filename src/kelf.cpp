@@ -14,376 +14,1545 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <openssl/des.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <vector>
+
 #include "kelf.h"
+#include "crypto.h"
+#include "desbitslice.h"
+#include "fileio.h"
+#include "signer.h"
+#include "stats.h"
+#include "threadpool.h"
 
-uint8_t MG_IV_NULL[8] = { 0 };
+void xor_bit(const void* a, const void* b, void* Result, size_t Length)
+{
+	size_t i;
+	for (i = 0; i < Length; i++) {
+		((uint8_t*)Result)[i] = ((uint8_t*)a)[i] ^ ((uint8_t*)b)[i];
+	}
+}
 
-int TdesCbcCfb64Encrypt(void* Result, const void* Data, size_t Length, const void* Keys, int KeyCount, const void *IV)
+int Kelf::SetKeySet(const std::string& name)
 {
-	DES_key_schedule sc1;
-	DES_key_schedule sc2;
-	DES_key_schedule sc3;
+	int index = ring != NULL ? ring->Find(name) : -1;
+	if (index < 0)
+		return KELF_ERROR_UNKNOWN_KEYSET;
 
-	DES_set_key((const_DES_cblock*)Keys, &sc1);
-	if (KeyCount >= 2)
-		DES_set_key((const_DES_cblock*)((uint8_t*)Keys + 8), &sc2);
-	if (KeyCount >= 3)
-		DES_set_key((const_DES_cblock*)((uint8_t*)Keys + 16), &sc3);
+	keySet = index;
+	ctx = &ring->Get(keySet);
+	return 0;
+}
 
-	DES_cblock iv;
-	memcpy(&iv, IV, 8);
+// Switches to the keyset the header is signed with. Only the header goes
+// into the signature, so trying a keyset costs one short MAC, and the one
+// that matched the last file of the same kind is tried first.
+bool Kelf::SelectKeySet(KELFHeader& header, const uint8_t* HeaderSignature)
+{
+	uint8_t signature[8];
+	if (ring == NULL)
+	{
+		GetHeaderSignature(header, signature);
+		return memcmp(HeaderSignature, signature, 8) == 0;
+	}
 
-	if (KeyCount == 1)
-		DES_cbc_encrypt((uint8_t*)Data, (uint8_t*)Result, Length, &sc1, &iv, DES_ENCRYPT);
-	if (KeyCount == 2)
-		DES_ede2_cbc_encrypt((uint8_t*)Data, (uint8_t*)Result, Length, &sc1, &sc2, &iv, DES_ENCRYPT);
-	if (KeyCount == 3)
-		DES_ede3_cbc_encrypt((uint8_t*)Data, (uint8_t*)Result, Length, &sc1, &sc2, &sc3, &iv, DES_ENCRYPT);
-	else
-		return KELF_ERROR_INVALID_DES_KEY_COUNT;
+	size_t count = ring->GetCount();
+	size_t first = ring->GetLastMatch(header.SystemType, header.ApplicationType);
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t index = (first + i) % count;
+		ctx = &ring->Get(index);
+		GetHeaderSignature(header, signature);
+		if (memcmp(HeaderSignature, signature, 8) == 0)
+		{
+			keySet = index;
+			if (index != first)
+				ring->SetLastMatch(header.SystemType, header.ApplicationType, index);
+			return true;
+		}
+	}
 
-	return 0;
+	ctx = &ring->Get(keySet);
+	return false;
 }
 
-int TdesCbcCfb64Decrypt(void* Result, const void* Data, size_t Length, const void* Keys, int KeyCount, const void* IV)
+int Kelf::ParseHeader(const uint8_t* data, size_t size, KELFHeader& header)
 {
-	DES_key_schedule sc1;
-	DES_key_schedule sc2;
-	DES_key_schedule sc3;
+	if (size < sizeof(KELFHeader))
+		return KELF_ERROR_TRUNCATED;
 
-	DES_set_key((const_DES_cblock*)Keys, &sc1);
-	if (KeyCount >= 2)
-		DES_set_key((const_DES_cblock*)((uint8_t*)Keys + 8), &sc2);
-	if (KeyCount >= 3)
-		DES_set_key((const_DES_cblock*)((uint8_t*)Keys + 16), &sc3);
+	memcpy(&header, data, sizeof(header));
+	Header = header;
 
-	DES_cblock iv;
-	memcpy(&iv, IV, 8);
+	if (header.Flags & 1 || header.Flags & 0xf0000 || header.BitCount != 0)
+		return KELF_ERROR_UNSUPPORTED_FILE;
 
-	if (KeyCount == 1)
-		DES_cbc_encrypt((uint8_t*)Data, (uint8_t*)Result, Length, &sc1, &iv, DES_DECRYPT);
-	if (KeyCount == 2)
-		DES_ede2_cbc_encrypt((uint8_t*)Data, (uint8_t*)Result, Length, &sc1, &sc2, &iv, DES_DECRYPT);
-	if (KeyCount == 3)
-		DES_ede3_cbc_encrypt((uint8_t*)Data, (uint8_t*)Result, Length, &sc1, &sc2, &sc3, &iv, DES_DECRYPT);
-	else
-		return KELF_ERROR_INVALID_DES_KEY_COUNT;
+	if (header.HeaderSize > size)
+		return KELF_ERROR_TRUNCATED;
+
+	// Everything below reads up to HeaderSize only.
+	if (header.HeaderSize < KELF_MIN_HEADER_SIZE)
+		return KELF_ERROR_INVALID_BIT_TABLE_SIZE;
+
+	const uint8_t* f = data + sizeof(KELFHeader);
+
+	const uint8_t* HeaderSignature = f;
+	f += 8;
+
+	if (!SelectKeySet(header, HeaderSignature))
+		return KELF_ERROR_INVALID_HEADER_SIGNATURE;
+
+	DesKey KEK = DeriveKeyEncryptionKey(header);
+
+	memcpy(Kbit, f, 16);
+	f += 16;
+
+	memcpy(Kc, f, 16);
+	f += 16;
+
+	DecryptKeys(KEK);
+
+	int BitTableSize = header.HeaderSize - (f - data) - 8 - 8;
+	if (BitTableSize < 0 || (size_t)BitTableSize > sizeof(BitTable))
+		return KELF_ERROR_INVALID_BIT_TABLE_SIZE;
+
+	{
+		STATS_TIMER(STAT_BIT_TABLE, BitTableSize);
+		TdesCbcCfb64Decrypt((uint8_t*)& bitTable, f, BitTableSize, KbitKey, ctx->GetContentTableIV());
+	}
+	f += BitTableSize;
+
+	const uint8_t* BitTableSignature = f;
+	f += 8;
+
+	uint8_t signature[8];
+	GetBitTableSignature(signature);
+	if (memcmp(BitTableSignature, signature, 8) != 0)
+		return KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE;
+
+	GetRootSignature(HeaderSignature, BitTableSignature, signature);
+	if (memcmp(f, signature, 8) != 0)
+		return KELF_ERROR_INVALID_ROOT_SIGNATURE;
+	memcpy(RootSignature, f, 8);
+
+	// Kc only holds two keys, so three key content can't be decrypted.
+	int keycount = header.Flags >> 4 & 3;
+	if (keycount != 1 && keycount != 2)
+	{
+		for (int i = 0; i < bitTable.BlockCount; i++)
+			if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
+				return KELF_ERROR_INVALID_DES_KEY_COUNT;
+		keycount = 0;
+	}
+	KcKey.Set(Kc, keycount);
 
 	return 0;
 }
 
-void xor_bit(const void* a, const void* b, void* Result, size_t Length)
+int Kelf::ReadHeader(InputFile& in, KELFHeader& header)
 {
-	size_t i;
-	for (i = 0; i < Length; i++) {
-		((uint8_t*)Result)[i] = ((uint8_t*)a)[i] ^ ((uint8_t*)b)[i];
-	}
+	uint8_t buffer[KELF_MAX_HEADER_SIZE];
+
+	// Mapped input hands out consecutive pointers into the mapping, buffered
+	// input fills consecutive parts of buffer, so either way the header ends
+	// up contiguous behind start.
+	const uint8_t* start;
+	if (in.Read(sizeof(KELFHeader), &start, buffer) != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	uint16_t HeaderSize = ((const KELFHeader*)start)->HeaderSize;
+	if (HeaderSize < sizeof(KELFHeader) || HeaderSize > sizeof(buffer))
+		return KELF_ERROR_INVALID_BIT_TABLE_SIZE;
+
+	const uint8_t* rest;
+	if (in.Read(HeaderSize - sizeof(KELFHeader), &rest, buffer + sizeof(KELFHeader)) != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	return ParseHeader(start, HeaderSize, header);
+}
+
+size_t Kelf::GetPassThroughSize() const
+{
+	size_t size = 0;
+	for (int i = 0; i < bitTable.BlockCount; i++)
+		if (bitTable.Blocks[i].Flags == 0)
+			size += bitTable.Blocks[i].Size;
+	return size;
+}
+
+size_t Kelf::GetContentSize() const
+{
+	size_t size = 0;
+	for (int i = 0; i < bitTable.BlockCount; i++)
+		size += bitTable.Blocks[i].Size;
+	return size;
 }
 
 int Kelf::LoadKelf(std::string filename)
 {
-	FILE* f = fopen(filename.c_str(), "rb");
+	InputFile in;
+	if (in.Open(filename) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+	if (in.Load() != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	// Decrypt straight out of the mapped input, there is no staging copy.
+	return LoadKelf(in.Data(), in.Size());
+}
 
+int Kelf::LoadKelf(const void* data, size_t size)
+{
 	KELFHeader header;
-	fread(&header, sizeof(header), 1, f);
+	int ret = ParseHeader((const uint8_t*)data, size, header);
+	if (ret != 0)
+		return ret;
 
-	if (header.Flags & 1 || header.Flags & 0xf0000 || header.BitCount != 0)
+	size_t ContentSize = GetContentSize();
+	if (size - header.HeaderSize < ContentSize)
+		return KELF_ERROR_TRUNCATED;
+
+	Content.resize(ContentSize);
+	return ProcessContent((const uint8_t*)data + header.HeaderSize, (uint8_t*)Content.data(), true, true, threadCount);
+}
+
+int Kelf::LoadKelfHeader(std::string filename)
+{
+	InputFile in;
+	if (in.Open(filename, false) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	KELFHeader header;
+	return ReadHeader(in, header);
+}
+
+int Kelf::LoadKelfHeader(const void* data, size_t size)
+{
+	KELFHeader header;
+	return ParseHeader((const uint8_t*)data, size, header);
+}
+
+int Kelf::DecryptKelf(const void* data, size_t size, void* output, size_t outputSize)
+{
+	KELFHeader header;
+	int ret = ParseHeader((const uint8_t*)data, size, header);
+	if (ret != 0)
+		return ret;
+
+	size_t ContentSize = GetContentSize();
+	if (size - header.HeaderSize < ContentSize)
+		return KELF_ERROR_TRUNCATED;
+	if (outputSize < ContentSize)
+		return KELF_ERROR_BUFFER_TOO_SMALL;
+
+	return ProcessContent((const uint8_t*)data + header.HeaderSize, (uint8_t*)output, true, true, threadCount);
+}
+
+int Kelf::VerifyKelf(std::string filename)
+{
+	InputFile in;
+	if (in.Open(filename) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+	if (in.Load() != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	return VerifyKelf(in.Data(), in.Size());
+}
+
+int Kelf::VerifyKelf(const void* data, size_t size)
+{
+	KELFHeader header;
+	int ret = ParseHeader((const uint8_t*)data, size, header);
+	if (ret != 0)
+		return ret;
+
+	if (size - header.HeaderSize < GetContentSize())
+		return KELF_ERROR_TRUNCATED;
+
+	return ProcessContent((const uint8_t*)data + header.HeaderSize, NULL, true, true, threadCount);
+}
+
+int Kelf::DecryptKelfStream(std::string input, std::string output)
+{
+	// Decrypting a file onto itself needs all of it in memory first.
+	if (InputFile::IsSameFile(input, output))
 	{
-		printf("This file is not supported yet and looked after.");
-		printf("Please upload it and post it under that issue:");
-		printf("https://github.com/xfwcfw/kelftool/issues/1");
-		return KELF_ERROR_UNSUPPORTED_FILE;
+		int ret = LoadKelf(input);
+		return ret != 0 ? ret : SaveContent(output);
 	}
 
-	std::string HeaderSignature;
-	HeaderSignature.resize(8);
-	fread(HeaderSignature.data(), 1, HeaderSignature.size(), f);
+	InputFile in;
+	if (in.Open(input) != 0)
+		return KELF_ERROR_OPEN_FAILED;
 
-	if (HeaderSignature != GetHeaderSignature(header))
-		return KELF_ERROR_INVALID_HEADER_SIGNATURE;
+	KELFHeader header;
+	int ret = ReadHeader(in, header);
+	if (ret != 0)
+		return ret;
+
+	OutputFile out;
+	if (out.Create(output, GetContentSize()) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	// The working set is bounded by a few chunks no matter how big the
+	// content is: the read buffer (only needed when the input is not mapped)
+	// and the output buffer (only needed when the output is not mapped).
+	std::vector<uint8_t> chunk;
+	if (!in.IsMapped())
+		chunk.resize(KELF_STREAM_CHUNK_SIZE);
+
+	for (int i = 0; i < bitTable.BlockCount && ret == 0; i++)
+	{
+		uint32_t flags = bitTable.Blocks[i].Flags;
 
-	std::string KEK = DeriveKeyEncryptionKey(header);
+		// Neither encrypted nor signed, so there is nothing to look at.
+		if (flags == 0)
+		{
+			int moved = in.Transfer(out, bitTable.Blocks[i].Size);
+			if (moved != 0)
+				ret = moved == FILEIO_ERROR_READ_FAILED ? KELF_ERROR_READ_FAILED : KELF_ERROR_WRITE_FAILED;
+			continue;
+		}
 
-	Kbit.resize(16);
-	fread(Kbit.data(), 1, Kbit.size(), f);
+		uint8_t iv[8];
+		memcpy(iv, ctx->GetContentIV(), 8);
+		Signer signer(*ctx, flags & BIT_BLOCK_ENCRYPTED ? SIGNER_MODE_XOR : SIGNER_MODE_MAC);
 
-	Kc.resize(16);
-	fread(Kc.data(), 1, Kc.size(), f);
+		uint32_t remaining = bitTable.Blocks[i].Size;
+		while (remaining > 0)
+		{
+			size_t length = remaining < KELF_STREAM_CHUNK_SIZE ? remaining : KELF_STREAM_CHUNK_SIZE;
 
-	DecryptKeys(KEK);
+			const uint8_t* data;
+			if (in.Read(length, &data, chunk.data()) != 0)
+			{
+				ret = KELF_ERROR_READ_FAILED;
+				break;
+			}
 
-	int BitTableSize = header.HeaderSize - ftell(f) - 8 - 8;
-	if (BitTableSize > sizeof(BitTable))
-		return KELF_ERROR_INVALID_BIT_TABLE_SIZE;
+			uint8_t* decrypted = NULL;
+			if (flags & BIT_BLOCK_ENCRYPTED)
+			{
+				decrypted = out.Reserve(length);
+				if (decrypted == NULL)
+				{
+					ret = KELF_ERROR_WRITE_FAILED;
+					break;
+				}
+			}
 
-	fread(&bitTable, 1, BitTableSize, f);
+			const uint8_t* plain;
+			{
+				STATS_TIMER(STAT_DECRYPT, length);
+				plain = ProcessChunk(flags & BIT_BLOCK_ENCRYPTED, data, decrypted, length, iv, flags & BIT_BLOCK_SIGNED ? &signer : NULL, NULL);
+			}
 
-	TdesCbcCfb64Decrypt((uint8_t *)& bitTable, (uint8_t*)& bitTable, BitTableSize, (uint8_t*)Kbit.data(), 2, ks.GetContentTableIV().data());
+			int written = decrypted ? out.Commit(length) : out.Write(plain, length);
+			if (written != 0)
+			{
+				ret = KELF_ERROR_WRITE_FAILED;
+				break;
+			}
 
-	std::string BitTableSignature;
-	BitTableSignature.resize(8);
-	fread(BitTableSignature.data(), 1, BitTableSignature.size(), f);
+			remaining -= length;
+		}
 
-	if (BitTableSignature != GetBitTableSignature())
-		return KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE;
+		if (ret == 0 && flags & BIT_BLOCK_SIGNED)
+		{
+			uint8_t signature[8];
+			signer.Final(signature);
+			if (memcmp(bitTable.Blocks[i].Signature, signature, 8) != 0)
+				ret = KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+		}
+	}
 
-	std::string RootSignature;
-	RootSignature.resize(8);
-	fread(RootSignature.data(), 1, RootSignature.size(), f);
+	if (ret == 0 && out.Close() != 0)
+		ret = KELF_ERROR_WRITE_FAILED;
 
-	if (RootSignature != GetRootSignature(HeaderSignature, BitTableSignature))
-		return KELF_ERROR_INVALID_ROOT_SIGNATURE;
+	// Never leave output behind that did not pass verification.
+	if (ret != 0)
+		out.Discard();
 
-	for (int i = 0; i < bitTable.BlockCount; i++)
+	return ret;
+}
+
+int Kelf::DecryptKelfRange(std::string input, std::string output, uint64_t offset, uint64_t length, bool verify)
+{
+	InputFile in;
+	if (in.Open(input) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	KELFHeader header;
+	int ret = ReadHeader(in, header);
+	if (ret != 0)
+		return ret;
+
+	size_t ContentSize = GetContentSize();
+	if (offset > ContentSize || length > ContentSize - offset)
+		return KELF_ERROR_INVALID_RANGE;
+
+	uint64_t start, end;
+	GetRangeExtent(offset, length, verify, start, end);
+
+	// Mapped input hands out pointers, so skipping to the range costs
+	// nothing. Anything else is read through a chunk up to it.
+	std::vector<uint8_t> buffer;
+	if (!in.IsMapped())
+		buffer.resize(end - start > KELF_STREAM_CHUNK_SIZE ? end - start : KELF_STREAM_CHUNK_SIZE);
+
+	const uint8_t* data;
+	for (uint64_t skipped = 0; skipped < start;)
+	{
+		size_t chunk = start - skipped < KELF_STREAM_CHUNK_SIZE ? start - skipped : KELF_STREAM_CHUNK_SIZE;
+		if (in.Read(chunk, &data, buffer.data()) != 0)
+			return KELF_ERROR_READ_FAILED;
+		skipped += chunk;
+	}
+	if (in.Read(end - start, &data, buffer.data()) != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	OutputFile out;
+	if (out.Create(output, length) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	if (length != 0)
 	{
-		std::string Block;
-		Block.resize(bitTable.Blocks[i].Size);
-		fread(Block.data(), 1, Block.size(), f);
-		Content += Block;
+		uint8_t* plain = out.Reserve(length);
+		if (plain == NULL)
+			ret = KELF_ERROR_WRITE_FAILED;
+		else
+			ret = DecryptRange(data, start, offset, length, plain, verify);
+		if (ret == 0 && out.Commit(length) != 0)
+			ret = KELF_ERROR_WRITE_FAILED;
 	}
 
-	DecryptContent(header.Flags >> 4 & 3);
+	if (ret == 0 && out.Close() != 0)
+		ret = KELF_ERROR_WRITE_FAILED;
+	if (ret != 0)
+		out.Discard();
+
+	return ret;
+}
+
+// Reads and checks the header of in and writes it to buffer again with the
+// template applied, wrapping the unchanged keys for the new header. in is
+// left at the start of the content.
+int Kelf::RewrapHeader(InputFile& in, uint8_t* buffer, size_t& HeaderSize)
+{
+	KELFHeader header;
+	int ret = ReadHeader(in, header);
+	if (ret != 0)
+		return ret;
 
-	if (VerifyContentSignature() != 0)
-		return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+	// The bit table is written back at its real size, which has to be the
+	// size the file has.
+	if (header.HeaderSize != sizeof(KELFHeader) + 8 + 16 + 16 + (bitTable.BlockCount * 2 + 1) * 8 + 8 + 8)
+		return KELF_ERROR_UNSUPPORTED_FILE;
 
-	fclose(f);
+	KELFHeader target = header;
+	headerTemplate.Apply(target);
+	if ((target.Flags >> 4 & 3) != (header.Flags >> 4 & 3))
+		return KELF_ERROR_INVALID_HEADER_TEMPLATE;
 
+	HeaderSize = WriteHeader(target, buffer);
+	Header = target;
 	return 0;
 }
 
-int Kelf::SaveKelf(std::string filename)
+int Kelf::RewrapKelf(std::string filename)
+{
+	uint8_t header[KELF_MAX_HEADER_SIZE];
+	size_t HeaderSize;
+	{
+		InputFile in;
+		if (in.Open(filename, false) != 0)
+			return KELF_ERROR_OPEN_FAILED;
+		int ret = RewrapHeader(in, header, HeaderSize);
+		if (ret != 0)
+			return ret;
+	}
+
+	// The header keeps its size, so it is simply written over the old one.
+	FILE* file = fopen(filename.c_str(), "r+b");
+	if (file == NULL)
+		return KELF_ERROR_OPEN_FAILED;
+
+	int ret = 0;
+	if (fwrite(header, 1, HeaderSize, file) != HeaderSize)
+		ret = KELF_ERROR_WRITE_FAILED;
+	if (fclose(file) != 0 && ret == 0)
+		ret = KELF_ERROR_WRITE_FAILED;
+
+	return ret;
+}
+
+int Kelf::RewrapKelf(std::string input, std::string output)
+{
+	if (InputFile::IsSameFile(input, output))
+		return RewrapKelf(input);
+
+	InputFile in;
+	if (in.Open(input, false) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	uint8_t header[KELF_MAX_HEADER_SIZE];
+	size_t HeaderSize;
+	int ret = RewrapHeader(in, header, HeaderSize);
+	if (ret != 0)
+		return ret;
+
+	size_t ContentSize = GetContentSize();
+	OutputFile out;
+	if (out.Create(output, HeaderSize + ContentSize) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	if (out.Write(header, HeaderSize) != 0 || in.Transfer(out, ContentSize) != 0 || out.Close() != 0)
+	{
+		out.Discard();
+		return KELF_ERROR_WRITE_FAILED;
+	}
+
+	return 0;
+}
+
+int Kelf::PatchKelf(std::string filename, const std::vector<KelfPatch>& patches)
 {
-	FILE* f = fopen(filename.c_str(), "wb");
+	FILE* file = fopen(filename.c_str(), "r+b");
+	if (file == NULL)
+		return KELF_ERROR_OPEN_FAILED;
+
+	uint8_t buffer[KELF_MAX_HEADER_SIZE];
+	KELFHeader header;
+	int ret = 0;
+	if (fread(buffer, 1, sizeof(KELFHeader), file) != sizeof(KELFHeader))
+		ret = KELF_ERROR_READ_FAILED;
+	else
+	{
+		uint16_t HeaderSize = ((const KELFHeader*)buffer)->HeaderSize;
+		if (HeaderSize < sizeof(KELFHeader) || HeaderSize > sizeof(buffer))
+			ret = KELF_ERROR_INVALID_BIT_TABLE_SIZE;
+		else if (fread(buffer + sizeof(KELFHeader), 1, HeaderSize - sizeof(KELFHeader), file) != HeaderSize - sizeof(KELFHeader))
+			ret = KELF_ERROR_READ_FAILED;
+		else
+			ret = ParseHeader(buffer, HeaderSize, header);
+	}
+
+	// The rewritten bit table has to fit exactly where the old one was.
+	size_t BitTableOffset = sizeof(KELFHeader) + 8 + 16 + 16;
+	size_t BitTableSize = (bitTable.BlockCount * 2 + 1) * 8;
+	if (ret == 0 && header.HeaderSize != BitTableOffset + BitTableSize + 8 + 8)
+		ret = KELF_ERROR_UNSUPPORTED_FILE;
+
+	size_t ContentSize = GetContentSize();
+	for (size_t i = 0; ret == 0 && i < patches.size(); i++)
+		if (patches[i].Offset > ContentSize || patches[i].Data.size() > ContentSize - patches[i].Offset)
+			ret = KELF_ERROR_INVALID_PATCH;
+
+	// Touched blocks are brought into plain form, checked, patched, signed
+	// and encrypted again in memory, nothing is written before all of them
+	// made it. Blocks that are neither encrypted nor signed just take the
+	// patch bytes.
+	struct Block
+	{
+		long Position;
+		std::string Data;
+	};
+	std::vector<Block> blocks;
+	bool resigned = false;
+
+	uint32_t offset = 0;
+	for (int i = 0; ret == 0 && i < bitTable.BlockCount; offset += bitTable.Blocks[i].Size, i++)
+	{
+		BitTable::BitBlock& block = bitTable.Blocks[i];
+
+		bool touched = false;
+		for (const KelfPatch& patch : patches)
+			if (!patch.Data.empty() && patch.Offset < offset + block.Size && patch.Offset + patch.Data.size() > offset)
+				touched = true;
+		if (!touched)
+			continue;
+
+		// Later patches win where they overlap, in the file as in memory.
+		if (!(block.Flags & (BIT_BLOCK_ENCRYPTED | BIT_BLOCK_SIGNED)))
+		{
+			for (const KelfPatch& patch : patches)
+			{
+				uint32_t start = patch.Offset > offset ? patch.Offset : offset;
+				uint32_t end = patch.Offset + patch.Data.size() < offset + block.Size ? patch.Offset + patch.Data.size() : offset + block.Size;
+				if (start < end)
+					blocks.push_back({ (long)(header.HeaderSize + start), patch.Data.substr(start - patch.Offset, end - start) });
+			}
+			continue;
+		}
+
+		Block changed;
+		changed.Position = header.HeaderSize + offset;
+		changed.Data.resize(block.Size);
+		uint8_t* data = (uint8_t*)changed.Data.data();
+		if (fseek(file, changed.Position, SEEK_SET) != 0 || fread(data, 1, block.Size, file) != block.Size)
+		{
+			ret = KELF_ERROR_READ_FAILED;
+			break;
+		}
+
+		int mode = block.Flags & BIT_BLOCK_ENCRYPTED ? SIGNER_MODE_XOR : SIGNER_MODE_MAC;
+		Signer signer(*ctx, mode);
+		uint8_t iv[8];
+		memcpy(iv, ctx->GetContentIV(), 8);
+		ProcessChunk(block.Flags & BIT_BLOCK_ENCRYPTED, data, data, block.Size, iv, &signer, NULL);
+
+		uint8_t signature[8];
+		signer.Final(signature);
+		if (block.Flags & BIT_BLOCK_SIGNED && memcmp(block.Signature, signature, 8) != 0)
+		{
+			ret = KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+			break;
+		}
+
+		// Later patches win where they overlap.
+		for (const KelfPatch& patch : patches)
+		{
+			uint32_t start = patch.Offset > offset ? patch.Offset : offset;
+			uint32_t end = patch.Offset + patch.Data.size() < offset + block.Size ? patch.Offset + patch.Data.size() : offset + block.Size;
+			if (start < end)
+				memcpy(data + start - offset, patch.Data.data() + start - patch.Offset, end - start);
+		}
+
+		if (block.Flags & BIT_BLOCK_SIGNED)
+		{
+			signer.Reset();
+			signer.Update(data, block.Size);
+			signer.Final(block.Signature);
+			if (memcmp(block.Signature, signature, 8) != 0)
+				resigned = true;
+		}
+		if (block.Flags & BIT_BLOCK_ENCRYPTED)
+			TdesCbcCfb64Encrypt(data, data, block.Size, KcKey, ctx->GetContentIV());
+
+		blocks.push_back(changed);
+	}
+
+	if (ret != 0 || blocks.empty())
+	{
+		fclose(file);
+		return ret;
+	}
 
+	for (const Block& changed : blocks)
+	{
+		if (fseek(file, changed.Position, SEEK_SET) != 0 || fwrite(changed.Data.data(), 1, changed.Data.size(), file) != changed.Data.size())
+			ret = KELF_ERROR_WRITE_FAILED;
+	}
+
+	// The header signature and the keys stay as they are, everything from the
+	// bit table on is signed over the block signatures, so it only changes
+	// with one of them.
+	if (ret == 0 && resigned)
+	{
+		uint8_t* HeaderSignature = buffer + sizeof(KELFHeader);
+		uint8_t* f = buffer + BitTableOffset;
+		TdesCbcCfb64Encrypt(f, &bitTable, BitTableSize, KbitKey, ctx->GetContentTableIV());
+		f += BitTableSize;
+
+		uint8_t* BitTableSignature = f;
+		GetBitTableSignature(BitTableSignature);
+		f += 8;
+
+		GetRootSignature(HeaderSignature, BitTableSignature, f);
+		memcpy(RootSignature, f, 8);
+		f += 8;
+
+		size_t tail = f - buffer - BitTableOffset;
+		if (fseek(file, BitTableOffset, SEEK_SET) != 0 || fwrite(buffer + BitTableOffset, 1, tail, file) != tail)
+			ret = KELF_ERROR_WRITE_FAILED;
+	}
+
+	if (fclose(file) != 0 && ret == 0)
+		ret = KELF_ERROR_WRITE_FAILED;
+
+	return ret;
+}
+
+size_t Kelf::WriteHeader(uint8_t* buffer)
+{
 	KELFHeader header;
 	static uint8_t PSX_USER[] = { 0x01, 0x03, 0x00, 0x04, 0x00, 0x02, 0x00, 0x4A, 0x00, 0x07, 0x01, 0x00, 0x00, 0x00, 0x01, 0x78 };
 	memcpy(header.UserDefined, PSX_USER, 16);
-	header.ContentSize = Content.size();
-	header.HeaderSize = sizeof(KELFHeader) + 8 + 16 + 16 + 8 + 16 + 16 + 8 + 8; // header + header signature + kbit + kc + bittable + bittable signature + root signature
+	header.ContentSize = GetContentSize();
+	header.HeaderSize = bitTable.HeaderSize;
 	header.SystemType = SYSTEM_TYPE_PSX;
 	header.ApplicationType = 1; // 1 = xosdmain, 5 = dvdplayer kirx 7 = dvdplayer kelf
 	header.Flags = 0x22C;
 	header.BitCount = 0;
 	header.MGZones = 1; // Japan
+	headerTemplate.Apply(header);
 
-	std::string HeaderSignature = GetHeaderSignature(header);
-	std::string BitTableSignature = GetBitTableSignature();
-	std::string RootSignature = GetRootSignature(HeaderSignature, BitTableSignature);
+	return WriteHeader(header, buffer);
+}
+
+// Signs header and writes it with the wrapped keys, bit table and the
+// signatures over them. The bit table has to fill header.HeaderSize.
+size_t Kelf::WriteHeader(KELFHeader& header, uint8_t* buffer)
+{
+	uint8_t* f = buffer;
+	memcpy(f, &header, sizeof(header));
+	f += sizeof(header);
+
+	uint8_t* HeaderSignature = f;
+	GetHeaderSignature(header, HeaderSignature);
+	f += 8;
+
+	// The keys and the bit table are encrypted on their way out, the plain
+	// copies stay around so the file can be written again.
+	DesKey KEK = DeriveKeyEncryptionKey(header);
+	for (int i = 0; i < 2; i++)
+		TdesCbcCfb64Encrypt(f + i * 8, Kbit + i * 8, 8, KEK, MG_IV_NULL);
+	f += 16;
+	for (int i = 0; i < 2; i++)
+		TdesCbcCfb64Encrypt(f + i * 8, Kc + i * 8, 8, KEK, MG_IV_NULL);
+	f += 16;
 
 	int BitTableSize = (bitTable.BlockCount * 2 + 1) * 8;
+	TdesCbcCfb64Encrypt(f, &bitTable, BitTableSize, KbitKey, ctx->GetContentTableIV());
+	f += BitTableSize;
+
+	uint8_t* BitTableSignature = f;
+	GetBitTableSignature(BitTableSignature);
+	f += 8;
+
+	GetRootSignature(HeaderSignature, BitTableSignature, f);
+	memcpy(RootSignature, f, 8);
+	f += 8;
+
+	return f - buffer;
+}
+
+size_t Kelf::GetKelfSize() const
+{
+	return sizeof(KELFHeader) + 8 + 16 + 16 + (bitTable.BlockCount * 2 + 1) * 8 + 8 + 8 + Content.size();
+}
 
-	TdesCbcCfb64Encrypt((uint8_t*)& bitTable, (uint8_t*)& bitTable, (bitTable.BlockCount * 2 + 1) * 8, (uint8_t*)Kbit.data(), 2, ks.GetContentTableIV().data());
+int Kelf::SaveKelf(std::string filename)
+{
+	uint8_t header[KELF_MAX_HEADER_SIZE];
+	size_t HeaderSize = WriteHeader(header);
 
-	std::string KEK = DeriveKeyEncryptionKey(header);
-	EncryptKeys(KEK);
+	OutputFile f;
+	if (f.Create(filename, HeaderSize + Content.size()) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	if (f.Write(header, HeaderSize) != 0 ||
+		f.Write(Content.data(), Content.size()) != 0 ||
+		f.Close() != 0)
+	{
+		f.Discard();
+		return KELF_ERROR_WRITE_FAILED;
+	}
 
-	fwrite(&header, sizeof(header), 1, f);
-	fwrite(HeaderSignature.data(), 1, HeaderSignature.size(), f);
-	fwrite(Kbit.data(), 1, Kbit.size(), f);
-	fwrite(Kc.data(), 1, Kc.size(), f);
-	fwrite(&bitTable, 1, BitTableSize, f);
-	fwrite(BitTableSignature.data(), 1, BitTableSignature.size(), f);
-	fwrite(RootSignature.data(), 1, RootSignature.size(), f);
+	return 0;
+}
 
-	fwrite(Content.data(), 1, Content.size(), f);
-	fclose(f);
+int Kelf::SaveKelf(void* output, size_t outputSize)
+{
+	if (outputSize < GetKelfSize())
+		return KELF_ERROR_BUFFER_TOO_SMALL;
 
+	size_t HeaderSize = WriteHeader((uint8_t*)output);
+	memcpy((uint8_t*)output + HeaderSize, Content.data(), Content.size());
 	return 0;
 }
 
 int Kelf::LoadContent(std::string filename)
 {
-	FILE* f = fopen(filename.c_str(), "rb");
-	fseek(f, 0, SEEK_END);
-	Content.resize(ftell(f));
-	fseek(f, 0, SEEK_SET);
-	fread(Content.data(), 1, Content.size(), f);
-	fclose(f);
+	InputFile f;
+	if (f.Open(filename) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+	if (f.Load() != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	return LoadContent(f.Data(), f.Size());
+}
+
+int Kelf::BuildBitTable(size_t size, BitTable& table, uint32_t* offsets) const
+{
+	if (size > UINT32_MAX)
+		return KELF_ERROR_UNSUPPORTED_FILE;
+
+	memset(&table, 0, sizeof(table));
+	for (size_t entry = 0, offset = 0; offset < size; entry++)
+	{
+		const KelfLayoutEntry& e = layout[entry < layout.size() ? entry : layout.size() - 1];
+		size_t length = e.Size != 0 && e.Size < size - offset ? e.Size : size - offset;
+
+		// CBC only covers whole DES blocks, the tail of encrypted content is
+		// left plain.
+		size_t parts[2] = { length, 0 };
+		if (e.Flags & BIT_BLOCK_ENCRYPTED)
+		{
+			parts[0] = length & ~(size_t)7;
+			parts[1] = length & 7;
+		}
+
+		for (int p = 0; p < 2; p++)
+		{
+			if (parts[p] == 0)
+				continue;
+			if (table.BlockCount == KELF_MAX_BLOCKS)
+				return KELF_ERROR_INVALID_LAYOUT;
+
+			offsets[table.BlockCount] = offset;
+			table.Blocks[table.BlockCount].Size = parts[p];
+			table.Blocks[table.BlockCount].Flags = p == 0 ? e.Flags : e.Flags & ~BIT_BLOCK_ENCRYPTED;
+			table.BlockCount++;
+			offset += parts[p];
+		}
+	}
+	table.HeaderSize = sizeof(KELFHeader) + 8 + 16 + 16 + (table.BlockCount * 2 + 1) * 8 + 8 + 8; // header + header signature + kbit + kc + bittable + bittable signature + root signature
+
+	return 0;
+}
 
+void Kelf::SealContent(uint8_t* content, const uint32_t* offsets)
+{
 	// TODO: random kbit?
-	Kbit.resize(16);
-	memset(Kbit.data(), 0xAA, Kbit.size());
+	memset(Kbit, 0xAA, sizeof(Kbit));
+	KbitKey.Set(Kbit, 2);
 
 	// TODO: random kc?
-	Kc.resize(16);
-	memset(Kc.data(), 0xBB, Kc.size());
+	memset(Kc, 0xBB, sizeof(Kc));
+	KcKey.Set(Kc, 2);
+
+	// Many plain signed blocks are MACed side by side up front.
+	int macIndex[256];
+	uint8_t macs[256][8];
+	BatchMacs(content, offsets, macIndex, macs);
+
+	STATS_TIMER(STAT_ENCRYPT, GetContentSize());
+
+	// CBC is serial within a block, but every block starts over from the
+	// content IV, so the blocks are signed and encrypted in parallel. Each
+	// one goes chunk by chunk so its data is still in cache for encryption
+	// after being signed.
+	unsigned threads = threadCount ? threadCount : ThreadPool::GetDefaultThreadCount();
+	ThreadPool::ParallelFor(bitTable.BlockCount, threads, [&](size_t i) {
+		BitTable::BitBlock& block = bitTable.Blocks[i];
+		uint8_t* data = content + offsets[i];
+		bool encrypt = block.Flags & BIT_BLOCK_ENCRYPTED;
+		bool sign = block.Flags & BIT_BLOCK_SIGNED && macIndex[i] < 0;
+
+		Signer signer(*ctx, encrypt ? SIGNER_MODE_XOR : SIGNER_MODE_MAC);
+		uint8_t iv[8];
+		memcpy(iv, ctx->GetContentIV(), 8);
+		for (uint32_t done = 0; (sign || encrypt) && done < block.Size; done += KELF_STREAM_CHUNK_SIZE)
+		{
+			size_t length = block.Size - done < KELF_STREAM_CHUNK_SIZE ? block.Size - done : KELF_STREAM_CHUNK_SIZE;
+			if (sign)
+				signer.Update(data + done, length);
+			if (encrypt)
+			{
+				TdesCbcCfb64Encrypt(data + done, data + done, length, KcKey, iv);
+				memcpy(iv, data + done + length - 8, 8);
+			}
+		}
+
+		if (block.Flags & BIT_BLOCK_SIGNED)
+		{
+			if (macIndex[i] >= 0)
+				signer.SetState(macs[macIndex[i]]);
+			signer.Final(block.Signature);
+		}
+	});
+}
+
+int Kelf::LoadContent(const void* data, size_t size)
+{
+	BitTable table;
+	uint32_t offsets[KELF_MAX_BLOCKS];
+	int ret = BuildBitTable(size, table, offsets);
+	if (ret != 0)
+		return ret;
+
+	Content.assign((const char*)data, size);
+	bitTable = table;
+	SealContent((uint8_t*)Content.data(), offsets);
+
+	return 0;
+}
+
+int Kelf::EncryptKelfStream(std::string input, std::string output)
+{
+	InputFile in;
+	if (in.Open(input) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	// The layout depends on the size, which only mapped input knows before
+	// reading all of it. Output onto the input also takes the copy in memory.
+	if (!in.IsMapped() || InputFile::IsSameFile(input, output))
+	{
+		if (in.Load() != 0)
+			return KELF_ERROR_READ_FAILED;
+		int ret = LoadContent(in.Data(), in.Size());
+		return ret != 0 ? ret : SaveKelf(output);
+	}
+
+	size_t size = in.Size();
+	BitTable table;
+	uint32_t offsets[KELF_MAX_BLOCKS];
+	int ret = BuildBitTable(size, table, offsets);
+	if (ret != 0)
+		return ret;
+	bitTable = table;
+	Content.clear();
+
+	// Only the blocks that are encrypted or signed are copied out of the
+	// input and sealed, the others go from input to output unchanged.
+	uint32_t sealedOffsets[KELF_MAX_BLOCKS];
+	size_t sealedSize = 0;
+	for (int i = 0; i < bitTable.BlockCount; i++)
+	{
+		sealedOffsets[i] = sealedSize;
+		if (bitTable.Blocks[i].Flags != 0)
+			sealedSize += bitTable.Blocks[i].Size;
+	}
+
+	std::vector<uint8_t> sealed(sealedSize);
+	for (int i = 0; i < bitTable.BlockCount; i++)
+		if (bitTable.Blocks[i].Flags != 0)
+			memcpy(&sealed[sealedOffsets[i]], in.Data() + offsets[i], bitTable.Blocks[i].Size);
+	SealContent(sealed.data(), sealedOffsets);
+
+	uint8_t header[KELF_MAX_HEADER_SIZE];
+	size_t HeaderSize = WriteHeader(header);
 
-	bitTable.HeaderSize = sizeof(KELFHeader) + 8 + 16 + 16 + 8 + 16 + 16 + 8 + 8; // header + header signature + kbit + kc + bittable + bittable signature + root signature
-	bitTable.BlockCount = 2;
-	bitTable.Blocks[0].Size = 0x20;
-	bitTable.Blocks[0].Flags = BIT_BLOCK_SIGNED | BIT_BLOCK_ENCRYPTED;
-	memset(bitTable.Blocks[0].Signature, 0, 8);
+	OutputFile out;
+	if (out.Create(output, HeaderSize + size) != 0)
+		return KELF_ERROR_OPEN_FAILED;
 
-	// Sign
-	for (int j = 0; j < 0x20; j += 8)
-		xor_bit(&Content.data()[j], bitTable.Blocks[0].Signature, bitTable.Blocks[0].Signature, 8);
+	if (out.Write(header, HeaderSize) != 0)
+		ret = KELF_ERROR_WRITE_FAILED;
+	for (int i = 0; i < bitTable.BlockCount && ret == 0; i++)
+	{
+		uint32_t length = bitTable.Blocks[i].Size;
+		if (bitTable.Blocks[i].Flags == 0)
+		{
+			if (in.Transfer(out, length) != 0)
+				ret = KELF_ERROR_WRITE_FAILED;
+			continue;
+		}
+
+		const uint8_t* skipped;
+		if (in.Read(length, &skipped, NULL) != 0 || out.Write(&sealed[sealedOffsets[i]], length) != 0)
+			ret = KELF_ERROR_WRITE_FAILED;
+	}
+
+	if (ret == 0 && out.Close() != 0)
+		ret = KELF_ERROR_WRITE_FAILED;
+	if (ret != 0)
+		out.Discard();
+
+	return ret;
+}
+
+std::vector<KelfLayoutEntry> Kelf::GetDefaultLayout()
+{
+	return { { 0x20, BIT_BLOCK_SIGNED | BIT_BLOCK_ENCRYPTED }, { 0, 0 } };
+}
+
+int Kelf::SetLayout(const std::vector<KelfLayoutEntry>& entries)
+{
+	if (entries.empty())
+		return KELF_ERROR_INVALID_LAYOUT;
+
+	for (const KelfLayoutEntry& entry : entries)
+	{
+		if (entry.Flags & ~(BIT_BLOCK_ENCRYPTED | BIT_BLOCK_SIGNED))
+			return KELF_ERROR_INVALID_LAYOUT;
+		if (entry.Flags & BIT_BLOCK_ENCRYPTED && entry.Size % 8 != 0)
+			return KELF_ERROR_INVALID_LAYOUT;
+	}
+
+	layout = entries;
+	return 0;
+}
+
+int Kelf::ParseLayout(std::string text, std::vector<KelfLayoutEntry>& entries)
+{
+	entries.clear();
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string item = text.substr(start, end - start);
+		start = end + 1;
+
+		size_t colon = item.find(':');
+		if (colon == std::string::npos)
+			return KELF_ERROR_INVALID_LAYOUT;
+
+		KelfLayoutEntry entry = { 0, 0 };
+		std::string size = item.substr(0, colon);
+		if (size != "*")
+		{
+			char* unit;
+			unsigned long long value = strtoull(size.c_str(), &unit, 0);
+			if (unit == size.c_str())
+				return KELF_ERROR_INVALID_LAYOUT;
+			if (*unit == 'K' || *unit == 'k')
+				value *= 1024, unit++;
+			else if (*unit == 'M' || *unit == 'm')
+				value *= 1024 * 1024, unit++;
+			if (*unit != '\0' || value == 0 || value > UINT32_MAX)
+				return KELF_ERROR_INVALID_LAYOUT;
+			entry.Size = (uint32_t)value;
+		}
+
+		for (size_t i = colon + 1; i < item.size(); i++)
+		{
+			if (item[i] == 'e')
+				entry.Flags |= BIT_BLOCK_ENCRYPTED;
+			else if (item[i] == 's')
+				entry.Flags |= BIT_BLOCK_SIGNED;
+			else
+				return KELF_ERROR_INVALID_LAYOUT;
+		}
+
+		entries.push_back(entry);
+	}
 
-	uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
-	memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
-	memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
+	return 0;
+}
+
+void KelfHeaderTemplate::Apply(KELFHeader& header) const
+{
+	if (Fields & KELF_HEADER_USER_DEFINED)
+		memcpy(header.UserDefined, Values.UserDefined, sizeof(header.UserDefined));
+	if (Fields & KELF_HEADER_SYSTEM_TYPE)
+		header.SystemType = Values.SystemType;
+	if (Fields & KELF_HEADER_APPLICATION_TYPE)
+		header.ApplicationType = Values.ApplicationType;
+	if (Fields & KELF_HEADER_FLAGS)
+		header.Flags = Values.Flags;
+	if (Fields & KELF_HEADER_MG_ZONES)
+		header.MGZones = Values.MGZones;
+}
 
-	TdesCbcCfb64Encrypt(bitTable.Blocks[0].Signature, bitTable.Blocks[0].Signature, 8, MG_SIG_MASTER_AND_HASH_KEY, 2, MG_IV_NULL);
+int Kelf::SetHeaderTemplate(const KelfHeaderTemplate& header)
+{
+	// The same checks ParseHeader makes, and Kc only holds two keys.
+	if (header.Fields & KELF_HEADER_FLAGS)
+	{
+		uint16_t flags = header.Values.Flags;
+		if (flags & 1 || (flags >> 4 & 3) == 3)
+			return KELF_ERROR_INVALID_HEADER_TEMPLATE;
+	}
 
-	// Encrypt
-	TdesCbcCfb64Encrypt(Content.data(), Content.data(), 0x20, Kc.data(), 2, ks.GetContentIV().data());
+	headerTemplate = header;
+	return 0;
+}
 
-	bitTable.Blocks[1].Size = Content.size() - 0x20;
-	bitTable.Blocks[1].Flags = 0;
-	memset(bitTable.Blocks[1].Signature, 0, 8);
+int Kelf::ParseHeaderTemplate(std::string text, KelfHeaderTemplate& header)
+{
+	header = KelfHeaderTemplate();
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == std::string::npos)
+			end = text.size();
+		std::string item = text.substr(start, end - start);
+		start = end + 1;
+
+		size_t equals = item.find('=');
+		if (equals == std::string::npos)
+			return KELF_ERROR_INVALID_HEADER_TEMPLATE;
+		std::string name = item.substr(0, equals);
+		std::string value = item.substr(equals + 1);
+
+		if (name == "userDefined")
+		{
+			if (value.size() != sizeof(header.Values.UserDefined) * 2)
+				return KELF_ERROR_INVALID_HEADER_TEMPLATE;
+			for (size_t i = 0; i < sizeof(header.Values.UserDefined); i++)
+			{
+				char byte[3] = { value[i * 2], value[i * 2 + 1], 0 };
+				char* byteEnd;
+				header.Values.UserDefined[i] = (uint8_t)strtoul(byte, &byteEnd, 16);
+				if (byteEnd != byte + 2)
+					return KELF_ERROR_INVALID_HEADER_TEMPLATE;
+			}
+			header.Fields |= KELF_HEADER_USER_DEFINED;
+			continue;
+		}
+
+		char* valueEnd;
+		unsigned long long number = strtoull(value.c_str(), &valueEnd, 0);
+		if (value.empty() || *valueEnd != '\0')
+			return KELF_ERROR_INVALID_HEADER_TEMPLATE;
+
+		if (name == "systemType" && number <= UINT8_MAX)
+		{
+			header.Values.SystemType = (uint8_t)number;
+			header.Fields |= KELF_HEADER_SYSTEM_TYPE;
+		}
+		else if (name == "applicationType" && number <= UINT8_MAX)
+		{
+			header.Values.ApplicationType = (uint8_t)number;
+			header.Fields |= KELF_HEADER_APPLICATION_TYPE;
+		}
+		else if (name == "flags" && number <= UINT16_MAX)
+		{
+			header.Values.Flags = (uint16_t)number;
+			header.Fields |= KELF_HEADER_FLAGS;
+		}
+		else if (name == "mgZones" && number <= UINT32_MAX)
+		{
+			header.Values.MGZones = (uint32_t)number;
+			header.Fields |= KELF_HEADER_MG_ZONES;
+		}
+		else
+			return KELF_ERROR_INVALID_HEADER_TEMPLATE;
+	}
 
 	return 0;
 }
 
 int Kelf::SaveContent(std::string filename)
 {
-	FILE* f = fopen(filename.c_str(), "wb");
-	fwrite(Content.data(), 1, Content.size(), f);
-	fclose(f);
+	OutputFile f;
+	if (f.Create(filename, Content.size()) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+
+	if (f.Write(Content.data(), Content.size()) != 0 || f.Close() != 0)
+	{
+		f.Discard();
+		return KELF_ERROR_WRITE_FAILED;
+	}
 
 	return 0;
 }
 
-std::string Kelf::GetHeaderSignature(KELFHeader& header)
+int Kelf::SaveContent(void* output, size_t outputSize)
 {
-	uint8_t HMasterEnc[sizeof(KELFHeader)];
-	TdesCbcCfb64Encrypt(HMasterEnc, (uint8_t*)& header, sizeof(KELFHeader), ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
-	
-	uint8_t Hsign[8];
-	memcpy(Hsign, HMasterEnc + sizeof(HMasterEnc) - 8, 8);
-	TdesCbcCfb64Decrypt(Hsign, Hsign, 8, ks.GetSignatureHashKey().data(), 1, MG_IV_NULL);
-	TdesCbcCfb64Encrypt(Hsign, Hsign, 8, ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
+	if (outputSize < Content.size())
+		return KELF_ERROR_BUFFER_TOO_SMALL;
+
+	memcpy(output, Content.data(), Content.size());
+	return 0;
+}
 
-	return std::string((char *) Hsign, 8);
+void Kelf::GetHeaderSignature(KELFHeader& header, uint8_t* signature) const
+{
+	STATS_TIMER(STAT_HEADER_SIGNATURE, sizeof(KELFHeader));
+	Signer signer(*ctx, SIGNER_MODE_MAC);
+	signer.Update(&header, sizeof(KELFHeader));
+	signer.Final(signature);
 }
 
-std::string Kelf::DeriveKeyEncryptionKey(KELFHeader& header)
+DesKey Kelf::DeriveKeyEncryptionKey(KELFHeader& header) const
 {
+	STATS_TIMER(STAT_KEY_DERIVATION, 0);
 	uint8_t* KelfHeader = (uint8_t*)& header;
 	uint8_t HeaderData[8];
 	xor_bit(KelfHeader, &KelfHeader[8], HeaderData, 8);
 
 	uint8_t KEK[16];
-	xor_bit(ks.GetKbitIV().data(), HeaderData, KEK, 8);
-	xor_bit(ks.GetKcIV().data(), HeaderData, &KEK[8], 8);
+	xor_bit(ctx->GetKbitIV(), HeaderData, KEK, 8);
+	xor_bit(ctx->GetKcIV(), HeaderData, &KEK[8], 8);
 
-	TdesCbcCfb64Encrypt(KEK, KEK, 8, ks.GetKbitMasterKey().data(), 2, MG_IV_NULL);
-	TdesCbcCfb64Encrypt(&KEK[8], &KEK[8], 8, ks.GetKcMasterKey().data(), 2, MG_IV_NULL);
+	TdesCbcCfb64Encrypt(KEK, KEK, 8, ctx->GetKbitMasterKey(), MG_IV_NULL);
+	TdesCbcCfb64Encrypt(&KEK[8], &KEK[8], 8, ctx->GetKcMasterKey(), MG_IV_NULL);
 
-	return std::string((char*) KEK, 16);
+	return DesKey(KEK, 2);
 }
 
-void Kelf::DecryptKeys(std::string KEK)
+void Kelf::DecryptKeys(const DesKey& KEK)
 {
-	TdesCbcCfb64Decrypt((uint8_t*)Kbit.data(), (uint8_t*)Kbit.data(), 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
-	TdesCbcCfb64Decrypt((uint8_t*)Kbit.data() + 8, (uint8_t*)Kbit.data() + 8, 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
+	STATS_TIMER(STAT_KEY_DERIVATION, sizeof(Kbit) + sizeof(Kc));
+	TdesCbcCfb64Decrypt(Kbit, Kbit, 8, KEK, MG_IV_NULL);
+	TdesCbcCfb64Decrypt(Kbit + 8, Kbit + 8, 8, KEK, MG_IV_NULL);
+
+	TdesCbcCfb64Decrypt(Kc, Kc, 8, KEK, MG_IV_NULL);
+	TdesCbcCfb64Decrypt(Kc + 8, Kc + 8, 8, KEK, MG_IV_NULL);
 
-	TdesCbcCfb64Decrypt((uint8_t*)Kc.data(), (uint8_t*)Kc.data(), 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
-	TdesCbcCfb64Decrypt((uint8_t*)Kc.data() + 8, (uint8_t*)Kc.data() + 8, 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
+	KbitKey.Set(Kbit, 2);
+	KcKey.Set(Kc, 2);
 }
 
-void Kelf::EncryptKeys(std::string KEK)
+void Kelf::EncryptKeys(const DesKey& KEK)
 {
-	TdesCbcCfb64Encrypt((uint8_t*)Kbit.data(), (uint8_t*)Kbit.data(), 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
-	TdesCbcCfb64Encrypt((uint8_t*)Kbit.data() + 8, (uint8_t*)Kbit.data() + 8, 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
+	STATS_TIMER(STAT_KEY_DERIVATION, sizeof(Kbit) + sizeof(Kc));
+	TdesCbcCfb64Encrypt(Kbit, Kbit, 8, KEK, MG_IV_NULL);
+	TdesCbcCfb64Encrypt(Kbit + 8, Kbit + 8, 8, KEK, MG_IV_NULL);
 
-	TdesCbcCfb64Encrypt((uint8_t*)Kc.data(), (uint8_t*)Kc.data(), 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
-	TdesCbcCfb64Encrypt((uint8_t*)Kc.data() + 8, (uint8_t*)Kc.data() + 8, 8, (uint8_t*)KEK.data(), 2, MG_IV_NULL);
+	TdesCbcCfb64Encrypt(Kc, Kc, 8, KEK, MG_IV_NULL);
+	TdesCbcCfb64Encrypt(Kc + 8, Kc + 8, 8, KEK, MG_IV_NULL);
 }
 
-std::string Kelf::GetBitTableSignature()
+void Kelf::GetBitTableSignature(uint8_t* signature) const
 {
-	uint8_t hash[8];
-	memcpy(hash, &Kbit[0], 8);
+	STATS_TIMER(STAT_BIT_TABLE, 0);
+	Signer signer(*ctx, SIGNER_MODE_XOR);
+
+	signer.Update(&Kbit[0], 8);
 	if (memcmp(&Kbit[0], &Kbit[8], 8) != 0)
-		xor_bit(&Kbit[8], hash, hash, 8);
+		signer.Update(&Kbit[8], 8);
 
-	xor_bit(&Kc[0], hash, hash, 8);
+	signer.Update(&Kc[0], 8);
 	if (memcmp(&Kc[0], &Kc[8], 8) != 0)
-		xor_bit(&Kc[8], hash, hash, 8);
-
-	for (int i = 0; i < bitTable.BlockCount * 2 + 1; i++)
-		xor_bit(&((uint8_t*)& bitTable)[i * 8], hash, hash, 8);
-
-	uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
-	memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
-	memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
+		signer.Update(&Kc[8], 8);
 
-	uint8_t signature[8];
-	TdesCbcCfb64Encrypt(signature, hash, 8, MG_SIG_MASTER_AND_HASH_KEY, 2, MG_IV_NULL);
-
-	return std::string((char*)signature, 8);
+	signer.Update(&bitTable, (bitTable.BlockCount * 2 + 1) * 8);
+	signer.Final(signature);
 }
 
-std::string Kelf::GetRootSignature(std::string HeaderSignature, std::string BitTableSignature)
+void Kelf::GetRootSignature(const uint8_t* HeaderSignature, const uint8_t* BitTableSignature, uint8_t* signature) const
 {
-	std::string Signatures;
-	Signatures += HeaderSignature;
-	Signatures += BitTableSignature;
+	STATS_TIMER(STAT_BIT_TABLE, 0);
+	// CBC-MAC over the header, bit table and block signatures, chained one
+	// signature at a time instead of concatenating them first.
+	Signer signer(*ctx, SIGNER_MODE_ROOT);
+	signer.Update(HeaderSignature, 8);
+	signer.Update(BitTableSignature, 8);
 
 	for (int i = 0; i < bitTable.BlockCount; i++)
 		if (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED)
-			Signatures += std::string((char *) bitTable.Blocks[i].Signature, 8);
+			signer.Update(bitTable.Blocks[i].Signature, 8);
 
-	TdesCbcCfb64Encrypt((uint8_t*) Signatures.data(), (uint8_t*)Signatures.data(), Signatures.size(), ks.GetRootSignatureMasterKey().data(), 1, MG_IV_NULL);
-	std::string Root;
-	Root.resize(8);
-	TdesCbcCfb64Decrypt((uint8_t*)Root.data(), (uint8_t*)Signatures.substr(Signatures.size() - 8).data(), 8, ks.GetRootSignatureHashKey().data(), 2, MG_IV_NULL);
+	signer.Final(signature);
+}
 
-	return Root;
+const uint8_t* Kelf::ProcessChunk(bool decrypt, const uint8_t* data, uint8_t* out, size_t length, uint8_t* iv, Signer* signer, uint8_t* scratch) const
+{
+	const uint8_t* plain = data;
+	if (decrypt)
+	{
+		// CBC chains across chunks on the last ciphertext block, which an in
+		// place decryption overwrites.
+		uint8_t next[8];
+		if (length >= 8)
+			memcpy(next, &data[length - 8], 8);
+
+		uint8_t* target = out ? out : scratch;
+		TdesCbcCfb64Decrypt(target, data, length, KcKey, iv);
+		if (length >= 8)
+			memcpy(iv, next, 8);
+		plain = target;
+	}
+	else if (out != NULL && out != data)
+	{
+		memcpy(out, data, length);
+		plain = out;
+	}
+
+	if (signer != NULL)
+		signer->Update(plain, length);
+
+	return plain;
 }
 
-void Kelf::DecryptContent(int keycount)
+size_t Kelf::BatchMacs(const uint8_t* content, const uint32_t* offsets, int* macIndex, uint8_t (*macs)[8]) const
 {
+	const uint8_t* macData[256];
+	size_t macLengths[256];
+	size_t macCount = 0;
+
 	uint32_t offset = 0;
 	for (int i = 0; i < bitTable.BlockCount; i++)
 	{
-		if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
-			TdesCbcCfb64Decrypt(&Content.data()[offset], &Content.data()[offset], bitTable.Blocks[i].Size, Kc.data(), keycount, ks.GetContentIV().data());
-		offset += bitTable.Blocks[i].Size;
+		macIndex[i] = -1;
+		uint32_t flags = bitTable.Blocks[i].Flags;
+		uint32_t size = bitTable.Blocks[i].Size;
+		if ((flags & BIT_BLOCK_SIGNED) && !(flags & BIT_BLOCK_ENCRYPTED) && size != 0 && size % 8 == 0)
+		{
+			macIndex[i] = (int)macCount;
+			macData[macCount] = &content[offsets ? offsets[i] : offset];
+			macLengths[macCount] = size;
+			macCount++;
+		}
+		offset += size;
+	}
+
+	if (macCount < DesBitslice::GetMacBatchMinimum())
+	{
+		for (int i = 0; i < bitTable.BlockCount; i++)
+			macIndex[i] = -1;
+		return 0;
 	}
+
+	DesBitslice::CbcMac(macCount, macData, macLengths, ctx->GetSignatureMasterKey(), macs);
+	return macCount;
 }
 
-int Kelf::VerifyContentSignature()
+int Kelf::ProcessContent(const uint8_t* source, uint8_t* dest, bool decrypt, bool verify, unsigned threads) const
 {
+	STATS_TIMER(dest != NULL ? STAT_DECRYPT : STAT_VERIFY, GetContentSize());
+	if (threads == 0)
+		threads = ThreadPool::GetDefaultThreadCount();
+
+	// With enough plain signed blocks their CBC-MACs are computed side by side
+	// by the bitsliced engine up front and the blocks themselves only copied.
+	int macIndex[256];
+	uint8_t macs[256][8];
+	if (verify)
+		BatchMacs(source, NULL, macIndex, macs);
+
+	// Per block, what is left to do on every chunk of it: computing its
+	// signature unless that was done above, and decrypting it.
+	bool sign[256];
+	bool decryptBlock[256];
+	size_t workSize = 0;
+	for (int i = 0; i < bitTable.BlockCount; i++)
+	{
+		uint32_t flags = bitTable.Blocks[i].Flags;
+		sign[i] = verify && flags & BIT_BLOCK_SIGNED && macIndex[i] < 0;
+		decryptBlock[i] = decrypt && flags & BIT_BLOCK_ENCRYPTED;
+		if (sign[i] || decryptBlock[i])
+			workSize += bitTable.Blocks[i].Size;
+	}
+
+	// Every block restarts from the content IV, and inside a block each
+	// plaintext block only depends on the ciphertext block before it. The XOR
+	// fold does not care about order either, so blocks are cut into pieces
+	// that are decrypted and folded independently, each one chained on the
+	// ciphertext preceding it. Only the CBC-MAC of plain signed blocks has to
+	// run over the whole block. The IVs are taken before any piece is
+	// decrypted since decryption may happen in place.
+	struct Piece
+	{
+		int Block;
+		uint32_t Offset;
+		uint32_t Size;
+		uint8_t IV[8];
+		Signer Sign;
+
+		Piece(const CryptoContext& ctx, int mode) : Sign(ctx, mode) { }
+	};
+
+	size_t pieceSize = SIZE_MAX;
+	if (threads > 1 && workSize >= KELF_PARALLEL_MIN_SIZE)
+	{
+		pieceSize = (workSize / (threads * 4) + 7) & ~(size_t)7;
+		if (pieceSize < KELF_PARALLEL_CHUNK_SIZE)
+			pieceSize = KELF_PARALLEL_CHUNK_SIZE;
+	}
+
+	std::vector<Piece> pieces;
 	uint32_t offset = 0;
 	for (int i = 0; i < bitTable.BlockCount; i++)
 	{
-		if (bitTable.Blocks[i].Flags & BIT_BLOCK_SIGNED)
+		uint32_t size = bitTable.Blocks[i].Size;
+		bool copy = dest != NULL && dest != source;
+		if (!sign[i] && !decryptBlock[i] && !copy)
 		{
-			uint8_t signature[8];
-			memset(signature, 0, 8);
+			offset += size;
+			continue;
+		}
 
-			if (bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
-			{
-				for (int j = 0; j < bitTable.Blocks[i].Size; j += 8)
-					xor_bit(&Content.data()[offset + j], signature, signature, 8);
+		int mode = bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED ? SIGNER_MODE_XOR : SIGNER_MODE_MAC;
+		size_t step = sign[i] && mode == SIGNER_MODE_MAC ? SIZE_MAX : pieceSize;
+		for (uint32_t start = 0; start < size;)
+		{
+			Piece piece(*ctx, mode);
+			piece.Block = i;
+			piece.Offset = offset + start;
+			piece.Size = size - start < step ? size - start : (uint32_t)step;
+			memcpy(piece.IV, start == 0 ? ctx->GetContentIV() : &source[piece.Offset - 8], 8);
+			pieces.push_back(piece);
+			start += piece.Size;
+		}
+		offset += size;
+	}
 
-				uint8_t MG_SIG_MASTER_AND_HASH_KEY[16];
-				memcpy(MG_SIG_MASTER_AND_HASH_KEY, ks.GetSignatureMasterKey().data(), 8);
-				memcpy(MG_SIG_MASTER_AND_HASH_KEY + 8, ks.GetSignatureHashKey().data(), 8);
+	ThreadPool::ParallelFor(pieces.size(), threads, [&](size_t i) {
+		Piece& piece = pieces[i];
+		uint8_t scratch[KELF_STREAM_CHUNK_SIZE];
 
-				TdesCbcCfb64Encrypt(signature, signature, 8, MG_SIG_MASTER_AND_HASH_KEY, 2, MG_IV_NULL);
-			}
-			else
-			{
-				std::string SigMasterEnc;
-				SigMasterEnc.resize(bitTable.Blocks[i].Size);
-				TdesCbcCfb64Encrypt(SigMasterEnc.data(), &Content.data()[offset], bitTable.Blocks[i].Size, ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
-				memcpy(signature, &SigMasterEnc.data()[bitTable.Blocks[i].Size - 8], 8);
-				TdesCbcCfb64Decrypt(signature, signature, 8, ks.GetSignatureHashKey().data(), 1, MG_IV_NULL);
-				TdesCbcCfb64Encrypt(signature, signature, 8, ks.GetSignatureMasterKey().data(), 1, MG_IV_NULL);
-			}
+		// Chunk by chunk so the decrypted data is still in cache when it is
+		// folded into the signature.
+		for (uint32_t done = 0; done < piece.Size; done += KELF_STREAM_CHUNK_SIZE)
+		{
+			size_t length = piece.Size - done < KELF_STREAM_CHUNK_SIZE ? piece.Size - done : KELF_STREAM_CHUNK_SIZE;
+			size_t at = piece.Offset + done;
+			ProcessChunk(decryptBlock[piece.Block], &source[at], dest ? &dest[at] : NULL, length, piece.IV, sign[piece.Block] ? &piece.Sign : NULL, scratch);
+		}
+	});
 
-			if (memcmp(bitTable.Blocks[i].Signature, signature, 8) != 0)
-				return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+	if (!verify)
+		return 0;
+
+	// Pieces are in block order. A plain signed block is a single piece, so
+	// merging the pieces into a fresh signer is right for both kinds.
+	size_t next = 0;
+	for (int i = 0; i < bitTable.BlockCount; i++)
+	{
+		uint32_t flags = bitTable.Blocks[i].Flags;
+		Signer signer(*ctx, flags & BIT_BLOCK_ENCRYPTED ? SIGNER_MODE_XOR : SIGNER_MODE_MAC);
+		for (; next < pieces.size() && pieces[next].Block == i; next++)
+			signer.Merge(pieces[next].Sign);
+
+		if (!(flags & BIT_BLOCK_SIGNED))
+			continue;
+
+		if (macIndex[i] >= 0)
+			signer.SetState(macs[macIndex[i]]);
+
+		uint8_t signature[8];
+		signer.Final(signature);
+		if (memcmp(bitTable.Blocks[i].Signature, signature, 8) != 0)
+			return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+	}
+
+	return 0;
+}
+
+// Part [from, to) of the block starting at blockStart that has to go
+// through the decryptor for the plain range [offset, end): the whole block
+// when its signature is checked, the range widened to whole DES blocks
+// when it is encrypted, the range itself otherwise. False if the block
+// lies outside the range.
+bool Kelf::GetRangeCover(int block, uint64_t blockStart, uint64_t offset, uint64_t end, bool verify, uint32_t& from, uint32_t& to) const
+{
+	const BitTable::BitBlock& b = bitTable.Blocks[block];
+	uint64_t blockEnd = blockStart + b.Size;
+	if (offset >= end || end <= blockStart || offset >= blockEnd)
+		return false;
+
+	from = (uint32_t)((offset > blockStart ? offset : blockStart) - blockStart);
+	to = (uint32_t)((end < blockEnd ? end : blockEnd) - blockStart);
+	if (verify && b.Flags & BIT_BLOCK_SIGNED)
+	{
+		from = 0;
+		to = b.Size;
+	}
+	else if (b.Flags & BIT_BLOCK_ENCRYPTED)
+	{
+		from &= ~7u;
+		to = (to + 7) & ~7u;
+		if (to > b.Size)
+			to = b.Size;
+	}
+
+	return true;
+}
+
+// Content bytes [start, end) DecryptRange reads, including the ciphertext
+// block in front of each cover that CBC chains on.
+void Kelf::GetRangeExtent(uint64_t offset, size_t length, bool verify, uint64_t& start, uint64_t& end) const
+{
+	start = end = 0;
+	bool first = true;
+	uint64_t blockStart = 0;
+	for (int i = 0; i < bitTable.BlockCount; blockStart += bitTable.Blocks[i].Size, i++)
+	{
+		uint32_t from, to;
+		if (!GetRangeCover(i, blockStart, offset, offset + length, verify, from, to))
+			continue;
+
+		if (from != 0 && bitTable.Blocks[i].Flags & BIT_BLOCK_ENCRYPTED)
+			from -= 8;
+		if (first)
+			start = blockStart + from;
+		end = blockStart + to;
+		first = false;
+	}
+}
+
+// data holds the content from dataOffset on, at least the extent
+// GetRangeExtent gives for the same range.
+int Kelf::DecryptRange(const uint8_t* data, uint64_t dataOffset, uint64_t offset, size_t length, uint8_t* output, bool verify) const
+{
+	if (offset > GetContentSize() || length > GetContentSize() - offset)
+		return KELF_ERROR_INVALID_RANGE;
+
+	STATS_TIMER(verify ? STAT_VERIFY : STAT_DECRYPT, length);
+	uint64_t end = offset + length;
+	uint8_t scratch[KELF_STREAM_CHUNK_SIZE];
+
+	uint64_t blockStart = 0;
+	for (int i = 0; i < bitTable.BlockCount; blockStart += bitTable.Blocks[i].Size, i++)
+	{
+		uint32_t from, to;
+		if (!GetRangeCover(i, blockStart, offset, end, verify, from, to))
+			continue;
+
+		const BitTable::BitBlock& block = bitTable.Blocks[i];
+		bool encrypted = block.Flags & BIT_BLOCK_ENCRYPTED;
+		bool sign = verify && block.Flags & BIT_BLOCK_SIGNED;
+		const uint8_t* source = data + (blockStart + from - dataOffset);
+
+		// Past the start of an encrypted block, CBC chains on the ciphertext
+		// before, which GetRangeExtent included. Plain blocks have no chain.
+		uint8_t iv[8];
+		memcpy(iv, encrypted && from != 0 ? source - 8 : ctx->GetContentIV(), 8);
+		Signer signer(*ctx, encrypted ? SIGNER_MODE_XOR : SIGNER_MODE_MAC);
+
+		for (uint32_t at = from; at < to;)
+		{
+			size_t chunk = to - at < KELF_STREAM_CHUNK_SIZE ? to - at : KELF_STREAM_CHUNK_SIZE;
+			const uint8_t* plain = ProcessChunk(encrypted, source + (at - from), NULL, chunk, iv, sign ? &signer : NULL, scratch);
+
+			uint64_t chunkStart = blockStart + at;
+			uint64_t copyStart = chunkStart > offset ? chunkStart : offset;
+			uint64_t copyEnd = chunkStart + chunk < end ? chunkStart + chunk : end;
+			if (copyStart < copyEnd)
+				memcpy(output + (copyStart - offset), plain + (copyStart - chunkStart), copyEnd - copyStart);
+			at += chunk;
 		}
 
-		offset += bitTable.Blocks[i].Size;
+		if (sign)
+		{
+			uint8_t signature[8];
+			signer.Final(signature);
+			if (memcmp(block.Signature, signature, 8) != 0)
+				return KELF_ERROR_INVALID_CONTENT_SIGNATURE;
+		}
 	}
 
 	return 0;
 }
+
+void Kelf::DecryptContent(int keycount)
+{
+	KcKey.Set(Kc, keycount);
+	ProcessContent((const uint8_t*)Content.data(), (uint8_t*)Content.data(), true, false, threadCount);
+}
+
+int Kelf::VerifyContentSignature()
+{
+	return ProcessContent((const uint8_t*)Content.data(), NULL, false, true, threadCount);
+}
+
+bool Kelf::IsNotKelf(int err)
+{
+	return err == KELF_ERROR_UNSUPPORTED_FILE || err == KELF_ERROR_INVALID_HEADER_SIGNATURE ||
+		err == KELF_ERROR_INVALID_BIT_TABLE_SIZE || err == KELF_ERROR_TRUNCATED || err == KELF_ERROR_READ_FAILED;
+}
+
+std::string Kelf::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case KELF_ERROR_INVALID_DES_KEY_COUNT: return "Invalid DES key count!";
+	case KELF_ERROR_INVALID_HEADER_SIGNATURE: return "Invalid header signature!";
+	case KELF_ERROR_INVALID_BIT_TABLE_SIZE: return "Invalid bit table size!";
+	case KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE: return "Invalid bit table signature!";
+	case KELF_ERROR_INVALID_ROOT_SIGNATURE: return "Invalid root signature!";
+	case KELF_ERROR_INVALID_CONTENT_SIGNATURE: return "Invalid content signature!";
+	case KELF_ERROR_UNSUPPORTED_FILE: return "Unsupported file!";
+	case KELF_ERROR_OPEN_FAILED: return "Failed to open file!";
+	case KELF_ERROR_READ_FAILED: return "Failed to read file!";
+	case KELF_ERROR_WRITE_FAILED: return "Failed to write file!";
+	case KELF_ERROR_TRUNCATED: return "File is truncated!";
+	case KELF_ERROR_BUFFER_TOO_SMALL: return "Output buffer is too small!";
+	case KELF_ERROR_INVALID_PATCH: return "Patch is outside of the content!";
+	case KELF_ERROR_INVALID_LAYOUT: return "Invalid block layout!";
+	case KELF_ERROR_UNKNOWN_KEYSET: return "No keyset of that name in the keystore!";
+	case KELF_ERROR_INVALID_HEADER_TEMPLATE: return "Invalid header template!";
+	case KELF_ERROR_INVALID_RANGE: return "Range is outside of the content!";
+	default: return "Unknown error";
+	}
+}
@@ -17,7 +17,16 @@
 #ifndef __KELF_H__
 #define __KELF_H__
 
-#include "keystore.h"
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+
+class InputFile;
+class Signer;
 
 #define KELF_ERROR_INVALID_DES_KEY_COUNT -1
 #define KELF_ERROR_INVALID_HEADER_SIGNATURE -2
@@ -25,7 +34,34 @@
 #define KELF_ERROR_INVALID_BIT_TABLE_SIGNATURE -4
 #define KELF_ERROR_INVALID_ROOT_SIGNATURE -5
 #define KELF_ERROR_INVALID_CONTENT_SIGNATURE -6
-#define KELF_ERROR_UNSUPPORTED_FILE -6
+#define KELF_ERROR_UNSUPPORTED_FILE -7
+#define KELF_ERROR_OPEN_FAILED -8
+#define KELF_ERROR_READ_FAILED -9
+#define KELF_ERROR_WRITE_FAILED -10
+#define KELF_ERROR_TRUNCATED -11
+#define KELF_ERROR_BUFFER_TOO_SMALL -12
+#define KELF_ERROR_INVALID_PATCH -13
+#define KELF_ERROR_INVALID_LAYOUT -14
+#define KELF_ERROR_UNKNOWN_KEYSET -15
+#define KELF_ERROR_INVALID_HEADER_TEMPLATE -16
+#define KELF_ERROR_INVALID_RANGE -17
+
+// Working set of the streaming decryptor, must be a multiple of 8
+#define KELF_STREAM_CHUNK_SIZE 0x10000
+
+// Below this much encrypted content decryption stays on one thread, and
+// blocks are never split into pieces smaller than the chunk size.
+#define KELF_PARALLEL_MIN_SIZE 0x40000
+#define KELF_PARALLEL_CHUNK_SIZE 0x10000
+
+// header + header signature + kbit + kc + largest bittable + bittable signature + root signature
+#define KELF_MAX_HEADER_SIZE (32 + 8 + 16 + 16 + 8 + 256 * 16 + 8 + 8)
+
+// The same with a bit table of no blocks.
+#define KELF_MIN_HEADER_SIZE (32 + 8 + 16 + 16 + 8 + 8 + 8)
+
+// BitTable::BlockCount is a byte
+#define KELF_MAX_BLOCKS 255
 
 #define SYSTEM_TYPE_PS2 0 // same for COH (arcade)
 #define SYSTEM_TYPE_PSX 1
@@ -62,29 +98,206 @@ struct BitTable
 
 #pragma pack(pop)
 
+// One entry of the block layout used by LoadContent: Size bytes (0 for all
+// that is left) with BIT_BLOCK_* Flags. The last entry repeats until the
+// content is covered. Encrypted entries must be a multiple of 8 bytes; a
+// shorter tail of encrypted content becomes a block of its own that is
+// only signed.
+struct KelfLayoutEntry
+{
+	uint32_t Size;
+	uint32_t Flags;
+};
+
+#define KELF_HEADER_USER_DEFINED 1
+#define KELF_HEADER_SYSTEM_TYPE 2
+#define KELF_HEADER_APPLICATION_TYPE 4
+#define KELF_HEADER_FLAGS 8
+#define KELF_HEADER_MG_ZONES 16
+
+// Header fields to write. Those named in Fields (KELF_HEADER_*) are taken
+// from Values, the rest keep the PSX defaults for new files and the input's
+// when rewrapping.
+struct KelfHeaderTemplate
+{
+	unsigned Fields;
+	KELFHeader Values;
+
+	KelfHeaderTemplate() : Fields(0), Values() { }
+
+	void Apply(KELFHeader& header) const;
+};
+
+// Replaces Data.size() bytes of the plain content at Offset.
+struct KelfPatch
+{
+	uint32_t Offset;
+	std::string Data;
+};
+
 class Kelf
 {
-	KeyStore ks;
-	std::string Kbit;
-	std::string Kc;
+	const CryptoContext* ctx;
+	const KeyRing* ring;
+	size_t keySet;
+	KELFHeader Header;
+	uint8_t Kbit[16];
+	uint8_t Kc[16];
+	uint8_t RootSignature[8];
+	DesKey KbitKey;
+	DesKey KcKey;
 	BitTable bitTable;
 	std::string Content;
+	unsigned threadCount;
+	std::vector<KelfLayoutEntry> layout;
+	KelfHeaderTemplate headerTemplate;
+
+	bool SelectKeySet(KELFHeader& header, const uint8_t* HeaderSignature);
+	int ParseHeader(const uint8_t* data, size_t size, KELFHeader& header);
+	int ReadHeader(InputFile& in, KELFHeader& header);
+	size_t WriteHeader(uint8_t* buffer);
+	size_t WriteHeader(KELFHeader& header, uint8_t* buffer);
+	int RewrapHeader(InputFile& in, uint8_t* buffer, size_t& HeaderSize);
+	const uint8_t* ProcessChunk(bool decrypt, const uint8_t* data, uint8_t* out, size_t length, uint8_t* iv, Signer* signer, uint8_t* scratch) const;
+	size_t BatchMacs(const uint8_t* content, const uint32_t* offsets, int* macIndex, uint8_t (*macs)[8]) const;
+	int BuildBitTable(size_t size, BitTable& table, uint32_t* offsets) const;
+	void SealContent(uint8_t* content, const uint32_t* offsets);
+	int ProcessContent(const uint8_t* source, uint8_t* dest, bool decrypt, bool verify, unsigned threads) const;
+	bool GetRangeCover(int block, uint64_t blockStart, uint64_t offset, uint64_t end, bool verify, uint32_t& from, uint32_t& to) const;
+	void GetRangeExtent(uint64_t offset, size_t length, bool verify, uint64_t& start, uint64_t& end) const;
+	int DecryptRange(const uint8_t* data, uint64_t dataOffset, uint64_t offset, size_t length, uint8_t* output, bool verify) const;
+
+	friend class KelfView;
+	friend class KelfBuilder;
+
 public:
-	Kelf(KeyStore& _ks) : ks(_ks) { }
+	Kelf(const CryptoContext& _ctx) : ctx(&_ctx), ring(NULL), keySet(0), Header(), RootSignature(), bitTable(), threadCount(1), layout(GetDefaultLayout()) { }
+	Kelf(const KeyRing& _ring) : ctx(&_ring.Get(0)), ring(&_ring), keySet(0), Header(), RootSignature(), bitTable(), threadCount(1), layout(GetDefaultLayout()) { }
+
+	// Keyset of the ring new files are encrypted with, the first one by
+	// default. Loading a file switches to the keyset whose header signature
+	// matches, so patching and re-signing keep the keys of the file.
+	int SetKeySet(const std::string& name);
+	std::string GetKeySetName() const { return ring != NULL ? ring->GetName(keySet) : std::string(); }
+
+	// Threads used to decrypt large content and to encrypt blocks, 0 for one
+	// per core.
+	void SetThreadCount(unsigned count) { threadCount = count; }
+
+	// Block layout for the next LoadContent. The default is a signed and
+	// encrypted 0x20 byte block followed by the rest in plain.
+	int SetLayout(const std::vector<KelfLayoutEntry>& entries);
+	static std::vector<KelfLayoutEntry> GetDefaultLayout();
+
+	// Reads a layout written as comma separated <size>:<flags> entries, the
+	// size in decimal or 0x prefixed hex with an optional K or M suffix or *
+	// for the rest, the flags any of e (encrypted) and s (signed), e.g.
+	// "0x20:es,*:" for the default.
+	static int ParseLayout(std::string text, std::vector<KelfLayoutEntry>& entries);
+
+	// Header fields for SaveKelf, EncryptKelfStream and RewrapKelf. The
+	// flags can't ask for three content keys or a bit count.
+	int SetHeaderTemplate(const KelfHeaderTemplate& header);
+
+	// Reads comma separated <field>=<value> pairs with the field names info
+	// prints: systemType, applicationType, flags and mgZones take a number in
+	// decimal or 0x prefixed hex, userDefined 32 hex digits, e.g.
+	// "systemType=0,mgZones=0x04".
+	static int ParseHeaderTemplate(std::string text, KelfHeaderTemplate& header);
 
 	int LoadKelf(std::string filename);
 	int SaveKelf(std::string filename);
 	int LoadContent(std::string filename);
 	int SaveContent(std::string filename);
 
-	std::string GetHeaderSignature(KELFHeader& header);
-	std::string DeriveKeyEncryptionKey(KELFHeader& header);
-	void DecryptKeys(std::string KEK);
-	void EncryptKeys(std::string KEK);
-	std::string GetBitTableSignature();
-	std::string GetRootSignature(std::string HeaderSignature, std::string BitTableSignature);
+	// The same over caller supplied memory. Output goes into caller owned
+	// buffers and fails with KELF_ERROR_BUFFER_TOO_SMALL when they are, use
+	// GetContentSize() and GetKelfSize() to size them.
+	int LoadKelf(const void* data, size_t size);
+	int SaveKelf(void* output, size_t outputSize);
+	int LoadContent(const void* data, size_t size);
+	int SaveContent(void* output, size_t outputSize);
+
+	// Checks the header, bit table and root signatures only, after which the
+	// content layout is known. The file variant reads nothing past the
+	// header.
+	int LoadKelfHeader(std::string filename);
+	int LoadKelfHeader(const void* data, size_t size);
+
+	// Header and decrypted bit table of the last loaded file or header.
+	const KELFHeader& GetHeader() const { return Header; }
+	const BitTable& GetBitTable() const { return bitTable; }
+	int GetKeyCount() const { return Header.Flags >> 4 & 3; }
+	// Root signature of the last file loaded or written, which covers all
+	// its other signatures.
+	const uint8_t* GetSignature() const { return RootSignature; }
+
+	// Decrypts and verifies straight into output without keeping a copy.
+	int DecryptKelf(const void* data, size_t size, void* output, size_t outputSize);
+
+	// Plain content size of the loaded file or header.
+	size_t GetContentSize() const;
+	// Bytes of it in blocks that are neither encrypted nor signed, which the
+	// stream functions move from input to output without looking at them.
+	size_t GetPassThroughSize() const;
+	// Size of the file SaveKelf writes.
+	size_t GetKelfSize() const;
+	const uint8_t* GetContent() const { return (const uint8_t*)Content.data(); }
+
+	// Decrypts and verifies block by block straight into the output file
+	// without holding the content in memory. The output is removed if
+	// verification fails. Either may be "-" for stdin and stdout.
+	int DecryptKelfStream(std::string input, std::string output);
+
+	// Decrypts length bytes of the content starting at offset into output.
+	// Only the ciphertext under the range and the block in front of it, which
+	// CBC chains on, is read; mapped input is not even paged in elsewhere.
+	// Content signatures are only checked with verify, which has to read
+	// every signed block the range touches in full.
+	int DecryptKelfRange(std::string input, std::string output, uint64_t offset, uint64_t length, bool verify);
+
+	// LoadContent and SaveKelf in one, where only the encrypted or signed
+	// blocks pass through memory and the rest is moved from input to output
+	// by the kernel. Input that is not a regular file, like "-" for stdin, is
+	// read into memory first since the layout depends on its size. Nothing
+	// of the content is kept.
+	int EncryptKelfStream(std::string input, std::string output);
+
+	// Writes input again with the header template applied to its header.
+	// Only the keys are unwrapped and wrapped again for the new header and
+	// the header and root signatures recomputed; the content goes from input
+	// to output unchanged and unread, so the cost does not depend on its
+	// size. The key count in the flags has to stay the same. The first form
+	// rewrites the header of the file in place.
+	int RewrapKelf(std::string filename);
+	int RewrapKelf(std::string input, std::string output);
+
+	// Applies patches to the plain content of a KELF in place. Only the blocks
+	// they touch are read, checked against their signature, re-encrypted and
+	// re-signed; the keys stay the same and apart from those blocks only the
+	// bit table and the signatures behind it are rewritten. The file is left
+	// alone if anything fails before writing starts.
+	int PatchKelf(std::string filename, const std::vector<KelfPatch>& patches);
+
+	// Checks every signature of a KELF, decrypting the content a chunk at a
+	// time into scratch space without keeping or writing any of it.
+	int VerifyKelf(std::string filename);
+	int VerifyKelf(const void* data, size_t size);
+
+	void GetHeaderSignature(KELFHeader& header, uint8_t* signature) const;
+	DesKey DeriveKeyEncryptionKey(KELFHeader& header) const;
+	void DecryptKeys(const DesKey& KEK);
+	void EncryptKeys(const DesKey& KEK);
+	void GetBitTableSignature(uint8_t* signature) const;
+	void GetRootSignature(const uint8_t* HeaderSignature, const uint8_t* BitTableSignature, uint8_t* signature) const;
 	void DecryptContent(int keycount);
 	int VerifyContentSignature();
+
+	// Errors that mean the input is no KELF at all rather than a broken one,
+	// for telling KELFs apart from the other files of a disc image.
+	static bool IsNotKelf(int err);
+
+	static std::string getErrorString(int err);
 };
 
 #endif
\ No newline at end of file
@@ -15,10 +15,50 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <filesystem>
+#include <map>
+#include <new>
+#include <vector>
+
 #include "keystore.h"
 #include "kelf.h"
+#include "batch.h"
+#include "cache.h"
+#include "fileio.h"
+#include "index.h"
+#include "iso9660.h"
+#include "journal.h"
+#include "server.h"
+#include "stats.h"
+
+#ifndef KELF_NO_STATS
+// Allocations of the tool are counted for --stats. Only the executable
+// replaces these, the library leaves them to whoever links it.
+void* operator new(size_t size)
+{
+	Stats::CountAllocation(size);
+	void* p = malloc(size ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+#endif
+
+// Set by --stats, where the statistics go when the submodule is done.
+std::string statsFile;
 
 std::string getKeyStorePath()
 {
@@ -29,72 +69,1042 @@ std::string getKeyStorePath()
 #endif
 }
 
+// KELFTOOL_CACHE enables the result cache for decrypt and verify. A cache
+// that can't be opened is reported and then left out.
+void openCache(Cache& cache)
+{
+	const char* dir = getenv(CACHE_DIR_ENV);
+	if (dir == NULL || *dir == '\0')
+		return;
+
+	uint64_t limit = CACHE_DEFAULT_SIZE;
+	const char* size = getenv(CACHE_SIZE_ENV);
+	if (size != NULL && *size != '\0')
+		limit = strtoull(size, NULL, 10) * 1024 * 1024;
+
+	int ret = cache.Open(dir, limit);
+	if (ret != 0)
+		fprintf(stderr, "Failed to open cache %s: %d - %s\n", dir, ret, Cache::getErrorString(ret).c_str());
+}
+
+// The library only reports the error code, the request for samples of
+// unsupported files is up to the tool.
+void printUnsupported(int err)
+{
+	if (err != KELF_ERROR_UNSUPPORTED_FILE)
+		return;
+
+	fprintf(stderr, "This file is not supported yet and looked after.\n");
+	fprintf(stderr, "Please upload it and post it under that issue:\n");
+	fprintf(stderr, "https://github.com/xfwcfw/kelftool/issues/1\n");
+}
+
 int decrypt(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printf("%s decrypt <input|-> <output|-> [--stream] [-j threads]\n", argv[0]);
+		printf("Content written to - is only verified once the exit code is 0\n");
+		return -1;
+	}
+
+	bool stream = false;
+	unsigned threads = 0;
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp("--stream", argv[i]) == 0)
+			stream = true;
+		else if (strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+	kelf.SetThreadCount(threads);
+
+	// stdin can only be read once and stdout can't be cached.
+	bool standard = strcmp(argv[1], FILEIO_STANDARD_STREAM) == 0 || strcmp(argv[2], FILEIO_STANDARD_STREAM) == 0;
+	Cache cache(ring);
+	if (!standard)
+		openCache(cache);
+
+	// A cached failure is always one of loading the file.
+	bool saving = false;
+	std::string output = argv[2];
+	ret = cache.Run(argv[1], &output, [&] {
+		// Content that is mostly neither encrypted nor signed is streamed, so
+		// those blocks go from file to file in the kernel.
+		if (!stream && !standard && kelf.LoadKelfHeader(argv[1]) == 0)
+			stream = kelf.GetPassThroughSize() * 2 >= kelf.GetContentSize();
+
+		if (stream || standard)
+			return kelf.DecryptKelfStream(argv[1], argv[2]);
+
+		int ret = kelf.LoadKelf(argv[1]);
+		if (ret != 0)
+			return ret;
+		saving = true;
+		return kelf.SaveContent(argv[2]);
+	});
+	STATS_RESULT(ret);
+
+	if (ret != 0)
+	{
+		if (stream || standard)
+			fprintf(stderr, "Failed to DecryptKelfStream: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
+		else
+			fprintf(stderr, saving ? "Failed to SaveContent!\n" : "Failed to LoadKelf!\n");
+		printUnsupported(ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+struct Input
+{
+	std::string Path;
+	bool Probe; // from an image, skip it if it is no KELF
+};
+
+// An ISO9660 image stands for all the files inside it.
+std::vector<Input> expandInputs(const std::vector<const char*>& paths)
+{
+	std::vector<Input> inputs;
+	for (const char* path : paths)
+	{
+		IsoImage iso;
+		std::vector<IsoEntry> entries;
+		if (iso.Open(path) != 0 || iso.List(entries) != 0)
+		{
+			inputs.push_back({ path, false });
+			continue;
+		}
+
+		for (const IsoEntry& entry : entries)
+			inputs.push_back({ path + std::string(ISO_PATH_SEPARATOR) + entry.Path, true });
+	}
+	return inputs;
+}
+
+int verify(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("%s verify <input> [<input> ...] [-j threads]\n", argv[0]);
+		return -1;
+	}
+
+	std::vector<const char*> inputs;
+	unsigned threads = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else
+			inputs.push_back(argv[i]);
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+	kelf.SetThreadCount(threads);
+	Cache cache(ring);
+	openCache(cache);
+
+	int failed = 0;
+	for (const Input& input : expandInputs(inputs))
+	{
+		const char* path = input.Path.c_str();
+		if (input.Probe && Kelf::IsNotKelf(kelf.LoadKelfHeader(path)))
+			continue;
+
+		ret = cache.Run(path, NULL, [&] { return kelf.VerifyKelf(path); });
+		STATS_RESULT(ret);
+		if (ret != 0)
+		{
+			printf("%s: FAILED %d - %s\n", path, ret, Kelf::getErrorString(ret).c_str());
+			printUnsupported(ret);
+			failed++;
+		}
+		else
+			printf("%s: OK\n", path);
+	}
+
+	return failed == 0 ? 0 : 1;
+}
+
+// Paths are the only free-form strings in the output.
+std::string jsonString(const char* s)
+{
+	std::string out = "\"";
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			out += '\\';
+		if ((unsigned char)*s < 0x20)
+		{
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", *s);
+			out += escape;
+		}
+		else
+			out += *s;
+	}
+	return out + "\"";
+}
+
+std::string hexString(const uint8_t* data, size_t size)
+{
+	std::string out;
+	char byte[3];
+	for (size_t i = 0; i < size; i++)
+	{
+		snprintf(byte, sizeof(byte), "%02x", data[i]);
+		out += byte;
+	}
+	return out;
+}
+
+void printInfo(const char* input, const Kelf& kelf)
+{
+	const KELFHeader& header = kelf.GetHeader();
+	const BitTable& bitTable = kelf.GetBitTable();
+	std::string userDefined = hexString(header.UserDefined, sizeof(header.UserDefined));
+
+	printf("{\"file\":%s,\"userDefined\":\"%s\",\"contentSize\":%u,\"headerSize\":%u,"
+		"\"systemType\":%u,\"applicationType\":%u,\"flags\":%u,\"bitCount\":%u,\"mgZones\":%u,\"keyCount\":%d,\"keySet\":%s,\"blocks\":[",
+		jsonString(input).c_str(), userDefined.c_str(), header.ContentSize, header.HeaderSize,
+		header.SystemType, header.ApplicationType, header.Flags, header.BitCount, header.MGZones, kelf.GetKeyCount(),
+		jsonString(kelf.GetKeySetName().c_str()).c_str());
+
+	size_t total = 0;
+	for (int i = 0; i < bitTable.BlockCount; i++)
+	{
+		const BitTable::BitBlock& block = bitTable.Blocks[i];
+		printf("%s{\"size\":%u,\"flags\":%u,\"encrypted\":%s,\"signed\":%s}", i ? "," : "",
+			block.Size, block.Flags,
+			block.Flags & BIT_BLOCK_ENCRYPTED ? "true" : "false",
+			block.Flags & BIT_BLOCK_SIGNED ? "true" : "false");
+		total += block.Size;
+	}
+
+	printf("],\"plainSize\":%zu}\n", total);
+}
+
+int info(int argc, char** argv)
 {
 	if (argc < 2)
 	{
-		printf("%s decrypt <input> <output>\n", argv[0]);
+		printf("%s info <input> [<input> ...]\n", argv[0]);
 		return -1;
 	}
 
-	KeyStore ks;
-	int ret = ks.Load(getKeyStorePath());
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
 	if (ret != 0)
 	{
-		printf("Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
 		return ret;
 	}
 
-	Kelf kelf(ks);
-	ret = kelf.LoadKelf(argv[1]);
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+
+	// One JSON object per line and file, the content is never read.
+	int failed = 0;
+	for (const Input& input : expandInputs(std::vector<const char*>(argv + 1, argv + argc)))
+	{
+		const char* path = input.Path.c_str();
+		ret = kelf.LoadKelfHeader(path);
+		if (input.Probe && Kelf::IsNotKelf(ret))
+			continue;
+		STATS_RESULT(ret);
+
+		if (ret != 0)
+		{
+			printf("{\"file\":%s,\"error\":%d,\"message\":%s}\n", jsonString(path).c_str(), ret, jsonString(Kelf::getErrorString(ret).c_str()).c_str());
+			failed++;
+		}
+		else
+			printInfo(path, kelf);
+	}
+
+	return failed == 0 ? 0 : 1;
+}
+
+int encrypt(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printf("%s encrypt <input|-> <output|-> [--layout <size>:<flags>,...] [--header <field>=<value>,...] [--keyset name] [-j threads]\n", argv[0]);
+		return -1;
+	}
+
+	std::vector<KelfLayoutEntry> layout = Kelf::GetDefaultLayout();
+	KelfHeaderTemplate header;
+	const char* keySet = NULL;
+	unsigned threads = 0;
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp("--layout", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (Kelf::ParseLayout(argv[++i], layout) != 0)
+			{
+				fprintf(stderr, "Invalid layout: %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp("--header", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (Kelf::ParseHeaderTemplate(argv[++i], header) != 0)
+			{
+				fprintf(stderr, "Invalid header: %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp("--keyset", argv[i]) == 0 && i + 1 < argc)
+			keySet = argv[++i];
+		else if (strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+	kelf.SetThreadCount(threads);
+	if (keySet != NULL && (ret = kelf.SetKeySet(keySet)) != 0)
+	{
+		fprintf(stderr, "Unknown keyset %s: %d - %s\n", keySet, ret, Kelf::getErrorString(ret).c_str());
+		return ret;
+	}
+	ret = kelf.SetLayout(layout);
 	if (ret != 0)
 	{
-		printf("Failed to LoadKelf!\n");
+		fprintf(stderr, "Invalid layout: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
 		return ret;
 	}
-	ret = kelf.SaveContent(argv[2]);
+	ret = kelf.SetHeaderTemplate(header);
 	if (ret != 0)
 	{
-		printf("Failed to SaveContent!\n");
+		fprintf(stderr, "Invalid header: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
+		return ret;
+	}
+	ret = kelf.EncryptKelfStream(argv[1], argv[2]);
+	STATS_RESULT(ret);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to EncryptKelfStream: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
 		return ret;
 	}
 
 	return 0;
 }
 
-int encrypt(int argc, char** argv)
+// <offset>=<hex bytes> or <offset>@<file>, offsets into the plain content
+// in decimal or 0x prefixed hex.
+bool parsePatch(const char* arg, KelfPatch& patch)
+{
+	char* end;
+	unsigned long offset = strtoul(arg, &end, 0);
+	if (end == arg || offset > UINT32_MAX)
+		return false;
+	patch.Offset = (uint32_t)offset;
+
+	if (*end == '=')
+	{
+		const char* hex = end + 1;
+		size_t length = strlen(hex);
+		if (length % 2 != 0)
+			return false;
+		patch.Data.clear();
+		for (size_t i = 0; i < length; i += 2)
+		{
+			char byte[3] = { hex[i], hex[i + 1], 0 };
+			char* byteEnd;
+			patch.Data += (char)strtoul(byte, &byteEnd, 16);
+			if (byteEnd != byte + 2)
+				return false;
+		}
+		return true;
+	}
+
+	if (*end == '@')
+	{
+		FILE* f = fopen(end + 1, "rb");
+		if (f == NULL)
+			return false;
+		patch.Data.clear();
+		char chunk[0x10000];
+		size_t read;
+		while ((read = fread(chunk, 1, sizeof(chunk), f)) > 0)
+			patch.Data.append(chunk, read);
+		bool failed = ferror(f);
+		fclose(f);
+		return !failed;
+	}
+
+	return false;
+}
+
+int patch(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printf("%s patch <kelf> <offset>=<hex>|<offset>@<file> [...]\n", argv[0]);
+		return -1;
+	}
+
+	std::vector<KelfPatch> patches(argc - 2);
+	for (int i = 2; i < argc; i++)
+	{
+		if (!parsePatch(argv[i], patches[i - 2]))
+		{
+			fprintf(stderr, "Invalid patch: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+	ret = kelf.PatchKelf(argv[1], patches);
+	STATS_RESULT(ret);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to PatchKelf: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
+		printUnsupported(ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+// Offsets, lengths and other numbers in decimal or 0x prefixed hex.
+bool parseSize(const char* arg, uint64_t& value)
+{
+	char* end;
+	value = strtoull(arg, &end, 0);
+	return end != arg && *end == '\0' && *arg != '-';
+}
+
+int extract(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printf("%s extract <input> <output|-> [--offset n] [--length n] [--verify]\n", argv[0]);
+		return -1;
+	}
+
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	bool whole = true;
+	bool verify = false;
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp("--offset", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (!parseSize(argv[++i], offset))
+			{
+				fprintf(stderr, "Invalid offset: %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp("--length", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (!parseSize(argv[++i], length))
+			{
+				fprintf(stderr, "Invalid length: %s\n", argv[i]);
+				return -1;
+			}
+			whole = false;
+		}
+		else if (strcmp("--verify", argv[i]) == 0)
+			verify = true;
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+
+	// Without a length everything from the offset on.
+	if (whole)
+	{
+		ret = kelf.LoadKelfHeader(argv[1]);
+		if (ret == 0)
+			length = kelf.GetContentSize() > offset ? kelf.GetContentSize() - offset : 0;
+	}
+	if (ret == 0)
+		ret = kelf.DecryptKelfRange(argv[1], argv[2], offset, length, verify);
+	STATS_RESULT(ret);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to DecryptKelfRange: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
+		printUnsupported(ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+int rewrap(int argc, char** argv)
 {
 	if (argc < 2)
 	{
-		printf("%s decrypt <input> <output>\n", argv[0]);
+		printf("%s rewrap <input> [output|-] [--header <field>=<value>,...]\n", argv[0]);
+		return -1;
+	}
+
+	const char* output = NULL;
+	KelfHeaderTemplate header;
+	for (int i = 2; i < argc; i++)
+	{
+		if (strcmp("--header", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (Kelf::ParseHeaderTemplate(argv[++i], header) != 0)
+			{
+				fprintf(stderr, "Invalid header: %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (output == NULL && i == 2)
+			output = argv[i];
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	Kelf kelf(ring);
+	ret = kelf.SetHeaderTemplate(header);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Invalid header: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	// Without an output the header is rewritten in place.
+	ret = output != NULL ? kelf.RewrapKelf(argv[1], output) : kelf.RewrapKelf(argv[1]);
+	STATS_RESULT(ret);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to RewrapKelf: %d - %s\n", ret, Kelf::getErrorString(ret).c_str());
+		printUnsupported(ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+// The fields info prints, from the index instead of the file.
+void printIndexEntry(const IndexEntry& entry)
+{
+	const KELFHeader& header = entry.Header;
+	printf("{\"file\":%s,\"size\":%llu,\"userDefined\":\"%s\",\"contentSize\":%u,\"headerSize\":%u,"
+		"\"systemType\":%u,\"applicationType\":%u,\"flags\":%u,\"bitCount\":%u,\"mgZones\":%u,\"keyCount\":%d,\"keySet\":%s,"
+		"\"headerSignature\":\"%s\",\"rootSignature\":\"%s\",\"digest\":\"%s\",\"blocks\":[",
+		jsonString(entry.Path.c_str()).c_str(), (unsigned long long)entry.Size,
+		hexString(header.UserDefined, sizeof(header.UserDefined)).c_str(), header.ContentSize, header.HeaderSize,
+		header.SystemType, header.ApplicationType, header.Flags, header.BitCount, header.MGZones, header.Flags >> 4 & 3,
+		jsonString(entry.KeySet.c_str()).c_str(), hexString(entry.HeaderSignature, sizeof(entry.HeaderSignature)).c_str(),
+		hexString(entry.RootSignature, sizeof(entry.RootSignature)).c_str(), hexString(entry.Digest, sizeof(entry.Digest)).c_str());
+
+	for (size_t i = 0; i < entry.Blocks.size(); i++)
+		printf("%s{\"size\":%u,\"flags\":%u}", i ? "," : "", entry.Blocks[i].Size, entry.Blocks[i].Flags);
+	printf("]}\n");
+}
+
+int index(int argc, char** argv)
+{
+	if (argc < 3 || (strcmp("update", argv[1]) != 0 && strcmp("query", argv[1]) != 0))
+	{
+		printf("%s index update <index> <dir> [-j threads]\n", argv[0]);
+		printf("%s index query <index> [--system-type n] [--application-type n] [--mg-zones mask] [--duplicates]\n", argv[0]);
+		return -1;
+	}
+
+	bool update = strcmp("update", argv[1]) == 0;
+	if (update && argc < 4)
+	{
+		printf("%s index update <index> <dir> [-j threads]\n", argv[0]);
+		return -1;
+	}
+
+	unsigned threads = 0;
+	IndexFilter filter;
+	bool duplicates = false;
+	for (int i = update ? 4 : 3; i < argc; i++)
+	{
+		uint64_t value = 0;
+		bool number = i + 1 < argc && parseSize(argv[i + 1], value);
+		if (update && strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!update && strcmp("--system-type", argv[i]) == 0 && number && value <= UINT8_MAX)
+		{
+			filter.SystemType = (uint8_t)value;
+			filter.Fields |= INDEX_FILTER_SYSTEM_TYPE;
+			i++;
+		}
+		else if (!update && strcmp("--application-type", argv[i]) == 0 && number && value <= UINT8_MAX)
+		{
+			filter.ApplicationType = (uint8_t)value;
+			filter.Fields |= INDEX_FILTER_APPLICATION_TYPE;
+			i++;
+		}
+		else if (!update && strcmp("--mg-zones", argv[i]) == 0 && number && value <= UINT32_MAX)
+		{
+			filter.MGZones = (uint32_t)value;
+			filter.Fields |= INDEX_FILTER_MG_ZONES;
+			i++;
+		}
+		else if (!update && strcmp("--duplicates", argv[i]) == 0)
+			duplicates = true;
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	// Only an update starts a new index.
+	Index catalog;
+	int ret = !update && !std::filesystem::exists(argv[2]) ? INDEX_ERROR_OPEN_FAILED : catalog.Load(argv[2]);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load index %s: %d - %s\n", argv[2], ret, Index::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	if (!update)
+	{
+		if (duplicates)
+		{
+			for (const std::vector<const IndexEntry*>& group : catalog.FindDuplicates(filter))
+			{
+				printf("{\"digest\":\"%s\",\"files\":[", hexString(group[0]->Digest, sizeof(group[0]->Digest)).c_str());
+				for (size_t i = 0; i < group.size(); i++)
+					printf("%s%s", i ? "," : "", jsonString(group[i]->Path.c_str()).c_str());
+				printf("]}\n");
+			}
+		}
+		else
+		{
+			for (const IndexEntry* entry : catalog.Query(filter))
+				printIndexEntry(*entry);
+		}
+		return 0;
+	}
+
+	std::vector<KeyStore> keysets;
+	ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	size_t added, changed, removed;
+	ret = catalog.Update(ring, argv[3], threads, added, changed, removed);
+	if (ret == 0)
+		ret = catalog.Save(argv[2]);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to update index %s: %d - %s\n", argv[2], ret, Index::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	printf("Indexed %zu files: %zu added, %zu changed, %zu removed\n", catalog.GetCount(), added, changed, removed);
+	return 0;
+}
+
+int batch(int argc, char** argv)
+{
+	if (argc < 4)
+	{
+		printf("%s batch <decrypt|encrypt> <input dir|file list> <output dir> [-j threads] [--io uring|sync] [--queue-depth n] [--keyset name] [--journal file]\n", argv[0]);
+		return -1;
+	}
+
+	int mode;
+	if (strcmp("decrypt", argv[1]) == 0)
+		mode = BATCH_MODE_DECRYPT;
+	else if (strcmp("encrypt", argv[1]) == 0)
+		mode = BATCH_MODE_ENCRYPT;
+	else
+	{
+		fprintf(stderr, "Unknown batch mode: %s\n", argv[1]);
+		return -1;
+	}
+
+	unsigned threads = 0;
+	int io = BATCH_IO_AUTO;
+	unsigned queueDepth = BATCH_DEFAULT_QUEUE_DEPTH;
+	const char* keySet = NULL;
+	const char* journalFile = NULL;
+	for (int i = 4; i < argc; i++)
+	{
+		if (strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp("--io", argv[i]) == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcmp("uring", argv[i]) == 0)
+				io = BATCH_IO_URING;
+			else if (strcmp("sync", argv[i]) == 0)
+				io = BATCH_IO_SYNC;
+			else
+			{
+				fprintf(stderr, "Unknown I/O mode: %s\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp("--queue-depth", argv[i]) == 0 && i + 1 < argc)
+		{
+			queueDepth = atoi(argv[++i]);
+			if (queueDepth < 1 || queueDepth > 512)
+			{
+				fprintf(stderr, "Queue depth must be between 1 and 512\n");
+				return -1;
+			}
+		}
+		else if (strcmp("--keyset", argv[i]) == 0 && i + 1 < argc)
+			keySet = argv[++i];
+		else if (strcmp("--journal", argv[i]) == 0 && i + 1 < argc)
+			journalFile = argv[++i];
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	KeyRing ring(keysets);
+	int index = keySet != NULL ? ring.Find(keySet) : 0;
+	if (index < 0)
+	{
+		fprintf(stderr, "Unknown keyset %s: %d - %s\n", keySet, KELF_ERROR_UNKNOWN_KEYSET, Kelf::getErrorString(KELF_ERROR_UNKNOWN_KEYSET).c_str());
+		return KELF_ERROR_UNKNOWN_KEYSET;
+	}
+	Cache cache(ring);
+	openCache(cache);
+	Batch batch(ring, mode);
+	batch.SetKeySet(index);
+	batch.SetCache(&cache);
+	batch.SetIo(io);
+	batch.SetQueueDepth(queueDepth);
+	Journal journal;
+	if (journalFile != NULL)
+	{
+		ret = journal.Open(journalFile);
+		if (ret != 0)
+		{
+			fprintf(stderr, "Failed to open journal %s: %d - %s\n", journalFile, ret, Journal::getErrorString(ret).c_str());
+			return ret;
+		}
+		batch.SetJournal(&journal);
+	}
+	ret = batch.AddInput(argv[2], argv[3]);
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to collect input: %d - %s\n", ret, Batch::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	int failed = batch.Run(threads);
+	ret = journal.Close();
+	if (ret != 0)
+		fprintf(stderr, "Failed to close journal: %d - %s\n", ret, Journal::getErrorString(ret).c_str());
+
+	return failed == 0 && ret == 0 ? 0 : 1;
+}
+
+int shard(int argc, char** argv)
+{
+	if (argc < 4)
+	{
+		printf("%s shard <input dir|file list|image> <manifest dir> <shards>\n", argv[0]);
 		return -1;
 	}
 
-	KeyStore ks;
-	int ret = ks.Load(getKeyStorePath());
+	int count = atoi(argv[3]);
+	if (count < 1 || count > 9999)
+	{
+		fprintf(stderr, "Shard count must be between 1 and 9999\n");
+		return -1;
+	}
+
+	// Collecting and splitting the input needs no keys.
+	Batch batch;
+	int ret = batch.AddInput(argv[1], "");
+	if (ret == 0)
+		ret = batch.WriteShards(argv[2], count);
 	if (ret != 0)
 	{
-		printf("Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
+		fprintf(stderr, "Failed to write shards: %d - %s\n", ret, Batch::getErrorString(ret).c_str());
 		return ret;
 	}
 
-	Kelf kelf(ks);
-	ret = kelf.LoadContent(argv[1]);
+	printf("Wrote %d shards to %s\n", count, argv[2]);
+	return 0;
+}
+
+int merge(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("%s merge <manifest dir> [report|-]\n", argv[0]);
+		return -1;
+	}
+
+	std::string report = argc > 2 ? argv[2] : (std::filesystem::path(argv[1]) / BATCH_SHARD_REPORT).string();
+	int ret = Batch::MergeShards(argv[1], report);
+	if (ret < 0)
+	{
+		fprintf(stderr, "Failed to merge shards: %d - %s\n", ret, Batch::getErrorString(ret).c_str());
+		return ret;
+	}
+
+	return ret == 0 ? 0 : 1;
+}
+
+int serve(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("%s serve <socket> [-j threads]\n", argv[0]);
+		return -1;
+	}
+
+	unsigned threads = 0;
+	for (int i = 2; i < argc; i++)
+	{
+		if (strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	std::vector<KeyStore> keysets;
+	int ret = KeyStore::LoadKeySets(getKeyStorePath(), keysets);
 	if (ret != 0)
 	{
-		printf("Failed to LoadContent!\n");
+		fprintf(stderr, "Failed to load keystore: %d - %s\n", ret, KeyStore::getErrorString(ret).c_str());
 		return ret;
 	}
-	ret = kelf.SaveKelf(argv[2]);
+
+	KeyRing ring(keysets);
+	Cache cache(ring);
+	openCache(cache);
+	Server server(ring);
+	server.SetCache(&cache);
+	server.SetStatsFile(statsFile);
+	ret = server.Listen(argv[1]);
+	if (ret == 0)
+	{
+		printf("Listening on %s\n", argv[1]);
+		fflush(stdout);
+		ret = server.Run(threads);
+	}
 	if (ret != 0)
 	{
-		printf("Failed to SaveKelf!\n");
+		fprintf(stderr, "Failed to serve: %d - %s\n", ret, Server::getErrorString(ret).c_str());
 		return ret;
 	}
 
 	return 0;
 }
 
+// With KELFTOOL_SOCKET set, decrypt, encrypt and verify are handed to a
+// running `kelftool serve` instead of loading the keystore here. Returns
+// false when that is not possible and the command has to run locally.
+bool forward(const char* cmd, int argc, char** argv, int& ret)
+{
+	const char* socketPath = getenv(SERVER_SOCKET_ENV);
+	if (socketPath == NULL || *socketPath == '\0')
+		return false;
+
+	std::vector<std::vector<std::string>> requests;
+	std::vector<const char*> names;
+	if (strcmp("decrypt", cmd) == 0 || strcmp("encrypt", cmd) == 0)
+	{
+		// stdin and stdout are only at hand here.
+		if (argc < 3 || strcmp(argv[1], FILEIO_STANDARD_STREAM) == 0 || strcmp(argv[2], FILEIO_STANDARD_STREAM) == 0)
+			return false;
+
+		std::vector<std::string> request = { cmd, std::filesystem::absolute(argv[1]).string(), std::filesystem::absolute(argv[2]).string() };
+		for (int i = 3; i < argc; i++)
+		{
+			if (strcmp("decrypt", cmd) == 0 && strcmp("--stream", argv[i]) == 0)
+				request.push_back("stream");
+			else if (strcmp("decrypt", cmd) == 0 && strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+				i++; // the server sizes its own pool
+			else
+				return false;
+		}
+		requests.push_back(request);
+	}
+	else if (strcmp("verify", cmd) == 0)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			IsoImage iso;
+			if (strcmp("-j", argv[i]) == 0 && i + 1 < argc)
+				i++;
+			else if (iso.Open(argv[i]) == 0)
+				return false; // images are expanded locally
+			else
+			{
+				requests.push_back({ cmd, std::filesystem::absolute(argv[i]).string() });
+				names.push_back(argv[i]);
+			}
+		}
+		if (requests.empty())
+			return false;
+	}
+	else
+		return false;
+
+	Client client;
+	if (client.Connect(socketPath) != 0)
+		return false;
+
+	// All requests go out at once, the server works on them in parallel.
+	std::map<unsigned, size_t> pending;
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		unsigned id;
+		ret = client.Send(requests[i], id);
+		if (ret != 0)
+		{
+			fprintf(stderr, "Failed to send request: %d - %s\n", ret, Client::getErrorString(ret).c_str());
+			return true;
+		}
+		pending[id] = i;
+	}
+
+	// Responses come back in the order the requests complete. Each id has to
+	// answer exactly one request that is still open.
+	std::vector<int> results(requests.size());
+	std::vector<std::string> messages(requests.size());
+	while (!pending.empty())
+	{
+		unsigned id;
+		int result;
+		std::string message;
+		ret = client.Receive(id, result, message);
+		std::map<unsigned, size_t>::iterator request = pending.find(id);
+		if (ret == 0 && request == pending.end())
+			ret = SERVER_ERROR_BAD_RESPONSE;
+		if (ret != 0)
+		{
+			fprintf(stderr, "Failed to receive response: %d - %s\n", ret, Client::getErrorString(ret).c_str());
+			return true;
+		}
+
+		results[request->second] = result;
+		messages[request->second] = message;
+		pending.erase(request);
+	}
+
+	if (strcmp("verify", cmd) == 0)
+	{
+		int failed = 0;
+		for (size_t i = 0; i < requests.size(); i++)
+		{
+			if (results[i] != 0)
+			{
+				printf("%s: FAILED %d - %s\n", names[i], results[i], messages[i].c_str());
+				failed++;
+			}
+			else
+				printf("%s: OK\n", names[i]);
+		}
+		ret = failed == 0 ? 0 : 1;
+		return true;
+	}
+
+	ret = results[0];
+	if (ret != 0)
+	{
+		fprintf(stderr, "Failed to %s: %d - %s\n", cmd, ret, messages[0].c_str());
+		printUnsupported(ret);
+	}
+	return true;
+}
+
 int main(int argc, char** argv)
 {
 	if (argc < 2)
@@ -103,6 +1113,17 @@ int main(int argc, char** argv)
 		printf("Available submodules:\n");
 		printf("\tdecrypt - decrypt and check signature of kelf files\n");
 		printf("\tencrypt - encrypt and sign kelf files\n");
+		printf("\tverify - check all signatures of kelf files without writing anything\n");
+		printf("\tpatch - change bytes of the content of a kelf file in place\n");
+		printf("\textract - decrypt part of the content of a kelf file\n");
+		printf("\trewrap - change header fields of a kelf file without touching its content\n");
+		printf("\tinfo - print the verified header and block layout of kelf files as json\n");
+		printf("\tindex - keep a catalog of the kelf files under a directory and query it\n");
+		printf("\tbatch - decrypt or encrypt whole directories or file lists in parallel\n");
+		printf("\tshard - split the input of a batch into shards for several machines\n");
+		printf("\tmerge - put the journals of sharded batches together into one report\n");
+		printf("\tserve - keep the keys loaded and serve requests over a unix socket\n");
+		printf("Any submodule takes --stats <file> to record per-stage timings and counters\n");
 		return -1;
 	}
 
@@ -111,11 +1132,69 @@ int main(int argc, char** argv)
 	argc--;
 	argv++;
 
+	// --stats <file> may go anywhere after the submodule and is taken out
+	// before the submodule sees its arguments.
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp("--stats", argv[i]) != 0)
+			continue;
+		statsFile = argv[i + 1];
+		for (int j = i; j + 2 <= argc; j++)
+			argv[j] = argv[j + 2];
+		argc -= 2;
+		break;
+	}
+#ifdef KELF_NO_STATS
+	if (!statsFile.empty())
+	{
+		fprintf(stderr, "Built without statistics, --stats is ignored\n");
+		statsFile.clear();
+	}
+#endif
+
+	// Work handed to a server is measured there, not here.
+	int ret;
+	if (statsFile.empty() && forward(cmd, argc, argv, ret))
+		return ret;
+	if (!statsFile.empty())
+		Stats::Enable();
+
 	if (strcmp("decrypt", cmd) == 0)
-		return decrypt(argc, argv);
+		ret = decrypt(argc, argv);
 	else if (strcmp("encrypt", cmd) == 0)
-		return encrypt(argc, argv);
+		ret = encrypt(argc, argv);
+	else if (strcmp("verify", cmd) == 0)
+		ret = verify(argc, argv);
+	else if (strcmp("patch", cmd) == 0)
+		ret = patch(argc, argv);
+	else if (strcmp("extract", cmd) == 0)
+		ret = extract(argc, argv);
+	else if (strcmp("rewrap", cmd) == 0)
+		ret = rewrap(argc, argv);
+	else if (strcmp("info", cmd) == 0)
+		ret = info(argc, argv);
+	else if (strcmp("index", cmd) == 0)
+		ret = index(argc, argv);
+	else if (strcmp("batch", cmd) == 0)
+		ret = batch(argc, argv);
+	else if (strcmp("shard", cmd) == 0)
+		ret = shard(argc, argv);
+	else if (strcmp("merge", cmd) == 0)
+		ret = merge(argc, argv);
+	else if (strcmp("serve", cmd) == 0)
+		ret = serve(argc, argv);
+	else
+	{
+		fprintf(stderr, "Unknown submodule!\n");
+		return -1;
+	}
+
+	if (!statsFile.empty())
+	{
+		int written = Stats::Write(statsFile, Stats::GetFormat(statsFile));
+		if (written != 0)
+			fprintf(stderr, "Failed to write %s: %d - %s\n", statsFile.c_str(), written, Stats::getErrorString(written).c_str());
+	}
 
-	printf("Unknown submodule!\n");
-	return -1;
+	return ret;
 }
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "kelfview.h"
+#include "fileio.h"
+
+int KelfView::Load(std::shared_ptr<KelfView> parsed, const void* data, size_t size, std::shared_ptr<const KelfView>& view)
+{
+	KELFHeader header;
+	int ret = parsed->kelf.ParseHeader((const uint8_t*)data, size, header);
+	if (ret != 0)
+		return ret;
+
+	if (size - header.HeaderSize < parsed->kelf.GetContentSize())
+		return KELF_ERROR_TRUNCATED;
+
+	parsed->content = (const uint8_t*)data + header.HeaderSize;
+	view = parsed;
+	return 0;
+}
+
+int KelfView::Load(std::shared_ptr<KelfView> parsed, std::string filename, std::shared_ptr<const KelfView>& view)
+{
+	std::shared_ptr<InputFile> in(new InputFile);
+	if (in->Open(filename) != 0)
+		return KELF_ERROR_OPEN_FAILED;
+	if (in->Load() != 0)
+		return KELF_ERROR_READ_FAILED;
+
+	parsed->file = in;
+	return Load(parsed, in->Data(), in->Size(), view);
+}
+
+int KelfView::Load(const CryptoContext& ctx, const void* data, size_t size, std::shared_ptr<const KelfView>& view)
+{
+	return Load(std::shared_ptr<KelfView>(new KelfView(ctx)), data, size, view);
+}
+
+int KelfView::Load(const KeyRing& ring, const void* data, size_t size, std::shared_ptr<const KelfView>& view)
+{
+	return Load(std::shared_ptr<KelfView>(new KelfView(ring)), data, size, view);
+}
+
+int KelfView::Load(const CryptoContext& ctx, std::string filename, std::shared_ptr<const KelfView>& view)
+{
+	return Load(std::shared_ptr<KelfView>(new KelfView(ctx)), filename, view);
+}
+
+int KelfView::Load(const KeyRing& ring, std::string filename, std::shared_ptr<const KelfView>& view)
+{
+	return Load(std::shared_ptr<KelfView>(new KelfView(ring)), filename, view);
+}
+
+int KelfView::Verify(unsigned threads) const
+{
+	return kelf.ProcessContent(content, NULL, true, true, threads);
+}
+
+int KelfView::Decrypt(void* output, size_t outputSize, unsigned threads) const
+{
+	if (outputSize < GetContentSize())
+		return KELF_ERROR_BUFFER_TOO_SMALL;
+
+	return kelf.ProcessContent(content, (uint8_t*)output, true, true, threads);
+}
+
+int KelfView::DecryptRange(uint64_t offset, size_t length, void* output, bool verify) const
+{
+	return kelf.DecryptRange(content, 0, offset, length, (uint8_t*)output, verify);
+}
+
+size_t KelfBuilder::GetKelfSize(size_t contentSize) const
+{
+	BitTable table;
+	uint32_t offsets[KELF_MAX_BLOCKS];
+	if (settings.BuildBitTable(contentSize, table, offsets) != 0)
+		return 0;
+
+	return table.HeaderSize + contentSize;
+}
+
+int KelfBuilder::Build(const void* content, size_t size, void* output, size_t outputSize) const
+{
+	// Keys and bit table of this file live in a copy of the settings.
+	Kelf kelf(settings);
+
+	uint32_t offsets[KELF_MAX_BLOCKS];
+	int ret = kelf.BuildBitTable(size, kelf.bitTable, offsets);
+	if (ret != 0)
+		return ret;
+
+	size_t HeaderSize = kelf.bitTable.HeaderSize;
+	if (outputSize < HeaderSize + size)
+		return KELF_ERROR_BUFFER_TOO_SMALL;
+
+	uint8_t* out = (uint8_t*)output;
+	memcpy(out + HeaderSize, content, size);
+	kelf.SealContent(out + HeaderSize, offsets);
+	kelf.WriteHeader(out);
+	return 0;
+}
+
+int KelfBuilder::Build(const void* content, size_t size, std::string& output) const
+{
+	output.resize(GetKelfSize(size));
+
+	// A size the layout can't cover fails in Build before the buffer is
+	// looked at.
+	int ret = Build(content, size, &output[0], output.size());
+	if (ret != 0)
+		output.clear();
+	return ret;
+}
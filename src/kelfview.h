@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __KELFVIEW_H__
+#define __KELFVIEW_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "kelf.h"
+
+class InputFile;
+
+// A parsed KELF whose header, bit table and root signatures checked out:
+// header, decrypted bit table, unwrapped content keys and a view of the
+// still encrypted content. Nothing changes after Load, so one view can be
+// verified and decrypted from any number of threads at once and is shared
+// through the shared_ptr Load hands out.
+class KelfView
+{
+	// Parsed state, only const members of it are called after Load.
+	Kelf kelf;
+	const uint8_t* content;
+	// Keeps the mapping alive for views of a file.
+	std::shared_ptr<InputFile> file;
+
+	KelfView(const CryptoContext& ctx) : kelf(ctx), content(NULL) { }
+	KelfView(const KeyRing& ring) : kelf(ring), content(NULL) { }
+
+	static int Load(std::shared_ptr<KelfView> parsed, const void* data, size_t size, std::shared_ptr<const KelfView>& view);
+	static int Load(std::shared_ptr<KelfView> parsed, std::string filename, std::shared_ptr<const KelfView>& view);
+
+public:
+	// Views of caller memory point into it, and it has to outlive them. A
+	// view of a file maps it for as long as the view lives.
+	static int Load(const CryptoContext& ctx, const void* data, size_t size, std::shared_ptr<const KelfView>& view);
+	static int Load(const KeyRing& ring, const void* data, size_t size, std::shared_ptr<const KelfView>& view);
+	static int Load(const CryptoContext& ctx, std::string filename, std::shared_ptr<const KelfView>& view);
+	static int Load(const KeyRing& ring, std::string filename, std::shared_ptr<const KelfView>& view);
+
+	const KELFHeader& GetHeader() const { return kelf.GetHeader(); }
+	const BitTable& GetBitTable() const { return kelf.GetBitTable(); }
+	int GetKeyCount() const { return kelf.GetKeyCount(); }
+	const uint8_t* GetSignature() const { return kelf.GetSignature(); }
+	std::string GetKeySetName() const { return kelf.GetKeySetName(); }
+	size_t GetContentSize() const { return kelf.GetContentSize(); }
+	// The content as it is in the file, encrypted.
+	const uint8_t* GetContent() const { return content; }
+
+	// Checks the content signatures, threads 0 for one per core.
+	int Verify(unsigned threads) const;
+	// Decrypts and verifies into output, which has to hold GetContentSize()
+	// bytes.
+	int Decrypt(void* output, size_t outputSize, unsigned threads) const;
+	// Decrypts length bytes from offset into output, touching only the
+	// ciphertext under them. Signatures of the blocks the range touches are
+	// only checked with verify.
+	int DecryptRange(uint64_t offset, size_t length, void* output, bool verify) const;
+};
+
+// Makes KELFs out of plain content. Keyset, layout, header template and
+// thread count are set up front; Build only reads them and the content and
+// works on state of its own, so one builder can be shared by a thread pool
+// once it is set up.
+class KelfBuilder
+{
+	// Settings, copied by every Build for its own state.
+	Kelf settings;
+
+public:
+	KelfBuilder(const CryptoContext& ctx) : settings(ctx) { }
+	KelfBuilder(const KeyRing& ring) : settings(ring) { }
+
+	// As the Kelf members of the same name.
+	int SetKeySet(const std::string& name) { return settings.SetKeySet(name); }
+	int SetLayout(const std::vector<KelfLayoutEntry>& entries) { return settings.SetLayout(entries); }
+	int SetHeaderTemplate(const KelfHeaderTemplate& header) { return settings.SetHeaderTemplate(header); }
+	void SetThreadCount(unsigned count) { settings.SetThreadCount(count); }
+
+	// Size of the KELF Build makes of contentSize bytes, 0 if the layout
+	// can't cover that much.
+	size_t GetKelfSize(size_t contentSize) const;
+
+	// Writes the KELF of content to output, sealing a copy of the content in
+	// place there.
+	int Build(const void* content, size_t size, void* output, size_t outputSize) const;
+	int Build(const void* content, size_t size, std::string& output) const;
+};
+
+#endif
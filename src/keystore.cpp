@@ -45,7 +45,7 @@ int char2int(char input)
 std::string hex2bin(const std::string& src)
 {
 	std::string hex;
-	for (int i = 0; i < src.size(); i += 2)
+	for (size_t i = 0; i < src.size(); i += 2)
 	{
 		char chr = char2int(src[i]) << 4 | char2int(src[i + 1]);
 		hex += chr;
@@ -53,47 +53,110 @@ std::string hex2bin(const std::string& src)
 	return hex;
 }
 
+int KeyStore::SetKey(const std::string& key, std::string value)
+{
+	if (value.size() % 2 != 0)
+		return KEYSTORE_ERROR_ODD_LEN_VALUE;
+
+	value = hex2bin(value);
+
+	if (key == "MG_SIG_MASTER_KEY") SignatureMasterKey = value;
+	if (key == "MG_SIG_HASH_KEY") SignatureHashKey = value;
+	if (key == "MG_KBIT_MASTER_KEY") KbitMasterKey = value;
+	if (key == "MG_KBIT_IV") KbitIV = value;
+	if (key == "MG_KC_MASTER_KEY") KcMasterKey = value;
+	if (key == "MG_KC_IV") KcIV = value;
+	if (key == "MG_ROOTSIG_MASTER_KEY") RootSignatureMasterKey = value;
+	if (key == "MG_ROOTSIG_HASH_KEY") RootSignatureHashKey = value;
+	if (key == "MG_CONTENT_TABLE_IV") ContentTableIV = value;
+	if (key == "MG_CONTENT_IV") ContentIV = value;
+
+	return 0;
+}
+
+int KeyStore::Check() const
+{
+	if (SignatureMasterKey.size() == 0 || SignatureHashKey.size() == 0 ||
+		KbitMasterKey.size() == 0 || KbitIV.size() == 0 ||
+		KcMasterKey.size() == 0 || KcIV.size() == 0 ||
+		RootSignatureMasterKey.size() == 0 || RootSignatureHashKey.size() == 0 ||
+		ContentTableIV.size() == 0 || ContentIV.size() == 0)
+		return KEYSTORE_ERROR_MISSING_KEY;
+
+	if (SignatureMasterKey.size() != 8 || SignatureHashKey.size() != 8 ||
+		KbitMasterKey.size() != 16 || KbitIV.size() != 8 ||
+		KcMasterKey.size() != 16 || KcIV.size() != 8 ||
+		RootSignatureMasterKey.size() != 8 || RootSignatureHashKey.size() != 16 ||
+		ContentTableIV.size() != 8 || ContentIV.size() != 8)
+		return KEYSTORE_ERROR_INVALID_KEY_SIZE;
+
+	return 0;
+}
+
 int KeyStore::Load(std::string filename)
+{
+	std::vector<KeyStore> keysets;
+	int ret = LoadKeySets(filename, keysets);
+	if (ret != 0)
+		return ret;
+
+	*this = keysets[0];
+	return 0;
+}
+
+int KeyStore::LoadKeySets(std::string filename, std::vector<KeyStore>& keysets)
 {
 	std::ifstream infile(filename);
 	if (infile.fail())
 		return KEYSTORE_ERROR_OPEN_FAILED;
 
+	keysets.clear();
+
 	std::string line;
 	while (std::getline(infile, line))
 	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+
+		if (line.size() > 2 && line.front() == '[' && line.back() == ']')
+		{
+			std::string name = line.substr(1, line.size() - 2);
+			for (const KeyStore& ks : keysets)
+				if (ks.Name == name)
+					return KEYSTORE_ERROR_DUPLICATE_KEYSET;
+			keysets.push_back(KeyStore());
+			keysets.back().Name = name;
+			continue;
+		}
+
 		std::vector<std::string> tokens = split(line, '=');
 
 		if (tokens.size() != 2)
 			return KEYSTORE_ERROR_LINE_NOT_KEY_VALUE;
 
-		std::string key = tokens[0];
-		std::string value = tokens[1];
-
-		if (value.size() % 2 != 0)
-			return KEYSTORE_ERROR_ODD_LEN_VALUE;
+		if (keysets.empty())
+		{
+			keysets.push_back(KeyStore());
+			keysets.back().Name = KEYSTORE_DEFAULT_KEYSET;
+		}
 
-		value = hex2bin(value);
-
-		if (key == "MG_SIG_MASTER_KEY") SignatureMasterKey = value;
-		if (key == "MG_SIG_HASH_KEY") SignatureHashKey = value;
-		if (key == "MG_KBIT_MASTER_KEY") KbitMasterKey = value;
-		if (key == "MG_KBIT_IV") KbitIV = value;
-		if (key == "MG_KC_MASTER_KEY") KcMasterKey = value;
-		if (key == "MG_KC_IV") KcIV = value;
-		if (key == "MG_ROOTSIG_MASTER_KEY") RootSignatureMasterKey = value;
-		if (key == "MG_ROOTSIG_HASH_KEY") RootSignatureHashKey = value;
-		if (key == "MG_CONTENT_TABLE_IV") ContentTableIV = value;
-		if (key == "MG_CONTENT_IV") ContentIV = value;
+		int ret = keysets.back().SetKey(tokens[0], tokens[1]);
+		if (ret != 0)
+			return ret;
 	}
 
-	if (SignatureMasterKey.size() == 0 || SignatureHashKey.size() == 0 ||
-		KbitMasterKey.size() == 0 || KbitIV.size() == 0 ||
-		KcMasterKey.size() == 0 || KcIV.size() == 0 ||
-		RootSignatureMasterKey.size() == 0 || RootSignatureHashKey.size() == 0 ||
-		ContentTableIV.size() == 0 || ContentIV.size() == 0)
+	if (keysets.empty())
 		return KEYSTORE_ERROR_MISSING_KEY;
 
+	for (const KeyStore& ks : keysets)
+	{
+		int ret = ks.Check();
+		if (ret != 0)
+			return ret;
+	}
+
 	return 0;
 }
 
@@ -106,6 +169,8 @@ std::string KeyStore::getErrorString(int err)
 	case KEYSTORE_ERROR_LINE_NOT_KEY_VALUE: return "Line in the keystore file is not key-value pair!";
 	case KEYSTORE_ERROR_ODD_LEN_VALUE: return "Odd length hex value in keystore!";
 	case KEYSTORE_ERROR_MISSING_KEY: return "Some keys are missing from the keystore!";
+	case KEYSTORE_ERROR_INVALID_KEY_SIZE: return "Some keys in the keystore have the wrong size!";
+	case KEYSTORE_ERROR_DUPLICATE_KEYSET: return "Keyset appears twice in the keystore!";
 	default: return "Unknown error";
 	}
 }
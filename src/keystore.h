@@ -18,14 +18,24 @@
 #define __KEYSTORE_H__
 
 #include <string>
+#include <vector>
 
 #define KEYSTORE_ERROR_OPEN_FAILED -1
 #define KEYSTORE_ERROR_LINE_NOT_KEY_VALUE -2
 #define KEYSTORE_ERROR_ODD_LEN_VALUE -3
 #define KEYSTORE_ERROR_MISSING_KEY -4
+#define KEYSTORE_ERROR_INVALID_KEY_SIZE -5
+#define KEYSTORE_ERROR_DUPLICATE_KEYSET -6
 
+// Name of the keyset made of the keys in front of the first [name] line.
+#define KEYSTORE_DEFAULT_KEYSET "default"
+
+// One keyset. A keystore file holds one or more of them, each starting with a
+// [name] line, e.g. [PS2], [PSX] and [COH]; a file without any is the single
+// keyset "default".
 class KeyStore
 {
+	std::string Name;
 	std::string SignatureMasterKey;
 	std::string SignatureHashKey;
 	std::string KbitMasterKey;
@@ -37,19 +47,28 @@ class KeyStore
 	std::string ContentTableIV;
 	std::string ContentIV;
 
+	int SetKey(const std::string& key, std::string value);
+	int Check() const;
+
 public:
+	// Loads the first keyset of the file.
 	int Load(std::string filename);
 
-	std::string GetSignatureMasterKey() { return SignatureMasterKey; }
-	std::string GetSignatureHashKey() { return SignatureHashKey; }
-	std::string GetKbitMasterKey() { return KbitMasterKey; }
-	std::string GetKbitIV() { return KbitIV; }
-	std::string GetKcMasterKey() { return KcMasterKey; }
-	std::string GetKcIV() { return KcIV; }
-	std::string GetRootSignatureMasterKey() { return RootSignatureMasterKey; }
-	std::string GetRootSignatureHashKey() { return RootSignatureHashKey; }
-	std::string GetContentTableIV() { return ContentTableIV; }
-	std::string GetContentIV() { return ContentIV; }
+	// Loads every keyset of the file in the order they appear.
+	static int LoadKeySets(std::string filename, std::vector<KeyStore>& keysets);
+
+	const std::string& GetName() const { return Name; }
+
+	const std::string& GetSignatureMasterKey() const { return SignatureMasterKey; }
+	const std::string& GetSignatureHashKey() const { return SignatureHashKey; }
+	const std::string& GetKbitMasterKey() const { return KbitMasterKey; }
+	const std::string& GetKbitIV() const { return KbitIV; }
+	const std::string& GetKcMasterKey() const { return KcMasterKey; }
+	const std::string& GetKcIV() const { return KcIV; }
+	const std::string& GetRootSignatureMasterKey() const { return RootSignatureMasterKey; }
+	const std::string& GetRootSignatureHashKey() const { return RootSignatureHashKey; }
+	const std::string& GetContentTableIV() const { return ContentTableIV; }
+	const std::string& GetContentIV() const { return ContentIV; }
 
 	static std::string getErrorString(int err);
 };
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "server.h"
+#include "cache.h"
+#include "kelf.h"
+#include "stats.h"
+#include "threadpool.h"
+
+static std::vector<std::string> split(const std::string& line)
+{
+	std::vector<std::string> fields;
+	size_t start = 0;
+	for (;;)
+	{
+		size_t end = line.find('\t', start);
+		fields.push_back(line.substr(start, end - start));
+		if (end == std::string::npos)
+			return fields;
+		start = end + 1;
+	}
+}
+
+int Server::Execute(const std::vector<std::string>& request, std::string& message)
+{
+	const std::string& command = request[1];
+	size_t args = request.size() - 2;
+
+	for (size_t i = 2; i < request.size(); i++)
+	{
+		if (request[i] != "stream" && (request[i].empty() || request[i][0] != '/'))
+		{
+			message = "Paths must be absolute";
+			return SERVER_ERROR_BAD_REQUEST;
+		}
+	}
+
+	// Requests already run in parallel on the pool, each one stays on its
+	// worker.
+	Kelf kelf(ring);
+	std::function<int()> work;
+	const std::string* output = NULL;
+	if (command == "decrypt" && (args == 2 || (args == 3 && request[4] == "stream")))
+	{
+		output = &request[3];
+		work = [&] {
+			if (args == 3)
+				return kelf.DecryptKelfStream(request[2], request[3]);
+
+			int ret = kelf.LoadKelf(request[2]);
+			if (ret == 0)
+				ret = kelf.SaveContent(request[3]);
+			return ret;
+		};
+	}
+	else if (command == "encrypt" && args == 2)
+	{
+		work = [&] { return kelf.EncryptKelfStream(request[2], request[3]); };
+	}
+	else if (command == "verify" && args == 1)
+		work = [&] { return kelf.VerifyKelf(request[2]); };
+	else
+	{
+		message = "Unknown request";
+		return SERVER_ERROR_BAD_REQUEST;
+	}
+
+	// Encrypting is not cached, its input is not a KELF.
+	int ret = cache && command != "encrypt" ? cache->Run(request[2], output, work) : work();
+	message = Kelf::getErrorString(ret);
+	return ret;
+}
+
+#ifndef _WIN32
+
+static std::string socketPath;
+
+static void onSignal(int)
+{
+	unlink(socketPath.c_str());
+	_exit(0);
+}
+
+static int writeAll(int fd, const std::string& data)
+{
+	size_t done = 0;
+	while (done < data.size())
+	{
+		ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+		if (n <= 0)
+			return SERVER_ERROR_IO_FAILED;
+		done += n;
+	}
+	return 0;
+}
+
+// Reads up to the next newline, keeping whatever follows it in buffer.
+static int readLine(int fd, std::string& buffer, std::string& line)
+{
+	for (;;)
+	{
+		size_t end = buffer.find('\n');
+		if (end != std::string::npos)
+		{
+			line = buffer.substr(0, end);
+			buffer.erase(0, end + 1);
+			return 0;
+		}
+
+		char chunk[4096];
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			return SERVER_ERROR_IO_FAILED;
+		buffer.append(chunk, n);
+	}
+}
+
+Server::~Server()
+{
+	if (listener >= 0)
+	{
+		close(listener);
+		unlink(path.c_str());
+	}
+}
+
+int Server::Listen(std::string socketPath)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path))
+		return SERVER_ERROR_SOCKET_FAILED;
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		return SERVER_ERROR_SOCKET_FAILED;
+
+	// A socket left behind by a previous instance would make bind fail.
+	unlink(socketPath.c_str());
+
+	// The daemon holds the keys, only its owner gets to talk to it.
+	mode_t mask = umask(0077);
+	int ret = bind(listener, (sockaddr*)&addr, sizeof(addr));
+	umask(mask);
+
+	if (ret != 0 || listen(listener, SOMAXCONN) != 0)
+	{
+		close(listener);
+		listener = -1;
+		return SERVER_ERROR_SOCKET_FAILED;
+	}
+
+	path = socketPath;
+	return 0;
+}
+
+int Server::Run(unsigned threadCount)
+{
+	if (listener < 0)
+		return SERVER_ERROR_SOCKET_FAILED;
+
+	socketPath = path;
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	ThreadPool pool(threadCount);
+
+	// A connection stays open as long as its reader or any of its requests
+	// still need it.
+	struct Connection
+	{
+		int fd;
+		std::mutex lock;
+
+		Connection(int _fd) : fd(_fd) { }
+		~Connection() { close(fd); }
+	};
+
+	for (;;)
+	{
+		int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		std::shared_ptr<Connection> connection = std::make_shared<Connection>(fd);
+
+		// Every connection gets a thread that only reads requests, the work
+		// itself goes to the pool so pipelined requests run in parallel.
+		std::thread([this, connection, &pool] {
+			std::string buffer;
+			std::string line;
+			while (readLine(connection->fd, buffer, line) == 0)
+			{
+				pool.Submit([this, connection, line] {
+					std::vector<std::string> request = split(line);
+
+					int result;
+					std::string message;
+					if (request.size() < 2)
+					{
+						result = SERVER_ERROR_BAD_REQUEST;
+						message = "Malformed request";
+					}
+					else
+						result = Execute(request, message);
+
+					STATS_RESULT(result);
+					if (!statsFile.empty())
+					{
+						static std::mutex statsLock;
+						std::lock_guard<std::mutex> guard(statsLock);
+						Stats::Write(statsFile, Stats::GetFormat(statsFile));
+					}
+
+					std::string response = request[0] + "\t" + std::to_string(result) + "\t" + message + "\n";
+					std::lock_guard<std::mutex> guard(connection->lock);
+					writeAll(connection->fd, response);
+				});
+			}
+		}).detach();
+	}
+
+	return 0;
+}
+
+Client::~Client()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+int Client::Connect(std::string socketPath)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path))
+		return SERVER_ERROR_CONNECT_FAILED;
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return SERVER_ERROR_SOCKET_FAILED;
+
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		fd = -1;
+		return SERVER_ERROR_CONNECT_FAILED;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+int Client::Send(const std::vector<std::string>& request, unsigned& id)
+{
+	id = nextId++;
+
+	std::string line = std::to_string(id);
+	for (const std::string& field : request)
+	{
+		if (field.find_first_of("\t\n") != std::string::npos)
+			return SERVER_ERROR_BAD_REQUEST;
+		line += "\t" + field;
+	}
+	line += "\n";
+
+	return writeAll(fd, line);
+}
+
+int Client::Receive(unsigned& id, int& result, std::string& message)
+{
+	std::string line;
+	if (readLine(fd, received, line) != 0)
+		return SERVER_ERROR_IO_FAILED;
+
+	std::vector<std::string> fields = split(line);
+	if (fields.size() < 3)
+		return SERVER_ERROR_IO_FAILED;
+
+	id = (unsigned)strtoul(fields[0].c_str(), NULL, 10);
+	result = atoi(fields[1].c_str());
+	message = fields[2];
+	return 0;
+}
+
+#else
+
+Server::~Server() { }
+int Server::Listen(std::string socketPath) { return SERVER_ERROR_UNSUPPORTED; }
+int Server::Run(unsigned threadCount) { return SERVER_ERROR_UNSUPPORTED; }
+Client::~Client() { }
+int Client::Connect(std::string socketPath) { return SERVER_ERROR_UNSUPPORTED; }
+int Client::Send(const std::vector<std::string>& request, unsigned& id) { return SERVER_ERROR_UNSUPPORTED; }
+int Client::Receive(unsigned& id, int& result, std::string& message) { return SERVER_ERROR_UNSUPPORTED; }
+
+#endif
+
+std::string Server::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case SERVER_ERROR_UNSUPPORTED: return "Not supported on this platform!";
+	case SERVER_ERROR_SOCKET_FAILED: return "Failed to set up socket!";
+	case SERVER_ERROR_CONNECT_FAILED: return "Failed to connect to server!";
+	case SERVER_ERROR_IO_FAILED: return "Connection to server lost!";
+	case SERVER_ERROR_BAD_REQUEST: return "Bad request!";
+	case SERVER_ERROR_BAD_RESPONSE: return "Bad response from server!";
+	default: return "Unknown error";
+	}
+}
+
+std::string Client::getErrorString(int err)
+{
+	return Server::getErrorString(err);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+
+class Cache;
+
+// Kept clear of the KELF_ERROR_* codes, which travel in responses and end
+// up as the exit code of forwarded commands.
+#define SERVER_ERROR_UNSUPPORTED -101
+#define SERVER_ERROR_SOCKET_FAILED -102
+#define SERVER_ERROR_CONNECT_FAILED -103
+#define SERVER_ERROR_IO_FAILED -104
+#define SERVER_ERROR_BAD_REQUEST -105
+#define SERVER_ERROR_BAD_RESPONSE -106
+
+// Requests and responses are single lines of tab separated fields:
+//   <id> <command> <arguments...>
+//   <id> <result> <message>
+// with the commands
+//   decrypt <input> <output> [stream]
+//   encrypt <input> <output>
+//   verify <input>
+// The result is 0, a KELF_ERROR_* code or SERVER_ERROR_BAD_REQUEST.
+// Paths have to be absolute. Requests of one connection may be pipelined
+// and are answered as they complete, matched up by id.
+#define SERVER_SOCKET_ENV "KELFTOOL_SOCKET"
+
+class Server
+{
+	const KeyRing& ring;
+	Cache* cache;
+	int listener;
+	std::string path;
+	std::string statsFile;
+
+	int Execute(const std::vector<std::string>& request, std::string& message);
+
+public:
+	Server(const KeyRing& _ring) : ring(_ring), cache(NULL), listener(-1) { }
+	~Server();
+
+	// Decrypt and verify requests go through cache when it is set.
+	void SetCache(Cache* _cache) { cache = _cache; }
+
+	// Rewrites the statistics file after every request, see Stats::Write.
+	void SetStatsFile(std::string filename) { statsFile = filename; }
+
+	int Listen(std::string socketPath);
+
+	// Serves connections until the process is terminated.
+	int Run(unsigned threadCount);
+
+	static std::string getErrorString(int err);
+};
+
+// Client side of the protocol, one request at a time or pipelined.
+class Client
+{
+	int fd;
+	std::string received;
+	unsigned nextId;
+
+public:
+	Client() : fd(-1), nextId(0) { }
+	~Client();
+
+	int Connect(std::string socketPath);
+
+	// Queues a request and returns its id.
+	int Send(const std::vector<std::string>& request, unsigned& id);
+
+	// Waits for the next response, in whatever order they complete.
+	int Receive(unsigned& id, int& result, std::string& message);
+
+	static std::string getErrorString(int err);
+};
+
+#endif
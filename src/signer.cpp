@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "signer.h"
+
+// CBC-MAC output is only needed for its last block, so whole blocks are
+// encrypted through this much stack space at a time.
+#define SIGNER_MAC_CHUNK_SIZE 0x400
+
+Signer::Signer(const CryptoContext& _ctx, int _mode) : ctx(&_ctx), mode(_mode)
+{
+	Reset();
+}
+
+void Signer::Reset()
+{
+	memset(state, 0, 8);
+	pendingLength = 0;
+}
+
+// Takes a whole number of blocks.
+void Signer::Chain(const uint8_t* data, size_t length)
+{
+	if (mode == SIGNER_MODE_XOR)
+	{
+		uint64_t hash;
+		memcpy(&hash, state, 8);
+		for (size_t i = 0; i < length; i += 8)
+		{
+			uint64_t value;
+			memcpy(&value, &data[i], 8);
+			hash ^= value;
+		}
+		memcpy(state, &hash, 8);
+		return;
+	}
+
+	const DesKey& key = mode == SIGNER_MODE_ROOT ? ctx->GetRootSignatureMasterKey() : ctx->GetSignatureMasterKey();
+
+	uint8_t output[SIGNER_MAC_CHUNK_SIZE];
+	while (length > 0)
+	{
+		size_t n = length < sizeof(output) ? length : sizeof(output);
+		TdesCbcCfb64Encrypt(output, data, n, key, state);
+		memcpy(state, &output[n - 8], 8);
+		data += n;
+		length -= n;
+	}
+}
+
+void Signer::Update(const void* data, size_t length)
+{
+	const uint8_t* p = (const uint8_t*)data;
+
+	if (pendingLength > 0)
+	{
+		size_t n = 8 - pendingLength < length ? 8 - pendingLength : length;
+		memcpy(&pending[pendingLength], p, n);
+		pendingLength += n;
+		p += n;
+		length -= n;
+
+		if (pendingLength < 8)
+			return;
+
+		Chain(pending, 8);
+		pendingLength = 0;
+	}
+
+	size_t whole = length & ~(size_t)7;
+	if (whole > 0)
+		Chain(p, whole);
+
+	pendingLength = length - whole;
+	memcpy(pending, &p[whole], pendingLength);
+}
+
+void Signer::Merge(const Signer& other)
+{
+	Signer flushed = other;
+	if (flushed.pendingLength > 0)
+	{
+		memset(&flushed.pending[flushed.pendingLength], 0, 8 - flushed.pendingLength);
+		flushed.Chain(flushed.pending, 8);
+	}
+
+	for (int i = 0; i < 8; i++)
+		state[i] ^= flushed.state[i];
+}
+
+void Signer::SetState(const uint8_t* value)
+{
+	memcpy(state, value, 8);
+	pendingLength = 0;
+}
+
+void Signer::Final(uint8_t* signature)
+{
+	if (pendingLength > 0)
+	{
+		memset(&pending[pendingLength], 0, 8 - pendingLength);
+		Chain(pending, 8);
+		pendingLength = 0;
+	}
+
+	memcpy(signature, state, 8);
+
+	switch (mode)
+	{
+	case SIGNER_MODE_XOR:
+		TdesCbcCfb64Encrypt(signature, signature, 8, ctx->GetSignatureMasterAndHashKey(), MG_IV_NULL);
+		break;
+	case SIGNER_MODE_MAC:
+		TdesCbcCfb64Decrypt(signature, signature, 8, ctx->GetSignatureHashKey(), MG_IV_NULL);
+		TdesCbcCfb64Encrypt(signature, signature, 8, ctx->GetSignatureMasterKey(), MG_IV_NULL);
+		break;
+	case SIGNER_MODE_ROOT:
+		TdesCbcCfb64Decrypt(signature, signature, 8, ctx->GetRootSignatureHashKey(), MG_IV_NULL);
+		break;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SIGNER_H__
+#define __SIGNER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypto.h"
+
+// XOR of all 8 byte blocks, encrypted with the signature master and hash
+// keys. Used for the bit table and encrypted content blocks.
+#define SIGNER_MODE_XOR 0
+// CBC-MAC with the signature master key, then decrypted with the hash key
+// and encrypted with the master key again. Used for the header and plain
+// content blocks.
+#define SIGNER_MODE_MAC 1
+// CBC-MAC with the root signature master key, decrypted with the root
+// signature hash key. Used for the root signature.
+#define SIGNER_MODE_ROOT 2
+
+// Incremental KELF signature: data can be fed in pieces of any size as it
+// is read, only the 8 byte chaining state and a partial block are kept.
+// A trailing partial block is zero padded.
+class Signer
+{
+	const CryptoContext* ctx;
+	int mode;
+	uint8_t state[8];
+	uint8_t pending[8];
+	size_t pendingLength;
+
+	void Chain(const uint8_t* data, size_t length);
+
+public:
+	Signer(const CryptoContext& _ctx, int _mode);
+
+	void Reset();
+	void Update(const void* data, size_t length);
+
+	// Folds in the state of a signer that ran over another part of the same
+	// data. Only meaningful in XOR mode where the order does not matter, or
+	// to take over the state of another signer from a fresh one.
+	void Merge(const Signer& other);
+
+	// Replaces the chaining state with one computed elsewhere, e.g. a CBC-MAC
+	// of the whole data.
+	void SetState(const uint8_t* value);
+
+	void Final(uint8_t* signature);
+};
+
+#endif
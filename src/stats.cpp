@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+
+#include <filesystem>
+
+#include "stats.h"
+
+namespace fs = std::filesystem;
+
+std::atomic<bool> Stats::enabled(false);
+Stats::Stage Stats::stages[STAT_COUNT];
+std::atomic<uint64_t> Stats::allocations(0);
+std::atomic<uint64_t> Stats::allocatedBytes(0);
+std::atomic<uint64_t> Stats::results[STATS_MAX_RESULT_CODES + 2];
+std::chrono::steady_clock::time_point Stats::started;
+
+void Stats::Enable()
+{
+	started = std::chrono::steady_clock::now();
+	enabled = true;
+}
+
+void Stats::AddStage(StatStage stage, uint64_t nanoseconds, uint64_t bytes)
+{
+	stages[stage].Nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+	stages[stage].Calls.fetch_add(1, std::memory_order_relaxed);
+	stages[stage].Bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Stats::CountAllocation(size_t size)
+{
+	if (!IsEnabled())
+		return;
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void Stats::CountResult(int result)
+{
+	if (!IsEnabled())
+		return;
+
+	// The last slot collects everything out of range.
+	int index = -result;
+	if (index < 0 || index > STATS_MAX_RESULT_CODES)
+		index = STATS_MAX_RESULT_CODES + 1;
+	results[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+const char* Stats::GetStageName(StatStage stage)
+{
+	switch (stage)
+	{
+	case STAT_READ: return "read";
+	case STAT_WRITE: return "write";
+	case STAT_HEADER_SIGNATURE: return "header_signature";
+	case STAT_KEY_DERIVATION: return "key_derivation";
+	case STAT_BIT_TABLE: return "bit_table";
+	case STAT_DECRYPT: return "decrypt";
+	case STAT_VERIFY: return "verify";
+	case STAT_ENCRYPT: return "encrypt";
+	default:
+		return "unknown";
+	}
+}
+
+static std::string resultLabel(int index)
+{
+	return index > STATS_MAX_RESULT_CODES ? "other" : std::to_string(-index);
+}
+
+std::string Stats::Format(int format)
+{
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	char line[1024];
+	std::string out;
+
+	if (format == STATS_FORMAT_PROMETHEUS)
+	{
+		out += "# HELP kelftool_stage_seconds_total Wall time spent per stage.\n";
+		out += "# TYPE kelftool_stage_seconds_total counter\n";
+		for (int i = 0; i < STAT_COUNT; i++)
+		{
+			snprintf(line, sizeof(line), "kelftool_stage_seconds_total{stage=\"%s\"} %.9f\n", GetStageName((StatStage)i), stages[i].Nanoseconds / 1e9);
+			out += line;
+		}
+		out += "# HELP kelftool_stage_calls_total Times a stage ran.\n";
+		out += "# TYPE kelftool_stage_calls_total counter\n";
+		for (int i = 0; i < STAT_COUNT; i++)
+		{
+			snprintf(line, sizeof(line), "kelftool_stage_calls_total{stage=\"%s\"} %llu\n", GetStageName((StatStage)i), (unsigned long long)stages[i].Calls);
+			out += line;
+		}
+		out += "# HELP kelftool_stage_bytes_total Bytes a stage processed.\n";
+		out += "# TYPE kelftool_stage_bytes_total counter\n";
+		for (int i = 0; i < STAT_COUNT; i++)
+		{
+			snprintf(line, sizeof(line), "kelftool_stage_bytes_total{stage=\"%s\"} %llu\n", GetStageName((StatStage)i), (unsigned long long)stages[i].Bytes);
+			out += line;
+		}
+		out += "# HELP kelftool_results_total Files processed by result code, 0 is success.\n";
+		out += "# TYPE kelftool_results_total counter\n";
+		for (int i = 0; i <= STATS_MAX_RESULT_CODES + 1; i++)
+		{
+			if (results[i] == 0)
+				continue;
+			snprintf(line, sizeof(line), "kelftool_results_total{code=\"%s\"} %llu\n", resultLabel(i).c_str(), (unsigned long long)results[i]);
+			out += line;
+		}
+		snprintf(line, sizeof(line),
+			"# HELP kelftool_allocations_total Heap allocations.\n"
+			"# TYPE kelftool_allocations_total counter\n"
+			"kelftool_allocations_total %llu\n"
+			"# HELP kelftool_allocated_bytes_total Heap bytes allocated.\n"
+			"# TYPE kelftool_allocated_bytes_total counter\n"
+			"kelftool_allocated_bytes_total %llu\n"
+			"# HELP kelftool_elapsed_seconds Wall time since recording started.\n"
+			"# TYPE kelftool_elapsed_seconds gauge\n"
+			"kelftool_elapsed_seconds %.6f\n",
+			(unsigned long long)allocations, (unsigned long long)allocatedBytes, elapsed);
+		out += line;
+		return out;
+	}
+
+	snprintf(line, sizeof(line), "{\"elapsed\":%.6f,\"stages\":{", elapsed);
+	out += line;
+	for (int i = 0; i < STAT_COUNT; i++)
+	{
+		double seconds = stages[i].Nanoseconds / 1e9;
+		snprintf(line, sizeof(line), "%s\"%s\":{\"seconds\":%.9f,\"calls\":%llu,\"bytes\":%llu,\"mib_per_second\":%.2f}",
+			i ? "," : "", GetStageName((StatStage)i), seconds, (unsigned long long)stages[i].Calls, (unsigned long long)stages[i].Bytes,
+			seconds > 0 ? stages[i].Bytes / seconds / (1024 * 1024) : 0.0);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "},\"allocations\":%llu,\"allocated_bytes\":%llu,\"results\":{",
+		(unsigned long long)allocations, (unsigned long long)allocatedBytes);
+	out += line;
+	bool first = true;
+	for (int i = 0; i <= STATS_MAX_RESULT_CODES + 1; i++)
+	{
+		if (results[i] == 0)
+			continue;
+		snprintf(line, sizeof(line), "%s\"%s\":%llu", first ? "" : ",", resultLabel(i).c_str(), (unsigned long long)results[i]);
+		out += line;
+		first = false;
+	}
+	out += "}}\n";
+	return out;
+}
+
+int Stats::GetFormat(const std::string& filename)
+{
+	const std::string suffix = ".prom";
+	if (filename.size() >= suffix.size() && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0)
+		return STATS_FORMAT_PROMETHEUS;
+	return STATS_FORMAT_JSON;
+}
+
+int Stats::Write(std::string filename, int format)
+{
+	std::string text = Format(format);
+	if (filename == "-")
+	{
+		fputs(text.c_str(), stdout);
+		return 0;
+	}
+
+	std::string temporary = filename + ".tmp";
+	FILE* f = fopen(temporary.c_str(), "w");
+	if (f == NULL)
+		return STATS_ERROR_WRITE_FAILED;
+	bool written = fwrite(text.data(), 1, text.size(), f) == text.size();
+	written = fclose(f) == 0 && written;
+
+	std::error_code ec;
+	if (written)
+		fs::rename(temporary, filename, ec);
+	if (!written || ec)
+	{
+		fs::remove(temporary, ec);
+		return STATS_ERROR_WRITE_FAILED;
+	}
+	return 0;
+}
+
+std::string Stats::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case STATS_ERROR_WRITE_FAILED: return "Failed to write statistics!";
+	default:
+		return "Unknown error!";
+	}
+}
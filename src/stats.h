@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#define STATS_ERROR_WRITE_FAILED -1
+
+#define STATS_FORMAT_JSON 0
+#define STATS_FORMAT_PROMETHEUS 1
+
+// Result codes from 0 down to this are counted one by one, anything below
+// in one bucket.
+#define STATS_MAX_RESULT_CODES 32
+
+enum StatStage
+{
+	STAT_READ,
+	STAT_WRITE,
+	STAT_HEADER_SIGNATURE, // GetHeaderSignature
+	STAT_KEY_DERIVATION, // DeriveKeyEncryptionKey and unwrapping Kbit/Kc
+	STAT_BIT_TABLE, // decrypting the bit table, its and the root signature
+	STAT_DECRYPT, // content decryption, including the signature check fused into it
+	STAT_VERIFY, // content signature check without keeping the plain content
+	STAT_ENCRYPT, // content encryption and signing
+	STAT_COUNT
+};
+
+// Process wide counters: wall time, calls and bytes per stage, allocations
+// and results by code. Nothing is recorded until Enable() is called, and
+// building with KELF_NO_STATS removes every hook, leaving the STATS_* macros
+// empty.
+class Stats
+{
+	struct Stage
+	{
+		std::atomic<uint64_t> Nanoseconds;
+		std::atomic<uint64_t> Calls;
+		std::atomic<uint64_t> Bytes;
+	};
+
+	static std::atomic<bool> enabled;
+	static Stage stages[STAT_COUNT];
+	static std::atomic<uint64_t> allocations;
+	static std::atomic<uint64_t> allocatedBytes;
+	static std::atomic<uint64_t> results[STATS_MAX_RESULT_CODES + 2];
+	static std::chrono::steady_clock::time_point started;
+
+public:
+	static void Enable();
+	static bool IsEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+	static void AddStage(StatStage stage, uint64_t nanoseconds, uint64_t bytes);
+	static void CountAllocation(size_t size);
+	// 0 for success or one of the negative error codes.
+	static void CountResult(int result);
+
+	static std::string Format(int format);
+	// Prometheus for *.prom files, JSON for everything else.
+	static int GetFormat(const std::string& filename);
+	// Replaces filename atomically, so a scraper never sees half a file.
+	// "-" prints to stdout.
+	static int Write(std::string filename, int format);
+
+	static const char* GetStageName(StatStage stage);
+	static std::string getErrorString(int err);
+};
+
+// Adds the time between construction and destruction to a stage.
+class StatTimer
+{
+	StatStage stage;
+	uint64_t bytes;
+	bool running;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	StatTimer(StatStage _stage, uint64_t _bytes) : stage(_stage), bytes(_bytes), running(Stats::IsEnabled())
+	{
+		if (running)
+			start = std::chrono::steady_clock::now();
+	}
+
+	~StatTimer()
+	{
+		if (running)
+			Stats::AddStage(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), bytes);
+	}
+};
+
+#ifndef KELF_NO_STATS
+#define STATS_CONCAT2(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT2(a, b)
+#define STATS_TIMER(stage, bytes) StatTimer STATS_CONCAT(statTimer, __LINE__)(stage, bytes)
+#define STATS_RESULT(result) Stats::CountResult(result)
+#define STATS_ADD(stage, nanoseconds, bytes) do { if (Stats::IsEnabled()) Stats::AddStage(stage, nanoseconds, bytes); } while (0)
+#else
+#define STATS_TIMER(stage, bytes) ((void)0)
+#define STATS_RESULT(result) ((void)0)
+#define STATS_ADD(stage, nanoseconds, bytes) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "threadpool.h"
+
+static thread_local ThreadPool* currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+ThreadPool::ThreadPool(unsigned threadCount)
+	: queued(0), pending(0), next(0), stopping(false)
+{
+	if (threadCount == 0)
+		threadCount = GetDefaultThreadCount();
+
+	for (unsigned i = 0; i < threadCount; i++)
+		workers.push_back(std::make_unique<Worker>());
+
+	for (unsigned i = 0; i < threadCount; i++)
+		threads.emplace_back(&ThreadPool::Run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(idleLock);
+		stopping = true;
+	}
+	idle.notify_all();
+
+	for (auto& thread : threads)
+		thread.join();
+}
+
+unsigned ThreadPool::GetDefaultThreadCount()
+{
+	unsigned count = std::thread::hardware_concurrency();
+	return count ? count : 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, unsigned threadCount, const std::function<void(size_t)>& fn)
+{
+	if (threadCount == 0)
+		threadCount = GetDefaultThreadCount();
+	if (threadCount > count)
+		threadCount = (unsigned)count;
+
+	std::atomic<size_t> index(0);
+	auto run = [&] {
+		for (size_t i = index++; i < count; i = index++)
+			fn(i);
+	};
+
+	std::vector<std::thread> helpers;
+	for (unsigned i = 1; i < threadCount; i++)
+		helpers.emplace_back(run);
+
+	run();
+
+	for (auto& helper : helpers)
+		helper.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	// Work spawned from inside the pool stays on the spawning worker so it is
+	// run while still hot; everything else is spread round-robin.
+	size_t target;
+	if (currentPool == this)
+		target = currentWorker;
+	else
+		target = next++ % workers.size();
+
+	pending++;
+	{
+		std::lock_guard<std::mutex> guard(workers[target]->lock);
+		workers[target]->tasks.push_back(std::move(task));
+		queued++;
+	}
+
+	// Taking the idle lock orders the update against a worker that is about
+	// to go to sleep, so the notification cannot be lost.
+	{
+		std::lock_guard<std::mutex> guard(idleLock);
+	}
+	idle.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+	std::unique_lock<std::mutex> guard(idleLock);
+	done.wait(guard, [this] { return pending == 0; });
+}
+
+bool ThreadPool::Pop(size_t self, std::function<void()>& task)
+{
+	{
+		Worker& own = *workers[self];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			queued--;
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < workers.size(); i++)
+	{
+		Worker& victim = *workers[(self + i) % workers.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::Run(size_t self)
+{
+	currentPool = this;
+	currentWorker = self;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> guard(idleLock);
+			idle.wait(guard, [this] { return queued > 0 || stopping; });
+			if (queued == 0 && stopping)
+				return;
+		}
+
+		std::function<void()> task;
+		if (!Pop(self, task))
+			continue;
+
+		task();
+
+		if (--pending == 0)
+		{
+			std::lock_guard<std::mutex> guard(idleLock);
+			done.notify_all();
+		}
+	}
+}
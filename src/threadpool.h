@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool: every worker owns a deque, pops its own work from the
+// back and steals from the front of the other workers' deques when idle.
+class ThreadPool
+{
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	std::mutex idleLock;
+	std::condition_variable idle;
+	std::condition_variable done;
+	std::atomic<size_t> queued;
+	std::atomic<size_t> pending;
+	std::atomic<size_t> next;
+	bool stopping;
+
+	bool Pop(size_t self, std::function<void()>& task);
+	void Run(size_t self);
+
+public:
+	ThreadPool(unsigned threadCount = 0);
+	~ThreadPool();
+
+	void Submit(std::function<void()> task);
+	void Wait();
+
+	unsigned GetThreadCount() const { return (unsigned)threads.size(); }
+
+	static unsigned GetDefaultThreadCount();
+
+	// Runs fn(0) .. fn(count - 1) on up to threadCount threads, including the
+	// calling one, and returns once all of them are done.
+	static void ParallelFor(size_t count, unsigned threadCount, const std::function<void(size_t)>& fn);
+};
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "uring.h"
+
+Uring::Uring()
+	: fd(-1), entries(0), sqRing(NULL), sqRingSize(0), cqRing(NULL), cqRingSize(0), sqeMemory(NULL), sqeMemorySize(0),
+	sqHead(NULL), sqTail(NULL), sqMask(0), sqArray(NULL), cqHead(NULL), cqTail(NULL), cqMask(0), cqes(NULL),
+	queued(0), registered(false)
+{
+}
+
+#ifdef __linux__
+
+Uring::~Uring()
+{
+	if (sqeMemory)
+		munmap(sqeMemory, sqeMemorySize);
+	if (cqRing && cqRing != sqRing)
+		munmap(cqRing, cqRingSize);
+	if (sqRing)
+		munmap(sqRing, sqRingSize);
+	if (fd >= 0)
+		close(fd);
+}
+
+int Uring::Init(unsigned queueDepth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	fd = (int)syscall(__NR_io_uring_setup, queueDepth, &params);
+	if (fd < 0)
+		return URING_ERROR_UNSUPPORTED;
+	entries = params.sq_entries;
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cqRingSize > sqRingSize)
+		sqRingSize = cqRingSize;
+
+	void* ring = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		return URING_ERROR_SETUP_FAILED;
+	sqRing = ring;
+
+	if (single)
+		cqRing = sqRing;
+	else
+	{
+		ring = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring == MAP_FAILED)
+			return URING_ERROR_SETUP_FAILED;
+		cqRing = ring;
+	}
+
+	sqeMemorySize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring = mmap(NULL, sqeMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring == MAP_FAILED)
+		return URING_ERROR_SETUP_FAILED;
+	sqeMemory = ring;
+
+	uint8_t* sq = (uint8_t*)sqRing;
+	sqHead = (unsigned*)(sq + params.sq_off.head);
+	sqTail = (unsigned*)(sq + params.sq_off.tail);
+	sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	sqArray = (unsigned*)(sq + params.sq_off.array);
+
+	uint8_t* cq = (uint8_t*)cqRing;
+	cqHead = (unsigned*)(cq + params.cq_off.head);
+	cqTail = (unsigned*)(cq + params.cq_off.tail);
+	cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+
+	return 0;
+}
+
+bool Uring::RegisterBuffers(void* base, size_t size, unsigned count)
+{
+	struct iovec vectors[1024];
+	if (count > sizeof(vectors) / sizeof(vectors[0]))
+		return false;
+	for (unsigned i = 0; i < count; i++)
+	{
+		vectors[i].iov_base = (uint8_t*)base + i * size;
+		vectors[i].iov_len = size;
+	}
+
+	registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, vectors, count) == 0;
+	return registered;
+}
+
+int Uring::Prepare(int opcode, int file, void* buffer, unsigned length, uint64_t offset, int bufferIndex, unsigned flags, uint64_t userData)
+{
+	// The kernel moves the head as it consumes entries.
+	unsigned tail = *sqTail;
+	if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries)
+		return URING_ERROR_QUEUE_FULL;
+
+	unsigned index = tail & sqMask;
+	struct io_uring_sqe* sqe = (struct io_uring_sqe*)sqeMemory + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = file;
+	sqe->off = offset;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = length;
+	sqe->rw_flags = flags;
+	sqe->user_data = userData;
+	if (bufferIndex >= 0)
+	{
+		sqe->opcode = opcode == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = bufferIndex;
+	}
+
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+	return 0;
+}
+
+int Uring::Read(int file, void* buffer, unsigned length, uint64_t offset, int bufferIndex, uint64_t userData)
+{
+	return Prepare(IORING_OP_READ, file, buffer, length, offset, registered ? bufferIndex : -1, 0, userData);
+}
+
+int Uring::Write(int file, const void* buffer, unsigned length, uint64_t offset, int bufferIndex, uint64_t userData)
+{
+	return Prepare(IORING_OP_WRITE, file, (void*)buffer, length, offset, registered ? bufferIndex : -1, 0, userData);
+}
+
+int Uring::Sync(int file, uint64_t userData)
+{
+	return Prepare(IORING_OP_FSYNC, file, NULL, 0, 0, -1, IORING_FSYNC_DATASYNC, userData);
+}
+
+bool Uring::Peek(uint64_t& userData, int& result)
+{
+	unsigned head = *cqHead;
+	if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		return false;
+
+	struct io_uring_cqe* cqe = (struct io_uring_cqe*)cqes + (head & cqMask);
+	userData = cqe->user_data;
+	result = cqe->res;
+	__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+int Uring::Wait(uint64_t& userData, int& result)
+{
+	for (;;)
+	{
+		if (queued == 0 && Peek(userData, result))
+			return 0;
+
+		int submitted = (int)syscall(__NR_io_uring_enter, fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return URING_ERROR_SUBMIT_FAILED;
+		}
+		queued -= submitted;
+
+		if (Peek(userData, result))
+			return 0;
+	}
+}
+
+bool Uring::IsSupported()
+{
+	Uring ring;
+	return ring.Init(2) == 0;
+}
+
+#else
+
+Uring::~Uring() { }
+int Uring::Init(unsigned queueDepth) { return URING_ERROR_UNSUPPORTED; }
+bool Uring::RegisterBuffers(void* base, size_t size, unsigned count) { return false; }
+int Uring::Prepare(int opcode, int file, void* buffer, unsigned length, uint64_t offset, int bufferIndex, unsigned flags, uint64_t userData) { return URING_ERROR_UNSUPPORTED; }
+int Uring::Read(int file, void* buffer, unsigned length, uint64_t offset, int bufferIndex, uint64_t userData) { return URING_ERROR_UNSUPPORTED; }
+int Uring::Write(int file, const void* buffer, unsigned length, uint64_t offset, int bufferIndex, uint64_t userData) { return URING_ERROR_UNSUPPORTED; }
+int Uring::Sync(int file, uint64_t userData) { return URING_ERROR_UNSUPPORTED; }
+bool Uring::Peek(uint64_t& userData, int& result) { return false; }
+int Uring::Wait(uint64_t& userData, int& result) { return URING_ERROR_UNSUPPORTED; }
+bool Uring::IsSupported() { return false; }
+
+#endif
+
+std::string Uring::getErrorString(int err)
+{
+	switch (err)
+	{
+	case 0: return "Success";
+	case URING_ERROR_UNSUPPORTED: return "io_uring is not supported!";
+	case URING_ERROR_SETUP_FAILED: return "Failed to set up io_uring!";
+	case URING_ERROR_QUEUE_FULL: return "Submission queue is full!";
+	case URING_ERROR_SUBMIT_FAILED: return "Failed to submit to io_uring!";
+	default:
+		return "Unknown error!";
+	}
+}
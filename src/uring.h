@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019 xfwcfw
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#define URING_ERROR_UNSUPPORTED -1
+#define URING_ERROR_SETUP_FAILED -2
+#define URING_ERROR_QUEUE_FULL -3
+#define URING_ERROR_SUBMIT_FAILED -4
+
+// Minimal io_uring binding on the raw system calls, just reads and writes
+// at an offset with optional registered buffers, and syncs. Not thread safe, one
+// thread owns the ring. Everywhere but Linux Init fails and callers take
+// their synchronous path.
+class Uring
+{
+	int fd;
+	unsigned entries;
+	void* sqRing;
+	size_t sqRingSize;
+	void* cqRing;
+	size_t cqRingSize;
+	void* sqeMemory;
+	size_t sqeMemorySize;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	void* cqes;
+	unsigned queued;
+	bool registered;
+
+	int Prepare(int opcode, int file, void* buffer, unsigned length, uint64_t offset, int bufferIndex, unsigned flags, uint64_t userData);
+
+public:
+	Uring();
+	~Uring();
+
+	int Init(unsigned queueDepth);
+
+	// Registers count buffers of size bytes starting at base, referred to by
+	// index afterwards. Fails without harm when the memlock limit is too low.
+	bool RegisterBuffers(void* base, size_t size, unsigned count);
+	bool HasRegisteredBuffers() const { return registered; }
+
+	// Queue a read or write, bufferIndex -1 for an unregistered buffer.
+	int Read(int file, void* buffer, unsigned length, uint64_t offset, int bufferIndex, uint64_t userData);
+	int Write(int file, const void* buffer, unsigned length, uint64_t offset, int bufferIndex, uint64_t userData);
+
+	// Queue an fdatasync of file, result is 0 or a negative errno.
+	int Sync(int file, uint64_t userData);
+
+	// Submits what is queued and waits for at least one completion, result
+	// is the byte count or a negative errno.
+	int Wait(uint64_t& userData, int& result);
+
+	// Completions already available, without entering the kernel.
+	bool Peek(uint64_t& userData, int& result);
+
+	static bool IsSupported();
+	static std::string getErrorString(int err);
+};
+
+#endif